@@ -63,7 +63,7 @@ int main(int argc, char **argv) {
         fixed_size_ht.insert(key_nolog, 1026, false, false);
 
         // Usually, you would create a checkpoint after having bulk loaded millions of records.
-        fixed_size_ht.checkpoint(32); //TODO: Thread count currently needs to be a power of 2.
+        fixed_size_ht.checkpoint(32);
 
     }
 
@@ -55,18 +55,22 @@ int main(int argc, char** argv) {
     uint64_t curr_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
     std::cout << "========== Insert time: " << (curr_ms * 1.0) / 1000  << " s ==========" << std::endl;
 
-    std::unique_ptr<uint8_t[]> content = std::make_unique<uint8_t[]>(10e6);
-
     table.count();
 
     std::string key = path + "/052/05206.txt";
+    std::span<std::byte> key_span(reinterpret_cast<std::byte*>(key.data()), key.size());
 
+    // The view keeps the value it found even if the key is updated meanwhile, a buffer sized with value_size() could
+    // be too small by the time lookup() fills it
+    auto view = table.lookup_view(key_span);
 
-    bool found = table.lookup(std::span<std::byte>(reinterpret_cast<std::byte*>(key.data()), key.size()), content.get());
-
-    std::cout << found << std::endl;
+    std::cout << view.has_value() << std::endl;
 
-    std::cout << content << std::endl;
+    if (view) {
+        std::span<const std::byte> value = view->value();
+        std::string content(reinterpret_cast<const char*>(value.data()), value.size());
+        std::cout << content << std::endl;
+    }
 
 
     return 0;
@@ -0,0 +1,104 @@
+//
+// Compares the scalar and the AVX-512 filter that log compaction and recovery run over the entries of full WAL chunks.
+//
+// Usage: log_scan_benchmark [pmem_dir] [repetitions]
+//
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include "../hashtable/Hashtable.h"
+
+class LogScanBenchmark {
+public:
+    using Table = Hashtable<uint64_t, uint64_t, PartitionType::Hash>;
+
+    explicit LogScanBenchmark(const std::string &pmem_dir) : table(pmem_dir, true) {}
+
+    // Fills chunk 0 of every log, which is free in a new table, and gives the DRAM directory entries random epochs,
+    // so that some of the entries count as migrated already
+    void fill_chunks() {
+        std::mt19937_64 rng(42);
+        for (int i = 0; i < table.DRAM_DIRECTORY_SIZE; ++i) {
+            table.dram_table[i].epoch = static_cast<int>(rng() % MAX_EPOCH);
+        }
+
+        for (int log_idx = 0; log_idx < table.LOG_NUM; ++log_idx) {
+            Table::Log &log = table.logs[log_idx];
+            bool valid_bit = log.persistent_state->valid_bits[0];
+            for (long pos = 0; pos < Table::MAX_LOG_ENTRIES; ++pos) {
+                // Every 16th entry is torn, i.e. has the wrong valid bit
+                bool torn = pos % 16 == 15;
+                log.chunks[0].entries[pos].persist(rng(), pos, static_cast<int>(rng() % MAX_EPOCH), valid_bit != torn);
+            }
+        }
+    }
+
+    // Both filters have to agree on every batch of 8 entries
+    bool verify() {
+        for (int log_idx = 0; log_idx < table.LOG_NUM; ++log_idx) {
+            Table::Log &log = table.logs[log_idx];
+            bool valid_bit = log.persistent_state->valid_bits[0];
+            for (long pos = 0; pos + 8 <= Table::MAX_LOG_ENTRIES; pos += 8) {
+                __mmask8 simd_valid;
+                __mmask8 scalar_valid;
+                __mmask8 simd_live = table.filter_log_entries(log.chunks[0].entries + pos, valid_bit, &simd_valid);
+                __mmask8 scalar_live = table.filter_log_entries_scalar(log.chunks[0].entries + pos, 8, valid_bit, &scalar_valid);
+                if (simd_live != scalar_live || simd_valid != scalar_valid) {
+                    std::cout << "Filters disagree at log " << log_idx << ", entry " << pos << std::endl;
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    template <bool simd>
+    void run(int repetitions) {
+        uint64_t live_entries = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int rep = 0; rep < repetitions; ++rep) {
+            for (int log_idx = 0; log_idx < table.LOG_NUM; ++log_idx) {
+                Table::Log &log = table.logs[log_idx];
+                bool valid_bit = log.persistent_state->valid_bits[0];
+                for (long pos = 0; pos + 8 <= Table::MAX_LOG_ENTRIES; pos += 8) {
+                    __mmask8 valid;
+                    __mmask8 live;
+                    if constexpr (simd) {
+                        live = table.filter_log_entries(log.chunks[0].entries + pos, valid_bit, &valid);
+                    } else {
+                        live = table.filter_log_entries_scalar(log.chunks[0].entries + pos, 8, valid_bit, &valid);
+                    }
+                    live_entries += __builtin_popcount(live);
+                }
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+
+        double entries = static_cast<double>(repetitions) * table.LOG_NUM * (Table::MAX_LOG_ENTRIES / 8 * 8);
+        double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        std::cout << (simd ? "AVX-512" : "Scalar ") << " filter: " << ns / entries << " ns per entry, "
+                  << entries / ns * 1e3 << " M entries/s, " << live_entries / repetitions << " live entries" << std::endl;
+    }
+
+private:
+    static constexpr int MAX_EPOCH = 4;
+
+    Table table;
+};
+
+int main(int argc, char **argv) {
+    std::string pmem_dir = argc > 1 ? argv[1] : "/mnt/pmem0/vogel/tabletest";
+    int repetitions = argc > 2 ? std::stoi(argv[2]) : 5;
+
+    LogScanBenchmark benchmark(pmem_dir);
+    benchmark.fill_chunks();
+    if (!benchmark.verify()) {
+        return 1;
+    }
+
+    benchmark.run<false>(repetitions);
+    benchmark.run<true>(repetitions);
+    return 0;
+}
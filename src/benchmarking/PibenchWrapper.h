@@ -20,6 +20,9 @@ public:
     inline int scan(const char* key, size_t key_sz, int scan_sz, char*& values_out) override;
     virtual long get_size() override;
 
+    // Prints the table's amplification counters in PiBench's "<name>: <value>" format
+    ~PibenchWrapper() override;
+
 private:
 
     Hashtable<uint64_t, uint64_t, PartitionType::Hash> table = Hashtable<uint64_t, uint64_t, PartitionType::Hash>("/mnt/pmem0/vogel/tabletest", true);
@@ -52,4 +52,28 @@ long PibenchWrapperVar::get_size() {
     total_size += directory_size;
 
     return total_size;
-}
\ No newline at end of file
+}
+
+PibenchWrapperVar::~PibenchWrapperVar() {
+    auto stats = table.stats();
+
+    std::cout << "Logical Bytes Written: " << stats.logical_bytes_written << std::endl;
+    std::cout << "Logical Bytes Read: " << stats.logical_bytes_read << std::endl;
+    std::cout << "WAL Bytes Written: " << stats.wal_bytes << std::endl;
+    std::cout << "Payload Log Bytes Written: " << stats.payload_log_bytes << std::endl;
+    for (int level = 0; level < *table.cur_pmem_levels; ++level) {
+        std::cout << "Level " << level << " Bytes Written: " << stats.level_bytes[level] << std::endl;
+    }
+    std::cout << "Directory Bytes Written: " << stats.directory_bytes << std::endl;
+    std::cout << "Fingerprint Bytes Written: " << stats.fingerprint_bytes << std::endl;
+    std::cout << "Compaction Bytes Written: " << stats.compaction_bytes << std::endl;
+    std::cout << "WAL Compaction Stalls: " << stats.wal_compaction_stalls << std::endl;
+    std::cout << "Log Pressure Migrations: " << stats.log_pressure_migrations << std::endl;
+    std::cout << "Checkpointer Migrations: " << stats.checkpointer_migrations << std::endl;
+    std::cout << "Payload GC Stalls: " << stats.payload_gc_stalls << std::endl;
+    std::cout << "Payload Compression Ratio: " << stats.compression_ratio() << std::endl;
+    std::cout << "PMem Bytes Read: " << stats.pmem_bytes_read << std::endl;
+    std::cout << "PMem Bytes Allocated: " << stats.pmem_bytes_allocated << std::endl;
+    std::cout << "Write Amplification: " << stats.write_amplification() << std::endl;
+    std::cout << "Read Amplification: " << stats.read_amplification() << std::endl;
+}
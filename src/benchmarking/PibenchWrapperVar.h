@@ -20,6 +20,9 @@ public:
     inline int scan(const char* key, size_t key_sz, int scan_sz, char*& values_out) override;
     virtual long get_size() override;
 
+    // Prints the table's amplification counters in PiBench's "<name>: <value>" format
+    ~PibenchWrapperVar() override;
+
 private:
 
     Hashtable<std::span<const std::byte>, std::span<const std::byte>,
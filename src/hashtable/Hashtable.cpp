@@ -2,15 +2,20 @@
 // Created by Lukas Vogel on 19.01.2021.
 //
 #include "Hashtable.h"
+#include "LzCodec.h"
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 #include <fcntl.h>
 #include <immintrin.h>
 #include <iostream>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include <thread>
 #include <unordered_map>
 #include <mutex>
+#include <utility>
 
 #define ALIGN(ptr, align) (((ptr) + (align) - 1) & ~((align) - 1))
 
@@ -59,6 +64,7 @@ void Hashtable<KeyType, ValType, pType>::insert(KeyType key, ValType value, bool
 
     uint64_t subdivision_idx;
     uint64_t entry_idx = get_dram_directory_entry_idx(key, &subdivision_idx);
+    ensure_recovered(entry_idx);
 
     //std::cout << entry_idx << std::endl;
     uint64_t subdivision_start = subdivision_idx * BUCKETS_PER_SUBDIVISION;
@@ -69,6 +75,12 @@ void Hashtable<KeyType, ValType, pType>::insert(KeyType key, ValType value, bool
     PayloadLocator val_loc;
     uint64_t key_val;
 
+    if constexpr (std::is_integral_v<KeyType>) {
+        get_io_counters().logical_bytes_written.fetch_add(sizeof(KeyType) + (tombstone ? 0 : sizeof(ValType)), std::memory_order_relaxed);
+    } else {
+        get_io_counters().logical_bytes_written.fetch_add(key.size() + (tombstone ? 0 : value.size()), std::memory_order_relaxed);
+    }
+
 RETRY_INSERT:
 
     if constexpr (std::is_integral_v<KeyType>) {
@@ -80,8 +92,8 @@ RETRY_INSERT:
         key_val = key;
     } else {
         if (tombstone) {
-            std::span<const std::byte> tmbval{reinterpret_cast<const std::byte*>(&TOMBSTONE_MARKER), 8};
-            val_loc = log_payload(key, tmbval);
+            // The locator marks the tombstone, the payload only keeps its key
+            val_loc = log_payload(key, {}, true);
         } else {
             val_loc = log_payload(key, value);
         }
@@ -95,8 +107,8 @@ RETRY_INSERT:
 
     if constexpr (!std::is_integral_v<KeyType>) {
         // Maybe our log got compacted while we tried to acquire the lock? - in that case we have lost our payload
-        // log entry - retry!
-        if (!is_alive(val_loc, key)) {
+        // log entry - retry! The same goes for a chunk that is being cleaned, it might already have passed our entry.
+        if (!is_alive(val_loc, key) || (!val_loc.is_inline() && payload_logs[val_loc.get_log_id()].chunks[val_loc.get_chunk_id()].cleaning)) {
             goto RETRY_INSERT;
         }
     }
@@ -111,6 +123,13 @@ RETRY_INSERT:
         log_to_pmem(key, val_loc, epoch);
     }
 
+    std::optional<LookupResult> previous;
+    if constexpr (!std::is_integral_v<KeyType>) {
+        for (uint64_t idx = subdivision_start; idx <= subdivision_end && !previous; ++idx) {
+            previous = lookup_in_DRAM_bucket(entry_idx, idx, key);
+        }
+    }
+
     uint64_t bucket_idx = subdivision_start;
     while (directory_entry.sizes[bucket_idx] >= KEYS_PER_BUCKET && bucket_idx < subdivision_end) {
         ++bucket_idx;
@@ -118,7 +137,16 @@ RETRY_INSERT:
     assert(bucket_idx <= subdivision_end);
     assert(directory_entry.sizes[bucket_idx] < KEYS_PER_BUCKET);
     insert_into_DRAM_bucket(entry_idx, bucket_idx, directory_entry.sizes[bucket_idx], key_val, val_loc);
-    directory_entry.sizes[bucket_idx].fetch_add(1, std::memory_order::relaxed);
+    directory_entry.sizes[bucket_idx].fetch_add(1, std::memory_order::release);
+
+    if constexpr (!std::is_integral_v<KeyType>) {
+        // A version still in DRAM is superseded now that the new one is visible, older ones on PMem are found when
+        // their entries are merged. Marking it earlier would let the cleaner collect it before readers can see its
+        // successor.
+        if (previous) {
+            mark_payload_dead(previous->locator);
+        }
+    }
 }
 
 template <class KeyType, class ValType, PartitionType pType>
@@ -133,20 +161,19 @@ void Hashtable<KeyType, ValType, pType>::checkpoint_runner(uint64_t start_idx, u
 
 template <class KeyType, class ValType, PartitionType pType>
 void Hashtable<KeyType, ValType, pType>::checkpoint(int thread_count) {
-    //TODO: thread_count must currently be a power of 2.
+    wait_for_recovery();
+    thread_count = std::max(thread_count, 1);
     std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
 
-    std::thread *thread_array[thread_count];
-
-    for (uint64_t i = 0; i < thread_count ; ++i) {
-        uint64_t morsel_start = (DRAM_DIRECTORY_SIZE / thread_count) * i;
-        uint64_t morsel_end = (DRAM_DIRECTORY_SIZE / thread_count) * (i + 1);
-        thread_array[i] = new std::thread(&Hashtable::checkpoint_runner, this, morsel_start, morsel_end);
+    std::vector<std::thread> threads;
+    for (uint64_t i = 0; i < thread_count; ++i) {
+        uint64_t morsel_start = DRAM_DIRECTORY_SIZE * i / thread_count;
+        uint64_t morsel_end = DRAM_DIRECTORY_SIZE * (i + 1) / thread_count;
+        threads.emplace_back(&Hashtable::checkpoint_runner, this, morsel_start, morsel_end);
     }
 
-    for (auto & t : thread_array) {
-        t->join();
-        delete t;
+    for (std::thread &t : threads) {
+        t.join();
     }
 
     std::chrono::time_point<std::chrono::high_resolution_clock> end = std::chrono::high_resolution_clock::now();
@@ -155,9 +182,260 @@ void Hashtable<KeyType, ValType, pType>::checkpoint(int thread_count) {
     std::cout << "Checkpointing: " << checkpoint_us / 1000 << " ms" << std::endl;
 }
 
+template <class KeyType, class ValType, PartitionType pType>
+std::future<void> Hashtable<KeyType, ValType, pType>::checkpoint_async(int thread_count) {
+    return std::async(std::launch::async, &Hashtable::checkpoint, this, thread_count);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::set_max_replay_bytes(size_t bytes) {
+    max_replay_bytes.store(bytes);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+size_t Hashtable<KeyType, ValType, pType>::replayable_log_bytes() const {
+    size_t entries = 0;
+    for (int log_idx = 0; log_idx < LOG_NUM; ++log_idx) {
+        int oldest_pinned_chunk;
+        entries += replayable_log_entries(log_idx, &oldest_pinned_chunk);
+    }
+    return entries * sizeof(LogEntry);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+size_t Hashtable<KeyType, ValType, pType>::replayable_log_entries(uint64_t log_idx, int *oldest_pinned_chunk) const {
+    Log &log = logs[log_idx];
+    PersistentLogState *p_state = log.persistent_state;
+    std::lock_guard<std::mutex> lock(log.m);
+
+    // Recovery also scans the write chunk if nothing in it is pinned, but it doesn't replay anything then
+    size_t entries = 0;
+    *oldest_pinned_chunk = -1;
+    for (int chunk_idx = p_state->first_chunk; chunk_idx != -1; chunk_idx = p_state->next_of[chunk_idx]) {
+        if (!is_pinned(log_idx, log.chunks[chunk_idx])) {
+            continue;
+        }
+        if (*oldest_pinned_chunk == -1) {
+            *oldest_pinned_chunk = chunk_idx;
+        }
+        entries += std::min<size_t>(log.chunks[chunk_idx].size, MAX_LOG_ENTRIES);
+    }
+    return entries;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::checkpointer_runner() {
+    std::vector<size_t> entries(LOG_NUM);
+    std::vector<int> oldest_pinned_chunks(LOG_NUM);
+
+    while (!stop_checkpointer) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(CHECKPOINTER_INTERVAL_MS));
+        size_t max_entries = max_replay_bytes.load() / sizeof(LogEntry);
+        if (max_entries == 0 || !recovery_complete) {
+            continue;
+        }
+
+        size_t total = 0;
+        for (int log_idx = 0; log_idx < LOG_NUM; ++log_idx) {
+            entries[log_idx] = replayable_log_entries(log_idx, &oldest_pinned_chunks[log_idx]);
+            total += entries[log_idx];
+        }
+
+        // Migrate the entries pinning the oldest chunk of the longest log until we are below the bound, or until we
+        // made a pass over all chunks because inserts keep up with us
+        for (int step = 0; total > max_entries && step < LOG_NUM * CHUNKS_PER_LOG && !stop_checkpointer; ++step) {
+            uint64_t log_idx = std::max_element(entries.begin(), entries.end()) - entries.begin();
+            total -= entries[log_idx];
+            if (oldest_pinned_chunks[log_idx] == -1) {
+                break;
+            }
+
+            uint64_t migrations = migrate_pinning_entries(log_idx, oldest_pinned_chunks[log_idx]);
+            get_io_counters().checkpointer_migrations.fetch_add(migrations, std::memory_order_relaxed);
+
+            entries[log_idx] = replayable_log_entries(log_idx, &oldest_pinned_chunks[log_idx]);
+            total += entries[log_idx];
+        }
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::is_empty() {
+    wait_for_recovery();
+    bool empty = *cur_pmem_levels == 1;
+    for (int i = 0; empty && i < DRAM_DIRECTORY_SIZE; ++i) {
+        for (int j = 0; j < BUCKETS_PER_DIRECTORY_ENTRY; ++j) {
+            empty &= dram_table[i].sizes[j] == 0;
+        }
+    }
+    for (int i = 0; empty && i < PMEM_DIRECTORY_SIZES[0]; ++i) {
+        empty &= get_directory_entry(0, i)->size == 0;
+    }
+    return empty;
+}
 
 template <class KeyType, class ValType, PartitionType pType>
-void Hashtable<KeyType, ValType, pType>::reinsert(uint64_t key, uint64_t val) {
+void Hashtable<KeyType, ValType, pType>::bulk_load(std::span<const std::pair<KeyType, ValType>> records, int num_threads) {
+    if (!is_empty()) {
+        throw std::runtime_error("Bulk loading requires an empty table");
+    }
+    if (records.empty()) {
+        return;
+    }
+    num_threads = std::max(num_threads, 1);
+
+    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
+
+    // Cleaning would drop the payloads we log, the table doesn't point to them until the level is published
+    payload_gc_paused = true;
+
+    const uint64_t num_records = records.size();
+    int level = 0;
+    while (level < MAX_PMEM_LEVELS - 1 &&
+           num_records > PMEM_DIRECTORY_SIZES[level] * BUCKETS_PER_DIRECTORY_ENTRY * KEYS_PER_BUCKET * BULK_LOAD_FILL) {
+        ++level;
+    }
+    reserve_level(level);
+
+    // Every thread owns a contiguous range of the level's directory entries
+    const uint64_t num_entries = PMEM_DIRECTORY_SIZES[level];
+    auto owner_of = [&](uint64_t entry_idx) { return entry_idx * num_threads / num_entries; };
+    auto first_entry_of = [&](uint64_t owner) { return (owner * num_entries + num_threads - 1) / num_threads; };
+
+    auto run_parallel = [&](auto &&fn) {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; ++t) {
+            threads.emplace_back(fn, t);
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    };
+
+    // Variable sized records only keep the hash of their key and the locator of their payload in the table
+    std::vector<uint64_t> keys(num_records);
+    std::vector<uint64_t> values(num_records);
+    std::vector<uint64_t> entries(num_records);
+    std::vector<uint64_t> counts(num_threads * num_threads, 0);
+
+    run_parallel([&](int t) {
+        for (uint64_t i = num_records * t / num_threads; i < num_records * (t + 1) / num_threads; ++i) {
+            const auto &[key, value] = records[i];
+            if constexpr (std::is_integral_v<KeyType>) {
+                keys[i] = key;
+                values[i] = value;
+            } else {
+                keys[i] = hash_key(key);
+                values[i] = log_payload(key, value).pos;
+            }
+            entries[i] = get_pmem_directory_entry_idx(level, keys[i]);
+            ++counts[t * num_threads + owner_of(entries[i])];
+        }
+    });
+
+    // Group the records by owner, records of the same key keep their order
+    std::vector<uint64_t> owner_starts(num_threads + 1, 0);
+    std::vector<uint64_t> scatter_pos(num_threads * num_threads);
+    for (int owner = 0; owner < num_threads; ++owner) {
+        uint64_t pos = owner_starts[owner];
+        for (int t = 0; t < num_threads; ++t) {
+            scatter_pos[t * num_threads + owner] = pos;
+            pos += counts[t * num_threads + owner];
+        }
+        owner_starts[owner + 1] = pos;
+    }
+
+    std::vector<uint64_t> order(num_records);
+    run_parallel([&](int t) {
+        for (uint64_t i = num_records * t / num_threads; i < num_records * (t + 1) / num_threads; ++i) {
+            order[scatter_pos[t * num_threads + owner_of(entries[i])]++] = i;
+        }
+    });
+
+    // Records that don't fit into their directory entry are inserted regularly once the levels are published
+    std::vector<std::vector<uint64_t>> overflow(num_threads);
+
+    run_parallel([&](int t) {
+        const uint64_t first_entry = first_entry_of(t);
+        const uint64_t end_entry = first_entry_of(t + 1);
+
+        std::vector<uint64_t> entry_starts(end_entry - first_entry + 1, 0);
+        for (uint64_t i = owner_starts[t]; i < owner_starts[t + 1]; ++i) {
+            ++entry_starts[entries[order[i]] - first_entry + 1];
+        }
+        for (uint64_t e = 1; e < entry_starts.size(); ++e) {
+            entry_starts[e] += entry_starts[e - 1];
+        }
+
+        std::vector<uint64_t> sorted(owner_starts[t + 1] - owner_starts[t]);
+        std::vector<uint64_t> fill(entry_starts.begin(), entry_starts.end() - 1);
+        for (uint64_t i = owner_starts[t]; i < owner_starts[t + 1]; ++i) {
+            sorted[fill[entries[order[i]] - first_entry]++] = order[i];
+        }
+
+        uint64_t entry_keys[BUCKETS_PER_DIRECTORY_ENTRY * KEYS_PER_BUCKET];
+        uint64_t entry_values[BUCKETS_PER_DIRECTORY_ENTRY * KEYS_PER_BUCKET];
+        uint64_t logical_bytes = 0;
+
+        for (uint64_t e = 0; e < end_entry - first_entry; ++e) {
+            uint64_t size = entry_starts[e + 1] - entry_starts[e];
+            if (size == 0) {
+                continue;
+            }
+
+            uint64_t loaded = std::min(size, static_cast<uint64_t>(BUCKETS_PER_DIRECTORY_ENTRY * KEYS_PER_BUCKET));
+            for (uint64_t i = 0; i < loaded; ++i) {
+                uint64_t record = sorted[entry_starts[e] + i];
+                entry_keys[i] = keys[record];
+                entry_values[i] = values[record];
+                if constexpr (std::is_integral_v<KeyType>) {
+                    logical_bytes += sizeof(KeyType) + sizeof(ValType);
+                } else {
+                    logical_bytes += records[record].first.size() + records[record].second.size();
+                }
+            }
+            overflow[t].insert(overflow[t].end(), sorted.begin() + entry_starts[e] + loaded, sorted.begin() + entry_starts[e + 1]);
+
+            bulk_load_directory_entry(level, first_entry + e, entry_keys, entry_values, loaded);
+
+            if constexpr (pType == PartitionType::Range) {
+                // Refining an ancestor whose children are still empty would move the records out of reach
+                for (int ancestor_level = 0; ancestor_level + 1 < level && ancestor_level < REFINED_SPLIT_LEVELS; ++ancestor_level) {
+                    pin_range_partitions(ancestor_level, (first_entry + e) >> (FANOUT_BITS * (level - ancestor_level)));
+                }
+            }
+        }
+        _mm_sfence();
+
+        get_io_counters().logical_bytes_written.fetch_add(logical_bytes, std::memory_order_relaxed);
+    });
+
+    // Publishing the levels makes the loaded records visible at once
+    cur_pmem_levels->store(level + 1);
+    _mm_clflushopt(cur_pmem_levels);
+    _mm_sfence();
+    payload_gc_paused = false;
+
+    run_parallel([&](int t) {
+        for (uint64_t record : overflow[t]) {
+            if constexpr (!std::is_integral_v<KeyType>) {
+                // insert() logs the payload again
+                mark_payload_dead(PayloadLocator(values[record]));
+            }
+            insert(records[record].first, records[record].second);
+        }
+    });
+
+    std::chrono::time_point<std::chrono::high_resolution_clock> end = std::chrono::high_resolution_clock::now();
+    uint64_t load_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+#if LOG_METRICS
+    std::cout << "[Bulk Load] (Level: " << level << "), (Total: " << load_us / 1000 << " ms)" << std::endl;
+#endif
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::reinsert(uint64_t key, uint64_t val, bool exclusive) {
 
     uint64_t entry_idx;
     uint64_t subdivision_idx;
@@ -175,7 +453,15 @@ void Hashtable<KeyType, ValType, pType>::reinsert(uint64_t key, uint64_t val) {
 
     DRAMDirectoryEntry &directory_entry = dram_table[entry_idx];
 
-    std::unique_lock<std::mutex> lock(directory_entry.m);
+    std::unique_lock<std::mutex> lock(directory_entry.m, std::defer_lock);
+    if (!exclusive) {
+        lock.lock();
+    }
+
+    // Only replicas can fill up the DRAM directory, the log never holds more entries than fit into it
+    if (directory_entry.sizes[subdivision_end] >= KEYS_PER_BUCKET) {
+        migrateDRAM(entry_idx);
+    }
 
     uint64_t bucket_idx = subdivision_start;
     // Let's check all existing buckets
@@ -208,20 +494,321 @@ uint64_t Hashtable<KeyType, ValType, pType>::hash_key(const uint64_t &key) {
     return hash;
 }
 
+template <class KeyType, class ValType, PartitionType pType>
+__m512i Hashtable<KeyType, ValType, pType>::hash_keys(__m512i keys) {
+    // hash_key() for 8 keys at once: std::_Hash_bytes is MurmurHash64A, which for a single 8 byte word boils down to
+    // a few multiplications and shifts
+    constexpr uint64_t mul = (0xc6a4a793ul << 32) + 0x5bd1e995ul;
+    const __m512i mul_vec = _mm512_set1_epi64(mul);
+    // The unmasked shifts start from an undefined vector, which GCC reports as uninitialized
+    const __m512i zero = _mm512_setzero_si512();
+
+    __m512i data = _mm512_mullo_epi64(keys, mul_vec);
+    data = _mm512_mullo_epi64(_mm512_xor_si512(data, _mm512_mask_srli_epi64(zero, 0xFF, data, 47)), mul_vec);
+
+    __m512i hash = _mm512_set1_epi64(0xDEADBEEF ^ (sizeof(uint64_t) * mul));
+    hash = _mm512_mullo_epi64(_mm512_xor_si512(hash, data), mul_vec);
+    hash = _mm512_mullo_epi64(_mm512_xor_si512(hash, _mm512_mask_srli_epi64(zero, 0xFF, hash, 47)), mul_vec);
+    return _mm512_xor_si512(hash, _mm512_mask_srli_epi64(zero, 0xFF, hash, 47));
+}
+
 template <class KeyType, class ValType, PartitionType pType>
 uint64_t Hashtable<KeyType, ValType, pType>::range_partition_key(const uint64_t &key, uint64_t level) const {
-    uint64_t step = std::max(1ul,(MAX-MIN) / PMEM_DIRECTORY_SIZES[level]);
-    return key / step;
+    const uint64_t *level_0_bounds = dram_range_lower_bounds.get();
+    uint64_t entry_idx = std::upper_bound(level_0_bounds, level_0_bounds + PMEM_DIRECTORY_SIZES[0], key) - level_0_bounds - 1;
+    if (level == 0) {
+        return entry_idx;
+    }
+
+    RangeBounds bounds = get_range_bounds(0, entry_idx);
+
+    // Descend into the child whose range contains the key until we reach the requested level
+    uint64_t lower_bounds[(1 << FANOUT_BITS) - 1];
+    for (int cur_level = 0; cur_level < level; ++cur_level) {
+        get_child_lower_bounds(cur_level, entry_idx, bounds, lower_bounds);
+        int child = std::upper_bound(lower_bounds, lower_bounds + (1 << FANOUT_BITS) - 1, key) - lower_bounds;
+
+        bounds = get_child_bounds(bounds, lower_bounds, child);
+        entry_idx = (entry_idx << FANOUT_BITS) + child;
+    }
+    return entry_idx;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+typename Hashtable<KeyType, ValType, pType>::RangeBounds Hashtable<KeyType, ValType, pType>::get_range_bounds(int level, uint64_t entry_idx) const {
+    if (level == 0) {
+        if (entry_idx + 1 < PMEM_DIRECTORY_SIZES[0]) {
+            return {dram_range_lower_bounds[entry_idx], dram_range_lower_bounds[entry_idx + 1], false};
+        }
+        return {dram_range_lower_bounds[entry_idx], static_cast<unsigned __int128>(partitions->range_max) + 1, true};
+    }
+
+    uint64_t parent_idx = entry_idx >> FANOUT_BITS;
+    RangeBounds parent_bounds = get_range_bounds(level - 1, parent_idx);
+    uint64_t lower_bounds[(1 << FANOUT_BITS) - 1];
+    get_child_lower_bounds(level - 1, parent_idx, parent_bounds, lower_bounds);
+    return get_child_bounds(parent_bounds, lower_bounds, entry_idx & ((1 << FANOUT_BITS) - 1));
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+typename Hashtable<KeyType, ValType, pType>::RangeBounds Hashtable<KeyType, ValType, pType>::get_child_bounds(const RangeBounds &bounds, const uint64_t *lower_bounds, int child) {
+    uint64_t lower = child == 0 ? bounds.lower : lower_bounds[child - 1];
+    if (child + 1 < (1 << FANOUT_BITS)) {
+        return {lower, lower_bounds[child], false};
+    }
+    if (bounds.open) {
+        // The last child of an open range is open again, with twice the nominal width of its left neighbour
+        return {lower, static_cast<unsigned __int128>(lower) + (lower - bounds.lower), true};
+    }
+    return {lower, bounds.end, false};
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::get_child_lower_bounds(int level, uint64_t entry_idx, const RangeBounds &bounds, uint64_t *lower_bounds) const {
+    if (level < REFINED_SPLIT_LEVELS) {
+        ChildSplits &splits = child_splits[level][entry_idx];
+        if (splits.valid.load(std::memory_order_acquire)) {
+            memcpy(lower_bounds, splits.lower_bounds, sizeof(splits.lower_bounds));
+            return;
+        }
+    }
+
+    // No learned split points - divide the range equally
+    unsigned __int128 width = bounds.end > bounds.lower ? bounds.end - bounds.lower : 1;
+    if (!bounds.open) {
+        if (width >> (64 - FANOUT_BITS) == 0) {
+            // The common case, the products fit into 64 bits
+            for (int child = 1; child < (1 << FANOUT_BITS); ++child) {
+                lower_bounds[child - 1] = bounds.lower + ((static_cast<uint64_t>(width) * child) >> FANOUT_BITS);
+            }
+        } else {
+            for (int child = 1; child < (1 << FANOUT_BITS); ++child) {
+                lower_bounds[child - 1] = bounds.lower + static_cast<uint64_t>((width * child) >> FANOUT_BITS);
+            }
+        }
+        return;
+    }
+
+    // The range above the largest expected key is open: the first half of the children splits the expected range,
+    // the second half grows exponentially beyond it, so that larger keys still spread over several entries
+    constexpr int half = 1 << (FANOUT_BITS - 1);
+    for (int child = 1; child < (1 << FANOUT_BITS); ++child) {
+        unsigned __int128 child_lower;
+        if (child < half) {
+            child_lower = bounds.lower + ((width * child) >> (FANOUT_BITS - 1));
+        } else {
+            child_lower = bounds.lower + (width << (child - half));
+        }
+        lower_bounds[child - 1] = static_cast<uint64_t>(std::min(child_lower, static_cast<unsigned __int128>(UINT64_MAX)));
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::refine_range_partitions(int level, uint64_t entry_idx) {
+    ChildSplits &splits = child_splits[level][entry_idx];
+    if (splits.valid.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    PMEMDirectoryEntry *entry = get_directory_entry(level, entry_idx);
+    const int size = entry->size.load(std::memory_order_relaxed);
+    if (size == 0) {
+        return;
+    }
+
+    // Refining after the first migration could strand records on any level below, so it freezes the split points.
+    // Children that already hold records were filled with the current splits, which are kept
+    for (uint64_t child = 0; child < (1 << FANOUT_BITS); ++child) {
+        if (get_directory_entry(level + 1, (entry_idx << FANOUT_BITS) + child)->size.load(std::memory_order_relaxed) > 0) {
+            pin_range_partitions(level, entry_idx);
+            return;
+        }
+    }
+
+    uint64_t keys[BUCKETS_PER_DIRECTORY_ENTRY * KEYS_PER_BUCKET];
+    for (int i = 0; i < size; ++i) {
+        Bucket *bucket;
+        if (level <= MAX_BUCKET_PREALLOC_LEVEL) {
+            bucket = &get_prealloced_bucket(level, entry_idx, i / KEYS_PER_BUCKET);
+        } else {
+            bucket = &get_bucket(entry->bucket_pointers[i / KEYS_PER_BUCKET]);
+        }
+        keys[i] = bucket->keys[i % KEYS_PER_BUCKET].load(std::memory_order_relaxed);
+    }
+    std::sort(keys, keys + size);
+    int unique_keys = std::unique(keys, keys + size) - keys;
+
+    RangeBounds bounds = get_range_bounds(level, entry_idx);
+    if (bounds.open) {
+        // Open ranges already adapt to keys beyond the expected range
+        pin_range_partitions(level, entry_idx);
+        return;
+    }
+
+    unsigned __int128 width = bounds.end > bounds.lower ? bounds.end - bounds.lower : 0;
+    unsigned __int128 spread = static_cast<unsigned __int128>(keys[unique_keys - 1] - keys[0]) + 1;
+    if (spread * REFINE_MIN_SPREAD >= width) {
+        // The keys are spread over the whole range, equal splits serve them well
+        pin_range_partitions(level, entry_idx);
+        return;
+    }
+
+    // Split at the quantiles of the keys we have seen so far
+    for (int child = 1; child < (1 << FANOUT_BITS); ++child) {
+        splits.lower_bounds[child - 1] = std::max(bounds.lower, keys[child * unique_keys >> FANOUT_BITS]);
+    }
+    _mm_clflushopt(&splits);
+    _mm_clflushopt(reinterpret_cast<char *>(&splits) + 64);
+    _mm_sfence();
+
+    splits.valid.store(1, std::memory_order_release);
+    _mm_clflushopt(&splits.valid);
+    _mm_sfence();
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::pin_range_partitions(int level, uint64_t entry_idx) {
+    ChildSplits &splits = child_splits[level][entry_idx];
+    if (splits.valid.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    get_child_lower_bounds(level, entry_idx, get_range_bounds(level, entry_idx), splits.lower_bounds);
+    _mm_clflushopt(&splits);
+    _mm_clflushopt(reinterpret_cast<char *>(&splits) + 64);
+    _mm_sfence();
+
+    splits.valid.store(1, std::memory_order_release);
+    _mm_clflushopt(&splits.valid);
+    _mm_sfence();
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::train_partitions(std::span<const uint64_t> sample) {
+    if constexpr (pType != PartitionType::Range) {
+        throw std::runtime_error("Partitions can only be trained in range partitioning mode");
+    } else {
+        if (!is_empty()) {
+            throw std::runtime_error("Partitions can only be trained on an empty table");
+        }
+
+        std::vector<uint64_t> keys(sample.begin(), sample.end());
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        if (keys.empty()) {
+            return;
+        }
+
+        const uint64_t num_partitions = PMEM_DIRECTORY_SIZES[0];
+        invalidate_partitions();
+        range_lower_bounds[0] = 0;
+        for (uint64_t i = 1; i < num_partitions; ++i) {
+            range_lower_bounds[i] = keys[(i * keys.size()) / num_partitions];
+        }
+        commit_partitions(keys.back());
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::invalidate_partitions() {
+    // A crash before the new split points are committed brings the table back with the default ones, which is fine
+    // as long as it is empty
+    partitions->magic = 0;
+    _mm_clflushopt(partitions);
+    _mm_sfence();
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::commit_partitions(uint64_t range_max) {
+    for (uint64_t i = 0; i < PMEM_DIRECTORY_SIZES[0]; i += 64 / sizeof(uint64_t)) {
+        _mm_clflushopt(range_lower_bounds + i);
+    }
+    partitions->range_max = range_max;
+    _mm_clflushopt(partitions);
+    _mm_sfence();
+
+    // The magic is the split points' valid flag, it only becomes durable after all of them
+    partitions->magic = PARTITIONS_MAGIC;
+    _mm_clflushopt(partitions);
+    _mm_sfence();
+
+    memcpy(dram_range_lower_bounds.get(), range_lower_bounds, PMEM_DIRECTORY_SIZES[0] * sizeof(uint64_t));
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::init_partitions(const std::string &partitions_file, bool reset) {
+    const size_t bounds_size = ((PMEM_DIRECTORY_SIZES[0] * sizeof(uint64_t) + sizeof(ChildSplits) - 1) / sizeof(ChildSplits)) * sizeof(ChildSplits);
+    size_t num_child_splits = 0;
+    for (int level = 0; level < REFINED_SPLIT_LEVELS; ++level) {
+        num_child_splits += PMEM_DIRECTORY_SIZES[level];
+    }
+    partitions_size = sizeof(ChildSplits) + bounds_size + num_child_splits * sizeof(ChildSplits);
+
+    char *data;
+    partitions_fd = mmap_pmem_file(partitions_file, partitions_size, &data);
+
+    partitions = reinterpret_cast<PersistentPartitions *>(data);
+    range_lower_bounds = reinterpret_cast<uint64_t *>(data + sizeof(ChildSplits));
+
+    size_t pos = sizeof(ChildSplits) + bounds_size;
+    for (int level = 0; level < REFINED_SPLIT_LEVELS; ++level) {
+        child_splits[level] = reinterpret_cast<ChildSplits *>(data + pos);
+        pos += PMEM_DIRECTORY_SIZES[level] * sizeof(ChildSplits);
+    }
+
+    dram_range_lower_bounds = std::make_unique<uint64_t[]>(PMEM_DIRECTORY_SIZES[0]);
+    if (reset || partitions->magic != PARTITIONS_MAGIC) {
+        // Equal splits over the default range - this is also how tables were partitioned before split points existed
+        invalidate_partitions();
+        uint64_t step = std::max(1ul, DEFAULT_RANGE_MAX / PMEM_DIRECTORY_SIZES[0]);
+        for (uint64_t i = 0; i < PMEM_DIRECTORY_SIZES[0]; ++i) {
+            range_lower_bounds[i] = i * step;
+        }
+        commit_partitions(DEFAULT_RANGE_MAX - 1);
+    } else {
+        memcpy(dram_range_lower_bounds.get(), range_lower_bounds, PMEM_DIRECTORY_SIZES[0] * sizeof(uint64_t));
+    }
 }
 
 
 
 template <class KeyType, class ValType, PartitionType pType>
 uint64_t Hashtable<KeyType, ValType, pType>::hash_key(const std::span<const std::byte> &key) {
+    if (INLINE_SMALL_RECORDS && key.size() <= INLINE_MAX_KEY_SIZE) {
+        // MurmurHash3's finalizer is a bijection, so equal hashes of keys with the same length mean equal keys
+        uint64_t hash = 0;
+        memcpy(&hash, key.data(), key.size());
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdul;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ul;
+        hash ^= hash >> 33;
+        return hash;
+    }
     uint64_t hash = std::_Hash_bytes(key.data(), key.size(), 0xDEADBEEF);
     return hash;
 }
 
+template <class KeyType, class ValType, PartitionType pType>
+uint64_t Hashtable<KeyType, ValType, pType>::unhash_small_key(uint64_t hash) {
+    // Undoes the finalizer step by step, the shifts by 33 bits are their own inverse
+    hash ^= hash >> 33;
+    hash *= 0x9cb4b2f8129337dbul;
+    hash ^= hash >> 33;
+    hash *= 0x4f74430c22a54005ul;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+uint64_t Hashtable<KeyType, ValType, pType>::key_tag(const std::span<const std::byte> &key) {
+    // The length and the last 8 bytes, which tells small keys apart exactly
+    uint64_t tail = 0;
+    size_t tail_len = std::min<size_t>(key.size(), 8);
+    memcpy(&tail, key.data() + key.size() - tail_len, tail_len);
+    return ((tail ^ key.size()) * 0x9E3779B97F4A7C15ul) >> (64 - PayloadLocator::TAG_BITS);
+}
+
 template <class KeyType, class ValType, PartitionType pType>
 uint64_t Hashtable<KeyType, ValType, pType>::get_key_representation(const KeyType &key) {
 
@@ -243,6 +830,7 @@ void Hashtable<KeyType, ValType, pType>::log_to_pmem(KeyType key, PayloadLocator
     Log& log = logs[log_idx];
 
     PersistentLogState* p_state = log.persistent_state;
+    bool stalled = false;
 
 RETRY_LOG:
 
@@ -257,8 +845,16 @@ RETRY_LOG:
         int epoch_idx = get_dram_directory_entry_idx(key, &subdivision_idx) >> LOG_NUM_BITS;
         // We don't need a more sophisticated concurrency control as we know that we have
         // a lock on that specific max epoch entry!
+        // The header has to be persisted before the entry, otherwise recovery might skip it
         if (cur_chunk.max_epochs[epoch_idx] < epoch) {
             cur_chunk.max_epochs[epoch_idx] = epoch;
+            _mm_clflushopt(&cur_chunk.max_epochs[epoch_idx]);
+            _mm_sfence();
+        }
+
+        // Recovery stops scanning at the chunk's persisted high-water mark
+        if (pos >= cur_chunk.durable_high_water.load()) {
+            raise_high_water_mark(cur_chunk, pos);
         }
 
         auto &entry = cur_chunk.entries[pos];
@@ -271,89 +867,133 @@ RETRY_LOG:
         assert(entry.get_value() == value.pos);
         assert(entry.get_epoch() == epoch);
         cur_chunk.size.fetch_add(1, std::memory_order_relaxed);
+        get_io_counters().wal_bytes.fetch_add(sizeof(LogEntry), std::memory_order_relaxed);
         return;
     }
 
-    bool our_turn = !log.is_compacting.test_and_set();
+    bool our_turn = !log.is_switching.test_and_set();
 
     if (!our_turn) {
-        log.persistent_state->write_chunk.wait(write_chunk_idx);
+        p_state->write_chunk.wait(write_chunk_idx);
         goto RETRY_LOG;
     }
 
     if (write_chunk_idx != p_state->write_chunk.load()) {
-        //Someone else already finished compacting the log while we were waiting to acquire the lock - restart!
-        log.is_compacting.clear();
-        log.is_compacting.notify_all();
+        //Someone else already switched the chunk while we were waiting to acquire the lock - restart!
+        log.is_switching.clear();
         goto RETRY_LOG;
     }
 
-    //Start a new chunk so all other waiters can continue ASAP
-    if (p_state->next_of[p_state->write_chunk] == -1) {
-        int first_free_chunk = p_state->first_free_chunk.load();
-        p_state->next_of[p_state->write_chunk] = first_free_chunk;
-
-        p_state->write_chunk = first_free_chunk;
-        _mm_clflush(&p_state->write_chunk);
-        _mm_sfence();
-
-        p_state->first_free_chunk = p_state->next_of[p_state->first_free_chunk].load();
-        p_state->next_of[p_state->write_chunk] = -1;
-        _mm_clflush(&p_state->write_chunk);
-        _mm_sfence();
+    // Usually the background compaction has a free chunk ready for us
+    if (!advance_write_chunk(log, LOG_COMPACTION_RESERVE)) {
+        // Last resort: Compact the log ourselves
+        if (!stalled) {
+            get_io_counters().wal_compaction_stalls.fetch_add(1, std::memory_order_relaxed);
+            stalled = true;
+        }
+        while (log.is_compacting.test_and_set()) {
+            log.is_compacting.wait(true);
+        }
 
+        while (log.free_chunk_count <= LOG_COMPACTION_RESERVE && compact_log(log_idx));
 
-        p_state->write_chunk.notify_all();
+        // Nobody else can compact this log right now, so we may also use its reserve
+        bool advanced = advance_write_chunk(log, 0);
+        log.is_compacting.clear();
+        log.is_compacting.notify_all();
 
-        // Let's first check if we have to prepend a new chunk where we should compact to
-        if (p_state->compact_target == -1) {
-            // Get new chunk and update free list
-            p_state->compact_target = p_state->first_free_chunk.load();
-            p_state->first_free_chunk = p_state->next_of[p_state->first_free_chunk].load();
+        if (!advanced) {
+            log.is_switching.clear();
+            // We hold the key's DRAM directory entry, so rather than waiting for a change cursor, we leave it behind
+            if (overtake_change_cursors(log)) {
+                goto RETRY_LOG;
+            }
+            throw std::runtime_error("Log full! No free chunks left.");
+        }
+    }
 
-            p_state->next_of[p_state->compact_target] = p_state->first_chunk.load();
-            _mm_clflush(&p_state->write_chunk);
-            _mm_sfence();
+    log.is_switching.clear();
 
-            p_state->first_chunk = p_state->compact_target.load();
-            _mm_clflush(&p_state->write_chunk);
-            _mm_sfence();
-        }
+    log_compaction_requests.fetch_add(1);
+    log_compaction_requests.notify_all();
+    goto RETRY_LOG;
+}
 
-        int chunk_to_compact_idx = p_state->next_of[p_state->compact_target];
-        LogChunk& chunk_to_compact = log.chunks[chunk_to_compact_idx];
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::advance_write_chunk(Log &log, int keep_free) {
+    PersistentLogState* p_state = log.persistent_state;
+    std::lock_guard<std::mutex> lock(log.m);
 
-        uint64_t reserved = chunk_to_compact.reserved.load();
-        assert(reserved > 0);
+    int write_chunk_idx = p_state->write_chunk.load();
+    int next_chunk_idx = p_state->next_of[write_chunk_idx];
 
-        if (reserved >= MAX_LOG_ENTRIES) {
-            while (chunk_to_compact.size < MAX_LOG_ENTRIES);
-            compact_log(log_idx);
+    if (next_chunk_idx == -1) {
+        next_chunk_idx = pop_free_log_chunk(log, keep_free);
+        if (next_chunk_idx == -1) {
+            return false;
         }
 
-    } else {
-        p_state->write_chunk = p_state->next_of[p_state->write_chunk].load();
-        _mm_clflush(&p_state->write_chunk);
+        p_state->next_of[write_chunk_idx] = next_chunk_idx;
+        _mm_clflush(p_state);
         _mm_sfence();
+    }
+
+    p_state->write_chunk = next_chunk_idx;
+    _mm_clflush(&p_state->write_chunk);
+    _mm_sfence();
 #if LOG_DEBUG
-        std::cout << "Started new chunk: " << p_state->write_chunk << std::endl;
+    std::cout << "Started new chunk: " << p_state->write_chunk << std::endl;
 #endif
-        p_state->write_chunk.notify_all();
+    p_state->write_chunk.notify_all();
+    return true;
+}
 
+template <class KeyType, class ValType, PartitionType pType>
+int Hashtable<KeyType, ValType, pType>::pop_free_log_chunk(Log &log, int keep_free) {
+    // The caller holds log.m
+    PersistentLogState* p_state = log.persistent_state;
+    if (log.free_chunk_count <= keep_free) {
+        return -1;
     }
-    log.is_compacting.clear();
-    log.is_compacting.notify_all();
-    goto RETRY_LOG;
+
+    int chunk_idx = p_state->first_free_chunk.load();
+    p_state->first_free_chunk = p_state->next_of[chunk_idx].load();
+    p_state->next_of[chunk_idx] = -1;
+    _mm_clflush(p_state);
+    _mm_sfence();
+
+    --log.free_chunk_count;
+    return chunk_idx;
 }
 
 template <class KeyType, class ValType, PartitionType pType>
 class Hashtable<KeyType, ValType, pType>::PayloadLocator Hashtable<KeyType, ValType, pType>::log_payload
-        (std::span<const std::byte> key, std::span<const std::byte> value) {
+        (std::span<const std::byte> key, std::span<const std::byte> value, bool tombstone) {
+
 
+    if (INLINE_SMALL_RECORDS && key.size() <= INLINE_MAX_KEY_SIZE && value.size() <= INLINE_MAX_VALUE_SIZE) {
+        return PayloadLocator::make_inline(key.size(), value, tombstone);
+    }
+
+    std::span<const std::byte> stored = value;
+    std::byte flags{0};
+    if (payload_codec == PayloadCodec::LZ && value.size() >= COMPRESSION_MIN_VALUE_SIZE) {
+        thread_local std::vector<uint8_t> buffer;
+        buffer.resize(value.size());
+        // The block and the raw length have to take less space than the raw value, otherwise it is logged raw
+        size_t block_size = LzCodec::compress(reinterpret_cast<const uint8_t *>(value.data()), value.size(),
+                                              buffer.data() + sizeof(uint32_t), value.size() - sizeof(uint32_t) - 1);
+        if (block_size != 0) {
+            uint32_t raw_len = value.size();
+            memcpy(buffer.data(), &raw_len, sizeof(uint32_t));
+            stored = std::as_bytes(std::span(buffer.data(), sizeof(uint32_t) + block_size));
+            flags = std::byte{PAYLOAD_ENTRY_COMPRESSED};
+        }
+    }
 
     uint64_t log_idx = get_payloadlog_entry_idx(key);
     PayloadLog& log = payload_logs[log_idx];
-    uint64_t entry_size = sizeof(PayloadLogEntry) + key.size() + value.size();
+    uint64_t entry_size = payload_entry_size(key.size(), stored.size());
 
     PersistentPayloadLogState* p_state = log.persistent_state;
 
@@ -365,20 +1005,28 @@ RETRY_PAYLOAD_LOG:
     size_t pos = cur_chunk.reserved.fetch_add(entry_size);
 
     if (pos + entry_size < PAYLOAD_CHUNK_SIZE) {
+        // The chunk can't be cleaned while we write to it, so its epoch stays the same
+        int epoch = p_state->log_epochs[write_chunk_idx].load();
         auto *entry = reinterpret_cast<PayloadLogEntry *>(cur_chunk.entries + pos);
-        entry->key_len = key.size();
-        entry->val_len = value.size();
-        entry->flags = std::byte{0};
+        init_payload_log_entry(entry, key.size(), stored.size(), flags, epoch);
         memcpy(reinterpret_cast<uint8_t *>(entry + 1), (uint8_t *) key.data(), key.size());
-        memcpy(reinterpret_cast<uint8_t *>(entry + 1) + key.size(), (uint8_t *) value.data(), value.size());
+        memcpy(reinterpret_cast<uint8_t *>(entry + 1) + key.size(), (uint8_t *) stored.data(), stored.size());
 
-        for (int i = 0; i < entry_size / 64; ++i) {
-            _mm_clflush(cur_chunk.entries + pos + i * 64);
+        for (size_t line = pos & ~63ul; line < pos + entry_size; line += 64) {
+            _mm_clflush(cur_chunk.entries + line);
         }
         _mm_sfence();
+        // Counted before the size, so that the chunk can't be cleaned before
+        cur_chunk.live_bytes.fetch_add(entry_size);
         cur_chunk.size += entry_size;
-
-        return {log_idx, static_cast<uint64_t>(write_chunk_idx), static_cast<uint64_t>(log.persistent_state->log_epochs[write_chunk_idx].load()), pos};
+        IOCounters &io = get_io_counters();
+        io.payload_log_bytes.fetch_add(entry_size, std::memory_order_relaxed);
+        io.payload_value_bytes.fetch_add(value.size(), std::memory_order_relaxed);
+        io.payload_stored_value_bytes.fetch_add(stored.size(), std::memory_order_relaxed);
+
+        PayloadLocator locator(log_idx, write_chunk_idx, epoch, pos);
+        locator.pos |= key_tag(key) << PayloadLocator::OFFSET_BITS | (tombstone ? PayloadLocator::TOMBSTONE_FLAG : 0);
+        return locator;
     }
 
     if (pos >= PAYLOAD_CHUNK_SIZE) {
@@ -394,17 +1042,17 @@ RETRY_PAYLOAD_LOG:
     };
 
     // First assign a new chunk to write to and a chunk we compact to so that we don't block for too long here.
-    int next_chunk_idx = (write_chunk_idx + 1) & ((1 << PAYLOAD_CHUNK_NUM_BITS) - 1);
-    while (!p_state->free[next_chunk_idx]) {
-        if (next_chunk_idx == write_chunk_idx) {
-            throw std::runtime_error("Payload log full! No free chunks left.");
-        }
-        next_chunk_idx = (next_chunk_idx +1) & ((1 << PAYLOAD_CHUNK_NUM_BITS) - 1);
+    int next_chunk_idx;
+    while ((next_chunk_idx = next_free_payload_chunk(log, write_chunk_idx)) < 0) {
+        log.m.unlock();
+        std::this_thread::yield();
+        log.m.lock();
     }
 
 
     // Now unfree the new log entry so that if we crash, it is guaranteed that no one else could unfree this chunk again
     // after we have already written data to it
+    reserve_payload_chunk(log_idx, next_chunk_idx);
     p_state->free[next_chunk_idx] = false;
     _mm_clflush(p_state);
     _mm_sfence();
@@ -417,25 +1065,77 @@ RETRY_PAYLOAD_LOG:
     p_state->write_chunk.notify_all();
 
     log.free_chunk_count--;
-    log.compact_order.push(write_chunk_idx);
+    cur_chunk.sealed_seq = ++log.seal_count;
+    log.gc_paused = false;
+    bool stall = log.free_chunk_count <= payload_low_watermark && !payload_gc_paused;
+    log.m.unlock();
 
-    if (log.free_chunk_count == 0) {
-        compact_payload_log(log_idx);
+    if (stall) {
+        // The background cleaning fell behind, clean until we are above the low watermark again
+        get_io_counters().payload_gc_stalls.fetch_add(1, std::memory_order_relaxed);
+        while (log.is_compacting.test_and_set()) {
+            log.is_compacting.wait(true);
+        }
+        // Cleaning chunks without garbage frees nothing, so give up once every chunk had its turn
+        for (int i = 0; i < CHUNKS_PER_PAYLOAD_LOG && log.free_chunk_count <= payload_low_watermark; ++i) {
+            if (compact_payload_log(log_idx) < 0) {
+                break;
+            }
+        }
+        log.is_compacting.clear();
+        log.is_compacting.notify_all();
     }
+    payload_compaction_requests.fetch_add(1);
+    payload_compaction_requests.notify_all();
 
-    log.m.unlock();
     goto RETRY_PAYLOAD_LOG;
 }
 
 template <class KeyType, class ValType, PartitionType pType>
-void Hashtable<KeyType, ValType, pType>::compact_log(uint64_t log_idx) {
+bool Hashtable<KeyType, ValType, pType>::overtake_change_cursors(Log &log) {
+    PersistentLogState* p_state = log.persistent_state;
+    std::lock_guard<std::mutex> lock(log.m);
+
+    int chunk_idx = p_state->compact_target == -1 ? p_state->first_chunk.load() : p_state->next_of[p_state->compact_target].load();
+    if (chunk_idx == p_state->write_chunk || log.cursors_in_chunk[chunk_idx] == 0) {
+        return false;
+    }
+    // The cursors notice the new generation and stop reading, even if the chunk is overwritten meanwhile
+    log.cursor_generations[chunk_idx].fetch_add(1, std::memory_order_release);
+    log.cursors_in_chunk[chunk_idx] = 0;
+    return true;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::compact_log(uint64_t log_idx) {
     Log& log = logs[log_idx];
     PersistentLogState* p_state = log.persistent_state;
 
-    int chunk_to_compact_idx = p_state->next_of[p_state->compact_target];
+    int chunk_to_compact_idx;
+    bool only_if_dead;
+    {
+        std::lock_guard<std::mutex> lock(log.m);
+
+        chunk_to_compact_idx = p_state->compact_target == -1 ? p_state->first_chunk.load() : p_state->next_of[p_state->compact_target].load();
+        if (chunk_to_compact_idx == p_state->write_chunk || log.cursors_in_chunk[chunk_to_compact_idx] > 0) {
+            return false;
+        }
+
+        // We might need a new head of the chain and another chunk if the moved entries don't fit into the target.
+        // Without them, we can still free the chunk if none of its entries is live anymore.
+        int chunks_needed = p_state->compact_target == -1 ? 2 : 1;
+        only_if_dead = log.free_chunk_count < chunks_needed;
+    }
 
     LogChunk& chunk_to_compact = log.chunks[chunk_to_compact_idx];
-    LogChunk* target_chunk = &log.chunks[p_state->compact_target];
+    // Targets are only allocated once we have to move an entry
+    LogChunk* target_chunk = p_state->compact_target == -1 ? nullptr : &log.chunks[p_state->compact_target];
+    int chunks_allocated = 0;
+
+    // Inserters that reserved an entry before the chunk was switched might still be writing it
+    while (chunk_to_compact.size < std::min<size_t>(chunk_to_compact.reserved, MAX_LOG_ENTRIES)) {
+        _mm_pause();
+    }
 
     uint64_t read_pos = 0;
     uint64_t num_writes = 0;
@@ -451,128 +1151,580 @@ void Hashtable<KeyType, ValType, pType>::compact_log(uint64_t log_idx) {
         }
     }
 
-    while (!can_skip && read_pos < chunk_to_compact.size) {
-        // Check whether entry at read pos is still in volatile memory
-        auto &entry = chunk_to_compact.entries[read_pos];
-        uint64_t key = entry.get_key();
-        uint64_t entry_idx;
+    if (!can_skip && only_if_dead) {
+        return false;
+    }
 
-        if constexpr (!std::is_integral_v<KeyType>) {
-            assert(pType == PartitionType::Hash);
-            entry_idx = key & (DRAM_DIRECTORY_SIZE - 1);
-        } else {
-            uint64_t subdivision_idx;
-            entry_idx = get_dram_directory_entry_idx(key, &subdivision_idx);
-        }
+    bool expected_valid_bit = p_state->valid_bits[chunk_to_compact_idx];
 
-        bool expected_valid_bit = log.persistent_state->valid_bits[chunk_to_compact_idx];
-        if (entry.get_epoch() < dram_table[entry_idx].epoch || !entry.is_valid(expected_valid_bit)) {
-            // Either the epoch in DRAM is larger - this entry's content is already persisted.
-            // Or it is an invalid entry because the system crashed.
-            // We can ignore it in both cases.
-            ++read_pos;
-            continue;
+    while (!can_skip && read_pos < chunk_to_compact.size) {
+        // Find the entries whose content is still only in volatile memory.
+        // All others are either already persisted (the epoch in DRAM is larger) or invalid because the system crashed.
+        __mmask8 valid;
+        __mmask8 live;
+        int batch_size = std::min<int>(8, chunk_to_compact.size - read_pos);
+        if (SIMD_LOG_SCAN && batch_size == 8) {
+            live = filter_log_entries(chunk_to_compact.entries + read_pos, expected_valid_bit, &valid);
+        } else {
+            live = filter_log_entries_scalar(chunk_to_compact.entries + read_pos, batch_size, expected_valid_bit, &valid);
         }
 
-        // Move the (still required) log entry to the new chunk
-        bool moved = move_log_entry(chunk_to_compact, *target_chunk, read_pos, log.persistent_state->valid_bits[p_state->compact_target]);
-
-        if (!moved) {
-            // We need to start a new chunk
-            int next = p_state->next_of[p_state->compact_target];
-            int old_target = p_state->compact_target.load();
-
-            // Get new chunk and update free list
-            int cur_first_free_chunk = p_state->first_free_chunk.load();
-
-            p_state->first_free_chunk = p_state->next_of[p_state->first_free_chunk].load();
-            _mm_clflush(p_state);
-            _mm_sfence();
-
-            p_state->compact_target = cur_first_free_chunk;
-            _mm_clflush(p_state);
-            _mm_sfence();
-
-            // Add next pointer
-            p_state->next_of[p_state->compact_target] = next;
-            _mm_clflush(p_state);
-            _mm_sfence();
-
-            // Add previous pointer
-            p_state->next_of[old_target] = p_state->compact_target.load();
-            _mm_clflush(p_state);
-            _mm_sfence();
+        for (; live != 0; live &= live - 1) {
+            uint64_t pos = read_pos + __builtin_ctz(live);
+            int epoch_idx = get_logged_dram_directory_entry_idx(chunk_to_compact.entries[pos].get_key()) >> LOG_NUM_BITS;
+
+            // Move the (still required) log entry to the new chunk
+            bool moved = target_chunk != nullptr && move_log_entry(chunk_to_compact, *target_chunk, pos, epoch_idx, p_state->valid_bits[p_state->compact_target]);
+
+            if (!moved) {
+                // We need to start a new chunk, it was reserved before we started
+                std::lock_guard<std::mutex> lock(log.m);
+                int old_target = p_state->compact_target.load();
+                int new_target = pop_free_log_chunk(log, 0);
+                assert(new_target != -1);
+                ++chunks_allocated;
+
+                p_state->compact_target = new_target;
+                p_state->next_of[new_target] = chunk_to_compact_idx;
+                _mm_clflush(p_state);
+                _mm_sfence();
+
+                // Link it in front of the chunk we compact, which might be the head of the chain
+                if (old_target == -1) {
+                    p_state->first_chunk = new_target;
+                } else {
+                    p_state->next_of[old_target] = new_target;
+                }
+                _mm_clflush(p_state);
+                _mm_sfence();
 
-            target_chunk = &log.chunks[p_state->compact_target];
+                target_chunk = &log.chunks[new_target];
 
-            // Finally move the log entry
-            move_log_entry(chunk_to_compact, *target_chunk, read_pos, log.persistent_state->valid_bits[p_state->compact_target]);
-        } else {
-            ++read_pos;
+                // Finally move the log entry
+                move_log_entry(chunk_to_compact, *target_chunk, pos, epoch_idx, p_state->valid_bits[new_target]);
+            }
+            ++num_writes;
         }
-        ++num_writes;
+        read_pos += batch_size;
     }
 
+    get_io_counters().compaction_bytes.fetch_add(num_writes * sizeof(LogEntry), std::memory_order_relaxed);
+
     chunk_to_compact.size = 0;
     chunk_to_compact.reserved = 0;
     for (int i = 0; i < (1 << (DRAM_BITS - LOG_NUM_BITS)); ++i) {
-        chunk_to_compact.max_epochs[i] = 0;
+        chunk_to_compact.max_epochs[i].store(0, std::memory_order_relaxed);
     }
+    for (long offset = 0; offset < LOG_CHUNK_HEADER_SIZE; offset += 64) {
+        _mm_clflushopt(reinterpret_cast<char *>(chunk_to_compact.max_epochs) + offset);
+    }
+    chunk_to_compact.high_water->store(0);
+    chunk_to_compact.durable_high_water = 0;
+    _mm_clflushopt(chunk_to_compact.high_water);
+    _mm_sfence();
+    get_io_counters().compaction_bytes.fetch_add(LOG_CHUNK_HEADER_SIZE, std::memory_order_relaxed);
 
-    //RAWL -> Flip valid bit
-    log.persistent_state->valid_bits[chunk_to_compact_idx] = !log.persistent_state->valid_bits[chunk_to_compact_idx];
+    std::lock_guard<std::mutex> lock(log.m);
 
-    if (p_state->next_of[chunk_to_compact_idx] == p_state->write_chunk) {
+    // Unlink the compacted chunk
+    if (p_state->compact_target == -1) {
+        p_state->first_chunk = p_state->next_of[chunk_to_compact_idx].load();
+    } else {
+        p_state->next_of[p_state->compact_target] = p_state->next_of[chunk_to_compact_idx].load();
+    }
+    bool caught_up = p_state->next_of[chunk_to_compact_idx] == p_state->write_chunk;
+    if (caught_up) {
 #if LOG_DEBUG
         std::cout << "Restarting compact target!" << std::endl;
 #endif
         //We've caught up with the log writing, restart compaction from the front
-        //TODO: Use some metric to abort earlier
-        //TODO: What about half filled log chunks?
         p_state->compact_target = -1;
-    } else {
-        p_state->next_of[p_state->compact_target] = p_state->next_of[chunk_to_compact_idx].load();
     }
     _mm_clflush(p_state);
     _mm_sfence();
 
+    //RAWL -> Flip valid bit
+    p_state->valid_bits[chunk_to_compact_idx] = !p_state->valid_bits[chunk_to_compact_idx];
+
     // Insert the now emptied chunk into the free list
     p_state->next_of[chunk_to_compact_idx] = p_state->first_free_chunk.load();
     p_state->first_free_chunk = chunk_to_compact_idx;
     _mm_clflush(p_state);
     _mm_sfence();
+    ++log.free_chunk_count;
 #if LOG_DEBUG
     std:: cout << "Compacted log chunk from: " << read_pos << " to: " << num_writes << " elements!" << std::endl;
 #endif
+    // Compacting the chunk that just received the moved entries of another one again won't free anything
+    return chunks_allocated == 0 || !caught_up;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::log_compaction_runner(int thread_idx) {
+    while (!stop_log_compaction) {
+        uint64_t requests = log_compaction_requests.load();
+        bool compacted = false;
+
+        for (uint64_t log_idx = thread_idx; log_idx < LOG_NUM; log_idx += LOG_COMPACTION_THREADS) {
+            Log& log = logs[log_idx];
+            if (log.free_chunk_count >= LOG_COMPACTION_RESERVE + ready_log_chunks ||
+                    log.recovery.load() != LogRecovery::Recovered) {
+                continue;
+            }
+
+            relieve_log_pressure(log_idx, log.free_chunk_count <= LOG_COMPACTION_RESERVE);
+
+            if (log.is_compacting.test_and_set()) {
+                // An inserter is already compacting this log
+                continue;
+            }
+            compacted |= compact_log(log_idx);
+            log.is_compacting.clear();
+            log.is_compacting.notify_all();
+        }
+
+        if (!compacted) {
+            // Nothing left to compact until an inserter switches chunks
+            log_compaction_requests.wait(requests);
+        }
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+uint64_t Hashtable<KeyType, ValType, pType>::get_logged_dram_directory_entry_idx(uint64_t logged_key) {
+    if constexpr (!std::is_integral_v<KeyType>) {
+        assert(pType == PartitionType::Hash);
+        return logged_key & (DRAM_DIRECTORY_SIZE - 1);
+    } else {
+        uint64_t subdivision_idx;
+        return get_dram_directory_entry_idx(logged_key, &subdivision_idx);
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+__mmask8 Hashtable<KeyType, ValType, pType>::filter_log_entries_scalar(const LogEntry *entries, int count, bool expected_valid_bit, __mmask8 *valid_mask) {
+    __mmask8 valid = 0;
+    __mmask8 live = 0;
+    for (int i = 0; i < count; ++i) {
+        if (!entries[i].is_valid(expected_valid_bit)) {
+            continue;
+        }
+        valid |= 1 << i;
+
+        uint64_t entry_idx = get_logged_dram_directory_entry_idx(entries[i].get_key());
+        if (entries[i].get_epoch() >= dram_table[entry_idx].epoch) {
+            live |= 1 << i;
+        }
+    }
+    *valid_mask = valid;
+    return live;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+__mmask8 Hashtable<KeyType, ValType, pType>::filter_log_entries(const LogEntry *entries, bool expected_valid_bit, __mmask8 *valid_mask) {
+    static_assert(sizeof(LogEntry) == 3 * sizeof(uint64_t));
+
+    // The 8 entries are 24 consecutive words: Sort them into one vector per word of an entry
+    const auto *words = reinterpret_cast<const uint64_t *>(entries);
+    __m512i lo = _mm512_loadu_si512(words);
+    __m512i mid = _mm512_loadu_si512(words + 8);
+    __m512i hi = _mm512_loadu_si512(words + 16);
+
+    __m512i content[3];
+    for (int word = 0; word < 3; ++word) {
+        __m512i idx = _mm512_add_epi64(_mm512_setr_epi64(0, 3, 6, 9, 12, 15, 18, 21), _mm512_set1_epi64(word));
+        // Indices below 16 select from lo and mid, the others from hi
+        content[word] = _mm512_permutex2var_epi64(lo, idx, mid);
+        content[word] = _mm512_mask_permutexvar_epi64(content[word], _mm512_cmpge_epu64_mask(idx, _mm512_set1_epi64(16)), idx, hi);
+    }
+
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m512i bit = _mm512_set1_epi64(expected_valid_bit ? 1 : 0);
+    __mmask8 valid = _mm512_cmpeq_epi64_mask(_mm512_and_si512(content[0], one), bit)
+                   & _mm512_cmpeq_epi64_mask(_mm512_and_si512(content[1], one), bit)
+                   & _mm512_cmpeq_epi64_mask(_mm512_and_si512(content[2], one), bit);
+    *valid_mask = valid;
+
+    // Same decoding as LogEntry::get_key() and LogEntry::get_epoch(). The masked intrinsics start from zeroed vectors,
+    // the unmasked ones from undefined ones, which GCC reports as uninitialized
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i keys = _mm512_or_si512(_mm512_mask_srli_epi64(zero, 0xFF, content[0], 1), _mm512_and_si512(content[2], _mm512_set1_epi64(1ul << 63)));
+    __m256i epochs = _mm512_mask_cvtepi64_epi32(_mm256_setzero_si256(), 0xFF,
+                                                _mm512_mask_srli_epi64(zero, 0xFF, _mm512_and_si512(content[2], _mm512_set1_epi64((1ul << 34) - 1)), 1));
+
+    __m512i entry_idx;
+    if constexpr (!std::is_integral_v<KeyType>) {
+        entry_idx = _mm512_and_si512(keys, _mm512_set1_epi64(DRAM_DIRECTORY_SIZE - 1));
+    } else if constexpr (pType == PartitionType::Hash) {
+        entry_idx = _mm512_and_si512(hash_keys(keys), _mm512_set1_epi64(DRAM_DIRECTORY_SIZE - 1));
+        assert(static_cast<uint64_t>(_mm_cvtsi128_si64(_mm512_mask_extracti32x4_epi32(_mm_setzero_si128(), 0xF, entry_idx, 0))) == get_logged_dram_directory_entry_idx(entries[0].get_key()));
+    } else {
+        // Range partitions need a binary search per key
+        alignas(64) uint64_t key_array[8];
+        alignas(64) uint64_t entry_idx_array[8];
+        _mm512_store_si512(key_array, keys);
+        for (int i = 0; i < 8; ++i) {
+            entry_idx_array[i] = get_logged_dram_directory_entry_idx(key_array[i]);
+        }
+        entry_idx = _mm512_load_si512(entry_idx_array);
+    }
+
+    // Gather the epochs of the DRAM directory entries
+    __m512i offsets = _mm512_mullo_epi64(entry_idx, _mm512_set1_epi64(sizeof(DRAMDirectoryEntry)));
+    __m256i dram_epochs = _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), valid, offsets, &dram_table[0].epoch, 1);
+
+    return valid & _mm256_mask_cmpge_epi32_mask(valid, epochs, dram_epochs);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::relieve_log_pressure(uint64_t log_idx, bool force) {
+    Log& log = logs[log_idx];
+    PersistentLogState* p_state = log.persistent_state;
+
+    int chunk_idx;
+    {
+        std::lock_guard<std::mutex> lock(log.m);
+        chunk_idx = p_state->compact_target == -1 ? p_state->first_chunk.load() : p_state->next_of[p_state->compact_target].load();
+        if (chunk_idx == p_state->write_chunk) {
+            return;
+        }
+    }
+
+    // Find the DRAM directory entries pinning the chunk that is compacted next
+    LogChunk& chunk = log.chunks[chunk_idx];
+    int pinning = 0;
+    for (int i = 0; i < (1 << (DRAM_BITS - LOG_NUM_BITS)); ++i) {
+        pinning += chunk.max_epochs[i] >= dram_table[(i << LOG_NUM_BITS) | log_idx].epoch;
+    }
+    if (!force && pinning <= LOG_PRESSURE_PINNED_SHARE * (1 << (DRAM_BITS - LOG_NUM_BITS))) {
+        return;
+    }
+
+    // Migrate them so that compaction can drop their log entries
+    uint64_t migrations = migrate_pinning_entries(log_idx, chunk_idx);
+    get_io_counters().log_pressure_migrations.fetch_add(migrations, std::memory_order_relaxed);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+uint64_t Hashtable<KeyType, ValType, pType>::migrate_pinning_entries(uint64_t log_idx, int chunk_idx) {
+    // Must not be called while holding any lock of the log: inserters might wait for the log while holding the lock of
+    // a directory entry.
+    Log &log = logs[log_idx];
+    int max_epochs[1 << (DRAM_BITS - LOG_NUM_BITS)];
+    {
+        // The caller found the chunk without holding the lock, compaction might have freed and reused it since.
+        // Only the epochs it holds while it is in use tell which entries pin it.
+        std::lock_guard<std::mutex> lock(log.m);
+        for (int free_idx = log.persistent_state->first_free_chunk; free_idx != -1; free_idx = log.persistent_state->next_of[free_idx]) {
+            if (free_idx == chunk_idx) {
+                return 0;
+            }
+        }
+        for (int i = 0; i < (1 << (DRAM_BITS - LOG_NUM_BITS)); ++i) {
+            max_epochs[i] = log.chunks[chunk_idx].max_epochs[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t migrations = 0;
+    for (int i = 0; i < (1 << (DRAM_BITS - LOG_NUM_BITS)); ++i) {
+        uint64_t dram_idx = (i << LOG_NUM_BITS) | log_idx;
+        DRAMDirectoryEntry &directory_entry = dram_table[dram_idx];
+        if (max_epochs[i] < directory_entry.epoch) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(directory_entry.m);
+        if (max_epochs[i] >= directory_entry.epoch) {
+            migrateDRAM(dram_idx);
+            ++migrations;
+        }
+    }
+    return migrations;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::is_pinned(uint64_t log_idx, const LogChunk &chunk) const {
+    for (int i = 0; i < (1 << (DRAM_BITS - LOG_NUM_BITS)); ++i) {
+        if (chunk.max_epochs[i] >= dram_table[(i << LOG_NUM_BITS) | log_idx].epoch) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+std::vector<double> Hashtable<KeyType, ValType, pType>::log_fill_levels() const {
+    std::vector<double> fill_levels;
+    for (int log_idx = 0; log_idx < LOG_NUM; ++log_idx) {
+        Log& log = logs[log_idx];
+        PersistentLogState* p_state = log.persistent_state;
+        std::lock_guard<std::mutex> lock(log.m);
+
+        size_t entries = 0;
+        for (int chunk_idx = p_state->first_chunk; chunk_idx != -1; chunk_idx = p_state->next_of[chunk_idx]) {
+            entries += std::min<size_t>(log.chunks[chunk_idx].size, MAX_LOG_ENTRIES);
+        }
+        fill_levels.push_back(static_cast<double>(entries) / (CHUNKS_PER_LOG * MAX_LOG_ENTRIES));
+    }
+    return fill_levels;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+uint64_t Hashtable<KeyType, ValType, pType>::payload_log_of(std::span<const std::byte> key) {
+    return get_payloadlog_entry_idx(key);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+Hashtable<KeyType, ValType, pType>::ChangeCursor::ChangeCursor(Hashtable &table) : table(table) {
+    if constexpr (!std::is_integral_v<KeyType>) {
+        throw std::runtime_error("Change streams only support fixed-size keys");
+    }
+    table.wait_for_recovery();
+
+    // Start behind the entries that are already reserved
+    for (int log_idx = 0; log_idx < table.LOG_NUM; ++log_idx) {
+        Log &log = table.logs[log_idx];
+        std::lock_guard<std::mutex> lock(log.m);
+
+        int chunk_idx = log.persistent_state->write_chunk.load();
+        ++log.cursors_in_chunk[chunk_idx];
+        chunks.push_back(chunk_idx);
+        generations.push_back(log.cursor_generations[chunk_idx]);
+        positions.push_back(std::min<size_t>(log.chunks[chunk_idx].reserved, MAX_LOG_ENTRIES));
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+Hashtable<KeyType, ValType, pType>::ChangeCursor::~ChangeCursor() {
+    for (int log_idx = 0; log_idx < table.LOG_NUM; ++log_idx) {
+        Log &log = table.logs[log_idx];
+        std::lock_guard<std::mutex> lock(log.m);
+        // Inserts that overtook us already dropped our pin
+        if (log.cursor_generations[chunks[log_idx]] == generations[log_idx]) {
+            --log.cursors_in_chunk[chunks[log_idx]];
+        }
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::ChangeCursor::overtaken() const {
+    return is_overtaken;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+size_t Hashtable<KeyType, ValType, pType>::ChangeCursor::poll(std::vector<Change> &changes, size_t max_changes) {
+    size_t polled = 0;
+    if (is_overtaken) {
+        return 0;
+    }
+
+    // Logs partition the keys, so it doesn't matter in which order we read them
+    for (int i = 0; i < table.LOG_NUM && polled < max_changes; ++i) {
+        int log_idx = next_log;
+        next_log = (next_log + 1) % table.LOG_NUM;
+
+        Log &log = table.logs[log_idx];
+        PersistentLogState *p_state = log.persistent_state;
+
+        while (polled < max_changes) {
+            int chunk_idx = chunks[log_idx];
+            LogChunk &chunk = log.chunks[chunk_idx];
+            uint64_t &pos = positions[log_idx];
+
+            // Entries are reserved in order but completed out of order, we can only read up to the reserved ones
+            // once no inserter is writing anymore. At the latest, that's the case once the chunk is full.
+            size_t size = chunk.size;
+            size_t reserved = std::min<size_t>(chunk.reserved, MAX_LOG_ENTRIES);
+            uint64_t end = size >= reserved ? reserved : pos;
+
+            size_t first = changes.size();
+            uint64_t first_pos = pos;
+            while (pos < end && polled < max_changes) {
+                const LogEntry &entry = chunk.entries[pos];
+                changes.push_back({entry.get_key(), entry.get_value(), entry.get_epoch(), entry.get_value() == TOMBSTONE_MARKER});
+                ++pos;
+                ++polled;
+            }
+
+            // Inserts that overtook us might have compacted and reused the chunk while we read it
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (log.cursor_generations[chunk_idx].load(std::memory_order_relaxed) != generations[log_idx]) {
+                is_overtaken = true;
+                polled -= pos - first_pos;
+                changes.resize(first);
+                return polled;
+            }
+
+            int next_chunk_idx = p_state->next_of[chunk_idx];
+            if (pos < MAX_LOG_ENTRIES || next_chunk_idx == -1) {
+                break;
+            }
+
+            // Pin the next chunk before releasing ours, so that compaction can't overtake us
+            std::lock_guard<std::mutex> lock(log.m);
+            if (log.cursor_generations[chunk_idx] != generations[log_idx]) {
+                is_overtaken = true;
+                return polled;
+            }
+            ++log.cursors_in_chunk[next_chunk_idx];
+            --log.cursors_in_chunk[chunk_idx];
+            chunks[log_idx] = next_chunk_idx;
+            generations[log_idx] = log.cursor_generations[next_chunk_idx];
+            pos = 0;
+        }
+    }
+    return polled;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::serve_changes(ChangeCursor &cursor, int fd, const std::atomic<bool> &stop) {
+    std::vector<Change> changes;
+    changes.reserve(CHANGE_BATCH_SIZE);
+
+    while (true) {
+        changes.clear();
+        if (cursor.poll(changes, CHANGE_BATCH_SIZE) == 0) {
+            if (stop || cursor.overtaken()) {
+                // An overtaken cursor missed changes, the replica has to start over
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(CHANGE_POLL_INTERVAL_US));
+            continue;
+        }
+
+        const char *data = reinterpret_cast<const char *>(changes.data());
+        size_t remaining = changes.size() * sizeof(Change);
+        while (remaining > 0) {
+            ssize_t sent = send(fd, data, remaining, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                // The replica disconnected
+                return;
+            }
+            data += sent;
+            remaining -= sent;
+        }
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::apply_changes(int fd) {
+    std::vector<Change> changes(CHANGE_BATCH_SIZE);
+    size_t buffered = 0;
+
+    while (true) {
+        ssize_t received = read(fd, reinterpret_cast<char *>(changes.data()) + buffered, changes.size() * sizeof(Change) - buffered);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return;
+        }
+        buffered += received;
+
+        // A change might arrive in pieces, keep the incomplete one for the next read
+        size_t complete = buffered / sizeof(Change);
+        for (size_t i = 0; i < complete; ++i) {
+            apply_change(changes[i]);
+        }
+        buffered -= complete * sizeof(Change);
+        memmove(changes.data(), changes.data() + complete, buffered);
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::apply_change(const Change &change) {
+    if constexpr (!std::is_integral_v<KeyType>) {
+        throw std::runtime_error("Change streams only support fixed-size keys");
+    } else {
+        get_io_counters().logical_bytes_written.fetch_add(sizeof(KeyType) + (change.tombstone ? 0 : sizeof(ValType)), std::memory_order_relaxed);
+        reinsert(change.key, change.tombstone ? TOMBSTONE_MARKER : change.value);
+    }
 }
 
 template <class KeyType, class ValType, PartitionType pType>
-bool Hashtable<KeyType, ValType, pType>::move_log_entry(const Hashtable<KeyType, ValType, pType>::LogChunk &source, LogChunk &target, uint64_t read_pos, bool target_valid_bit) {
+bool Hashtable<KeyType, ValType, pType>::move_log_entry(const Hashtable<KeyType, ValType, pType>::LogChunk &source, LogChunk &target, uint64_t read_pos, int epoch_idx, bool target_valid_bit) {
     if (target.size >= MAX_LOG_ENTRIES) {
         return false;
     }
 
+    if (target.size >= target.durable_high_water) {
+        raise_high_water_mark(target, target.size);
+    }
+
     auto &write_entry = target.entries[target.size];
-    auto &read_entry = target.entries[read_pos];
-    write_entry.persist(read_entry.get_key(), read_entry.get_value(), read_entry.get_epoch(), target_valid_bit);
-    _mm_clflush(write_entry.content);
-    _mm_sfence();
+    auto &read_entry = source.entries[read_pos];
+    int epoch = read_entry.get_epoch();
+    if (target.max_epochs[epoch_idx] < epoch) {
+        target.max_epochs[epoch_idx] = epoch;
+        _mm_clflushopt(&target.max_epochs[epoch_idx]);
+        _mm_sfence();
+    }
+
+    write_entry.persist(read_entry.get_key(), read_entry.get_value(), epoch, target_valid_bit);
     ++target.size;
     ++target.reserved;
     return true;
 }
 
 template <class KeyType, class ValType, PartitionType pType>
-void Hashtable<KeyType, ValType, pType>::compact_payload_log(uint64_t log_idx) {
+void Hashtable<KeyType, ValType, pType>::raise_high_water_mark(LogChunk &chunk, size_t pos) {
+    int mark = std::min<size_t>(pos + LOG_HIGH_WATER_INTERVAL, MAX_LOG_ENTRIES);
+    int cur = chunk.high_water->load();
+    while (cur < mark && !chunk.high_water->compare_exchange_weak(cur, mark)) {}
+
+    // Whoever raised it last, the flush persists a mark of at least ours
+    _mm_clflushopt(chunk.high_water);
+    _mm_sfence();
+
+    int durable = chunk.durable_high_water.load();
+    while (durable < mark && !chunk.durable_high_water.compare_exchange_weak(durable, mark)) {}
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+double Hashtable<KeyType, ValType, pType>::compact_payload_log(uint64_t log_idx) {
 
     uint64_t read_pos = 0;
 
     PayloadLog& log = payload_logs[log_idx];
-    size_t chunk_idx_to_compact = log.compact_order.front();
-    log.compact_order.pop();
-
     PersistentPayloadLogState* p_state = log.persistent_state;
 
+    // Pick the victim by cost-benefit: the garbage we free, weighted by how long the chunk had to collect garbage,
+    // against reading the chunk and writing back its live entries
+    int chunk_idx_to_compact = -1;
+    uint64_t victim_seq;
+    {
+        std::lock_guard guard(log.m);
+        double best_score = -1;
+        for (int chunk_idx = 0; chunk_idx < CHUNKS_PER_PAYLOAD_LOG; ++chunk_idx) {
+            PayloadLogChunk &chunk = log.chunks[chunk_idx];
+            if (chunk.sealed_seq == 0) {
+                continue;
+            }
+            // Without marks, the live bytes are never subtracted from
+            size_t live = IMM_MARK_INVALID ? std::min<size_t>(chunk.live_bytes & LIVE_BYTES_MASK, chunk.size) : 0;
+            if (live > PAYLOAD_GC_MAX_LIVE * chunk.size) {
+                continue;
+            }
+            double garbage = 1 - static_cast<double>(live) / std::max<size_t>(chunk.size, 1);
+            // The age counts in sealed chunks, ties go to the oldest chunk
+            double age = static_cast<double>(log.seal_count - chunk.sealed_seq + 1);
+            double score = garbage * age / (2 - garbage);
+            if (score > best_score || (score == best_score && chunk.sealed_seq < log.chunks[chunk_idx_to_compact].sealed_seq)) {
+                best_score = score;
+                chunk_idx_to_compact = chunk_idx;
+            }
+        }
+        if (chunk_idx_to_compact == -1) {
+            return -1;
+        }
+        victim_seq = log.chunks[chunk_idx_to_compact].sealed_seq;
+        log.chunks[chunk_idx_to_compact].sealed_seq = 0;
+        log.chunks[chunk_idx_to_compact].cleaning = true;
+    }
+
     PayloadLogChunk* old_chunk = &log.chunks[chunk_idx_to_compact];
     PayloadLogChunk* new_chunk = &log.chunks[p_state->compact_chunk];
 
@@ -580,13 +1732,23 @@ void Hashtable<KeyType, ValType, pType>::compact_payload_log(uint64_t log_idx) {
     std::cout << "Compacting to chunk: " << p_state->compact_chunk << std::endl;
 #endif
 
-    while (read_pos < old_chunk->size) {
+    size_t live_bytes = 0;
+    if ((old_chunk->live_bytes & LIVE_BYTES_MASK) == 0) {
+        // The table doesn't point into the chunk anymore, nothing to scan
+        read_pos = old_chunk->size;
+    }
+    int old_epoch = p_state->log_epochs[chunk_idx_to_compact];
+    bool torn = p_state->torn[chunk_idx_to_compact];
+    // Chunks whose size was unknown after recovery end at the first stale entry
+    while ((read_pos = next_payload_log_entry(*old_chunk, old_epoch, torn, read_pos, old_chunk->size)) < old_chunk->size) {
         auto *source_entry = reinterpret_cast<PayloadLogEntry *>(old_chunk->entries + read_pos);
-        size_t entry_size = sizeof(PayloadLogEntry) + source_entry->key_len + source_entry->val_len;
+        size_t entry_size = payload_entry_size(source_entry->key_len, source_entry->val_len);
+        // In torn chunks, only the entries the table points to are known to be real
+        size_t skip_size = torn ? 1ul << PayloadLocator::GRANULARITY_BITS : entry_size;
 
         if (IMM_MARK_INVALID && (static_cast<uint8_t>(source_entry->flags) & 0b1)) {
                 // Entry is invalid, we can skip it
-                read_pos += entry_size;
+                read_pos += skip_size;
                 continue;
         }
 
@@ -599,23 +1761,32 @@ void Hashtable<KeyType, ValType, pType>::compact_payload_log(uint64_t log_idx) {
             DRAMDirectoryEntry* entry = &dram_table[entry_idx];
             //Make sure nobody migrates anything while we are compacting
             entry->m.lock();
+            if (payload_gc_paused) {
+                // bulk_load() started after we picked the victim, lookups don't find its payloads yet. Give the
+                // chunk back, the entries we already moved are reached through their new locators
+                entry->m.unlock();
+                std::lock_guard guard(log.m);
+                uint64_t expected = old_chunk->live_bytes.load();
+                while (!old_chunk->live_bytes.compare_exchange_weak(expected, expected - std::min<uint64_t>(expected & LIVE_BYTES_MASK, live_bytes))) {}
+                old_chunk->sealed_seq = victim_seq;
+                old_chunk->cleaning = false;
+                return -1;
+            }
             std::optional<LookupResult> result= lookup_internal(key_span);
 
-            assert(result.has_value());
-
-            if (result && result->locator.get_offset() == read_pos) {
+            if (result && result->locator.get_position() == PayloadLocator(log_idx, chunk_idx_to_compact, log.persistent_state->log_epochs[chunk_idx_to_compact], read_pos).pos) {
                 // We want to keep this entry
-                size_t size = sizeof(PayloadLogEntry) + source_entry->key_len + source_entry->val_len;
+                size_t size = payload_entry_size(source_entry->key_len, source_entry->val_len);
                 if (new_chunk->size + size >= PAYLOAD_CHUNK_SIZE) {
-                    // We need to start a new chunk to compact to
-                    int next_chunk_idx = (p_state->compact_chunk + 1) & ((1 << PAYLOAD_CHUNK_NUM_BITS) - 1);
-
-                    while (!p_state->free[next_chunk_idx]) {
-                        if (next_chunk_idx == p_state->compact_chunk) {
-                            throw std::runtime_error("Payload log full! No free chunks left.");
-                        }
-                        next_chunk_idx = (next_chunk_idx + 1) & ((1 << PAYLOAD_CHUNK_NUM_BITS) - 1);
+                    // We need to start a new chunk to compact to, the full one can be cleaned later on
+                    std::unique_lock guard(log.m);
+                    int next_chunk_idx;
+                    while ((next_chunk_idx = next_free_payload_chunk(log, p_state->compact_chunk)) < 0) {
+                        guard.unlock();
+                        std::this_thread::yield();
+                        guard.lock();
                     }
+                    reserve_payload_chunk(log_idx, next_chunk_idx);
                     p_state->free[next_chunk_idx] = false;
                     _mm_clflush(p_state);
                     _mm_sfence();
@@ -624,13 +1795,16 @@ void Hashtable<KeyType, ValType, pType>::compact_payload_log(uint64_t log_idx) {
                     _mm_clflush(p_state);
                     _mm_sfence();
 
+                    --log.free_chunk_count;
+                    new_chunk->sealed_seq = ++log.seal_count;
                     new_chunk = &log.chunks[next_chunk_idx];
                 }
 
                 auto *target_entry = reinterpret_cast<PayloadLogEntry *>(new_chunk->entries + new_chunk->size);
-                move_payload_log_entry(source_entry, target_entry);
+                move_payload_log_entry(source_entry, target_entry, log.persistent_state->log_epochs[p_state->compact_chunk]);
+                get_io_counters().compaction_bytes.fetch_add(size, std::memory_order_relaxed);
 
-                PayloadLocator new_locator(log_idx, p_state->compact_chunk, log.persistent_state->log_epochs[p_state->compact_chunk], new_chunk->size);
+                PayloadLocator new_locator = PayloadLocator(log_idx, p_state->compact_chunk, log.persistent_state->log_epochs[p_state->compact_chunk], new_chunk->size).with_tag_of(result->locator);
 
                 if (result->is_volatile) {
                     //Is tombstone has to be false since otherwise the lookup wouldn't have found the element!
@@ -644,10 +1818,13 @@ void Hashtable<KeyType, ValType, pType>::compact_payload_log(uint64_t log_idx) {
                     _mm_clflush(result->storage_location->val_ptrs + result->offset);
                 }
 
+                new_chunk->live_bytes.fetch_add(entry_size);
                 new_chunk->size += entry_size;
                 new_chunk->reserved += entry_size;
+                live_bytes += entry_size;
+                skip_size = entry_size;
             }
-            read_pos += entry_size;
+            read_pos += skip_size;
             entry->m.unlock();
         }
     }
@@ -655,66 +1832,161 @@ void Hashtable<KeyType, ValType, pType>::compact_payload_log(uint64_t log_idx) {
 
 
     //Invalidate all old entries
-    ++log.persistent_state->log_epochs[chunk_idx_to_compact];
+    log.persistent_state->log_epochs[chunk_idx_to_compact] = log.persistent_state->log_epochs[chunk_idx_to_compact] % PayloadLocator::MAX_EPOCH + 1;
     _mm_clflush(log.persistent_state);
     _mm_sfence();
 
-    //Zero log, since it's mmap'd and the size was hopefully set responsibly, it should be 4KB-aligned.
-    __m512i zero = _mm512_set1_epi64(0);
-    for (size_t offset = 0; offset < PAYLOAD_CHUNK_SIZE; offset += 64) {
-        _mm512_stream_si512(reinterpret_cast<__m512i *>(old_chunk->entries + offset), zero);
-    }
-    _mm_sfence();
-    std:: cout << "Compacted log " << log_idx << " from: " << old_chunk->size / (1024.0 * 1024) << "MiB to: " << new_chunk->size / (1024.0 * 1024)  << " MiB!" << std::endl;
+    // The old entries are left in place, they don't carry the new epoch. Pinned values might still point to them, so
+    // the chunk is only written again once the values pinned until now are released.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    old_chunk->reusable_at = reclamation_epoch.load() + 2;
+#if LOG_DEBUG
+    std::cout << "Compacted log " << log_idx << " from: " << old_chunk->size / (1024.0 * 1024) << "MiB to: " << new_chunk->size / (1024.0 * 1024)  << " MiB!" << std::endl;
+#endif
 
     // Finally release the old chunk
-    log.persistent_state->free[chunk_idx_to_compact] = true;
-    log.free_chunk_count++;
+    std::lock_guard guard(log.m);
+    double garbage = 1 - static_cast<double>(live_bytes) / std::max<size_t>(old_chunk->size, 1);
     old_chunk->size = 0;
     old_chunk->reserved = 0;
+    old_chunk->live_bytes = static_cast<uint64_t>(log.persistent_state->log_epochs[chunk_idx_to_compact]) << 32;
+    old_chunk->cleaning = false;
+    log.persistent_state->free[chunk_idx_to_compact] = true;
+    log.persistent_state->torn[chunk_idx_to_compact] = false;
+    log.free_chunk_count++;
     _mm_clflush(log.persistent_state);
     _mm_sfence();
+    return garbage;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::payload_compaction_runner(int thread_idx) {
+    while (!stop_log_compaction) {
+        uint64_t requests = payload_compaction_requests.load();
+        bool compacted = false;
+
+        for (uint64_t log_idx = thread_idx; log_idx < PAYLOAD_LOG_NUM; log_idx += PAYLOAD_COMPACTION_THREADS) {
+            PayloadLog& log = payload_logs[log_idx];
+            if (log.free_chunk_count >= payload_high_watermark || log.gc_paused || payload_gc_paused) {
+                continue;
+            }
+            if (log.is_compacting.test_and_set()) {
+                // An inserter is already cleaning this log
+                continue;
+            }
+            double garbage = compact_payload_log(log_idx);
+            compacted |= garbage >= 0;
+            if (garbage < PAYLOAD_GC_MIN_GARBAGE) {
+                log.gc_paused = true;
+            }
+            log.is_compacting.clear();
+            log.is_compacting.notify_all();
+        }
+
+        if (!compacted) {
+            // Nothing worth cleaning until an inserter fills up a chunk
+            payload_compaction_requests.wait(requests);
+        }
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::mark_payload_dead(PayloadLocator locator) {
+    if (!IMM_MARK_INVALID || locator.is_inline() || is_collected(locator)) {
+        return;
+    }
+    PayloadLog &log = payload_logs[locator.get_log_id()];
+    PayloadLogChunk &chunk = log.chunks[locator.get_chunk_id()];
+
+    // Callers hold the DRAM directory entry of the key, so nobody else marks the same entry meanwhile
+    auto *entry = reinterpret_cast<PayloadLogEntry *>(chunk.entries + locator.get_offset());
+    if ((static_cast<uint8_t>(entry->flags) & 0b1) != 0) {
+        return;
+    }
+    entry->flags |= std::byte(0b1);
+
+    uint64_t size = payload_entry_size(entry->key_len, entry->val_len);
+    uint64_t expected = chunk.live_bytes.load();
+    while ((expected >> 32) == locator.get_epoch() && !chunk.live_bytes.compare_exchange_weak(expected, expected - size)) {}
 }
 
 
 template <class KeyType, class ValType, PartitionType pType>
-void Hashtable<KeyType, ValType, pType>::move_payload_log_entry(PayloadLogEntry* source, PayloadLogEntry* target) {
+size_t Hashtable<KeyType, ValType, pType>::payload_entry_size(size_t key_len, size_t val_len) {
+    return ALIGN(sizeof(PayloadLogEntry) + key_len + val_len, 1ul << PayloadLocator::GRANULARITY_BITS);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::move_payload_log_entry(PayloadLogEntry* source, PayloadLogEntry* target, uint32_t target_epoch) {
     size_t size = sizeof(PayloadLogEntry) + source->key_len + source->val_len;
     memcpy(reinterpret_cast<uint8_t *>(target),
                reinterpret_cast<uint8_t *>(source),
                size);
+    init_payload_log_entry(target, source->key_len, source->val_len, source->flags, target_epoch);
 
-    for (int i = 0; i < size / 64; ++i) {
-        _mm_clflush(target + i * 64);
+    auto start = reinterpret_cast<uintptr_t>(target);
+    for (uintptr_t line = start & ~63ul; line < start + size; line += 64) {
+        _mm_clflush(reinterpret_cast<void *>(line));
     }
     _mm_sfence();
 }
 
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::init_payload_log_entry(PayloadLogEntry* entry, uint64_t key_len, uint64_t val_len, std::byte flags, uint32_t epoch) {
+    entry->key_len = key_len;
+    entry->val_len = val_len;
+    entry->epoch = epoch;
+    entry->flags = flags;
+    entry->padding = 0;
+    entry->check = payload_log_entry_check(key_len, val_len, epoch);
+}
 
 template <class KeyType, class ValType, PartitionType pType>
-void Hashtable<KeyType, ValType, pType>::recover_from_log() {
+uint16_t Hashtable<KeyType, ValType, pType>::payload_log_entry_check(uint64_t key_len, uint64_t val_len, uint32_t epoch) {
+    uint64_t hash = (key_len * 0x9E3779B97F4A7C15ul) ^ ((val_len + (static_cast<uint64_t>(epoch) << 32)) * 0xC2B2AE3D27D4EB4Ful);
+    return static_cast<uint16_t>((hash ^ (hash >> 29)) >> 48);
+}
 
-    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
-    // Recalculate the epochs for DRAM
-    for (int dram_idx = 0; dram_idx < DRAM_DIRECTORY_SIZE; ++dram_idx) {
-        int min_epoch = 10000;
-        int max_epoch = 0;
+template <class KeyType, class ValType, PartitionType pType>
+size_t Hashtable<KeyType, ValType, pType>::next_payload_log_entry(const PayloadLogChunk &chunk, uint32_t epoch, bool torn, size_t read_pos, size_t end) const {
+    while (read_pos + sizeof(PayloadLogEntry) <= end) {
+        auto *entry = reinterpret_cast<const PayloadLogEntry *>(chunk.entries + read_pos);
+        if (entry->epoch == epoch && entry->check == payload_log_entry_check(entry->key_len, entry->val_len, epoch) &&
+            entry->key_len <= end && entry->val_len <= end && read_pos + payload_entry_size(entry->key_len, entry->val_len) <= end) {
+            return read_pos;
+        }
+        if (!torn) {
+            break;
+        }
+        // Look for the next entry behind the gap, entries start at multiples of the granularity
+        read_pos += 1ul << PayloadLocator::GRANULARITY_BITS;
+    }
+    return end;
+}
 
-        for (long counter = 0; counter < (1l << (PMEM_BITS - DRAM_BITS)); ++counter) {
-            long directory_idx = (dram_idx | (counter << DRAM_BITS)) & (PMEM_DIRECTORY_SIZES[0] - 1);
 
-            PMEMDirectoryEntry *entry = get_directory_entry(0, directory_idx);
-            if (entry->epoch < min_epoch) {
-                min_epoch = entry->epoch;
-            }
-            if (entry->epoch > max_epoch) {
-                max_epoch = entry->epoch;
-            }
-        }
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::recover_dram_epoch(uint64_t dram_idx) {
+    int min_epoch = 10000;
+    int max_epoch = 0;
 
-        dram_table[dram_idx].epoch = min_epoch + 1;
+    for (long counter = 0; counter < (1l << (PMEM_BITS - DRAM_BITS)); ++counter) {
+        long directory_idx = (dram_idx | (counter << DRAM_BITS)) & (PMEM_DIRECTORY_SIZES[0] - 1);
+
+        PMEMDirectoryEntry *entry = get_directory_entry(0, directory_idx);
+        if (entry->epoch < min_epoch) {
+            min_epoch = entry->epoch;
+        }
+        if (entry->epoch > max_epoch) {
+            max_epoch = entry->epoch;
+        }
     }
 
+    dram_table[dram_idx].epoch = min_epoch + 1;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::reopen_payload_logs() {
     // This is actually quite hacky, but also elegant in a weird way
     // Since we can distinguish between garbage and a real payload log entry when compacting
     // (payload log entry real <=> a living payload locator points to it)
@@ -722,113 +1994,219 @@ void Hashtable<KeyType, ValType, pType>::recover_from_log() {
     // We then filter out all the chunk entries with the next compaction.
     // The space wastage stays acceptable as we only overestimate the size of two entries:
     // The one we last inserted into and the one we compacted to.
+    // All other chunks in use are full, they are cleaning candidates again.
     if constexpr (!std::is_integral_v<KeyType>) {
         for (int log_idx = 0; log_idx < PAYLOAD_LOG_NUM; ++log_idx) {
             PayloadLog &log = payload_logs[log_idx];
             PersistentPayloadLogState *p_state = log.persistent_state;
+            log.free_chunk_count = 0;
+
+            // Inserts might have been writing behind entries that never made it
+            p_state->torn[p_state->write_chunk] = true;
+            _mm_clflush(&p_state->torn[p_state->write_chunk]);
+            _mm_sfence();
 
             for (int chunk_idx = 0; chunk_idx < CHUNKS_PER_PAYLOAD_LOG; ++chunk_idx) {
                 if (!p_state->free[chunk_idx]) {
                     log.chunks[chunk_idx].size = PAYLOAD_CHUNK_SIZE-1;
                     log.chunks[chunk_idx].reserved = PAYLOAD_CHUNK_SIZE-1;
+                    // Until its live bytes are counted, the chunk's epoch stays 0 so that nothing is subtracted yet
+                    log.chunks[chunk_idx].recovering = true;
+                    if (chunk_idx != p_state->write_chunk && chunk_idx != p_state->compact_chunk) {
+                        log.chunks[chunk_idx].sealed_seq = ++log.seal_count;
+                    }
+                } else {
+                    log.chunks[chunk_idx].live_bytes = static_cast<uint64_t>(p_state->log_epochs[chunk_idx]) << 32;
+                    ++log.free_chunk_count;
                 }
             }
         }
     }
+}
 
-    std::thread *thread_array[LOG_NUM];
-    std::thread *filter_recovery_thread_array[FILTER_RECOVERY_THREAD_NUM];
-    uint64_t max_bucket_ids[FILTER_RECOVERY_THREAD_NUM];
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::recover_from_log() {
 
-    for (uint64_t i = 0; i < LOG_NUM; ++i) {
-        thread_array[i] = new std::thread(&Hashtable::recover_single_log, this, i);
+    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
+    // Recalculate the epochs for DRAM
+    for (int dram_idx = 0; dram_idx < DRAM_DIRECTORY_SIZE; ++dram_idx) {
+        recover_dram_epoch(dram_idx);
     }
 
-    for (auto & t : thread_array) {
-        t->join();
-        delete t;
-    }
-    std::chrono::time_point<std::chrono::high_resolution_clock> log_end = std::chrono::high_resolution_clock::now();
+    reopen_payload_logs();
 
-    for (uint64_t i = 0; i < FILTER_RECOVERY_THREAD_NUM; ++i) {
-        filter_recovery_thread_array[i] = new std::thread(&Hashtable::recover_fingerprints_and_allocator_status, this, i, &*max_bucket_ids);
-    }
+    // Every thread scans a share of the logs and sorts the live entries by the partition of their DRAM directory entry.
+    // All entries of a DRAM directory entry are in the same log, so a partition's entries can then be replayed by a
+    // single thread without locks. Replaying them in log order keeps the newest version of every key.
+    std::vector<RecoveryPartitions> scanned(recovery_threads, RecoveryPartitions(recovery_threads));
+    std::vector<std::thread> threads;
 
-    for (auto & t : filter_recovery_thread_array) {
-        t->join();
-        delete t;
+    for (int i = 0; i < recovery_threads; ++i) {
+        threads.emplace_back([&, i]() {
+            for (int log_idx = i; log_idx < LOG_NUM; log_idx += recovery_threads) {
+                recover_single_log(log_idx, scanned[i]);
+            }
+        });
     }
-
-
-    for (int i = 0; i < FILTER_RECOVERY_THREAD_NUM; ++i) {
-        if (max_bucket_ids[i] > next_empty_bucket_idx) {
-            next_empty_bucket_idx = max_bucket_ids[i];
-        }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    threads.clear();
+    std::chrono::time_point<std::chrono::high_resolution_clock> log_scan_end = std::chrono::high_resolution_clock::now();
+
+    for (int i = 0; i < recovery_threads; ++i) {
+        threads.emplace_back([&, i]() {
+            for (RecoveryPartitions &partitions : scanned) {
+                for (auto [key, value] : partitions[i]) {
+                    reinsert(key, value, true);
+                }
+                std::vector<std::pair<uint64_t, uint64_t>>().swap(partitions[i]);
+            }
+        });
     }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    threads.clear();
+    std::chrono::time_point<std::chrono::high_resolution_clock> log_end = std::chrono::high_resolution_clock::now();
 
-    if (next_empty_bucket_idx > 0) {
-        next_empty_bucket_idx.fetch_add(1, std::memory_order::relaxed);
+    if (!filters_restored) {
+        recover_allocator_status(true);
     }
 
     std::chrono::time_point<std::chrono::high_resolution_clock> filter_recovery_end = std::chrono::high_resolution_clock::now();
 
+    // The table is complete again, so we can tell which payloads it still points to
+    if constexpr (!std::is_integral_v<KeyType>) {
+        std::vector<std::thread> payload_threads;
+        for (uint64_t i = 0; i < PAYLOAD_LOG_NUM; ++i) {
+            payload_threads.emplace_back(&Hashtable::recover_payload_log, this, i);
+        }
+        for (std::thread &t : payload_threads) {
+            t.join();
+        }
+    }
+    std::chrono::time_point<std::chrono::high_resolution_clock> payload_recovery_end = std::chrono::high_resolution_clock::now();
+
+    uint64_t log_scan_us = std::chrono::duration_cast<std::chrono::microseconds>(log_scan_end - start).count();
     uint64_t log_us = std::chrono::duration_cast<std::chrono::microseconds>(log_end - start).count();
     uint64_t filter_us = std::chrono::duration_cast<std::chrono::microseconds>(filter_recovery_end - log_end).count();
-    uint64_t total_us = std::chrono::duration_cast<std::chrono::microseconds>(filter_recovery_end - start).count();
+    uint64_t payload_us = std::chrono::duration_cast<std::chrono::microseconds>(payload_recovery_end - filter_recovery_end).count();
+    uint64_t total_us = std::chrono::duration_cast<std::chrono::microseconds>(payload_recovery_end - start).count();
 
 #if LOG_METRICS
     std::cout << "[Recovery]";
-    std::cout << "(Logs: " << log_us / 1000 << " ms), ";
+    std::cout << "(Logs: " << log_us / 1000 << " ms, of which scanning: " << log_scan_us / 1000 << " ms), ";
     std::cout << "(Filters: " << filter_us / 1000 << " ms), ";
+    if constexpr (!std::is_integral_v<KeyType>) {
+        std::cout << "(Payload Logs: " << payload_us / 1000 << " ms), ";
+    }
     std::cout << "(Total: " << total_us / 1000 << " ms)" << std::endl;
 #endif
 
 }
 
 template <class KeyType, class ValType, PartitionType pType>
-void Hashtable<KeyType, ValType, pType>::recover_single_log(uint64_t log_idx) {
+void Hashtable<KeyType, ValType, pType>::recover_payload_log(uint64_t log_idx) {
+    if constexpr (!std::is_integral_v<KeyType>) {
+        PayloadLog &log = payload_logs[log_idx];
+        PersistentPayloadLogState *p_state = log.persistent_state;
+
+        for (int chunk_idx = 0; chunk_idx < CHUNKS_PER_PAYLOAD_LOG; ++chunk_idx) {
+            PayloadLogChunk &chunk = log.chunks[chunk_idx];
+            int epoch = p_state->log_epochs[chunk_idx];
+            uint64_t live_bytes = 0;
+
+            if (!chunk.recovering) {
+                // Free when the table was opened, the chunk counts its entries itself
+                continue;
+            }
+
+            bool torn = p_state->torn[chunk_idx];
+            for (size_t read_pos = 0; (read_pos = next_payload_log_entry(chunk, epoch, torn, read_pos, chunk.size)) < chunk.size;) {
+                auto *entry = reinterpret_cast<PayloadLogEntry *>(chunk.entries + read_pos);
+                size_t entry_size = payload_entry_size(entry->key_len, entry->val_len);
+                // In torn chunks, a header behind a gap might lie within the bytes of another entry. Only the entries
+                // the table points to are known to be real, so we don't skip others and don't mark them either
+                size_t skip_size = torn ? 1ul << PayloadLocator::GRANULARITY_BITS : entry_size;
+
+                if (!IMM_MARK_INVALID || (static_cast<uint8_t>(entry->flags) & 0b1) == 0) {
+                    std::span<const std::byte> key_span{reinterpret_cast<std::byte *>(entry + 1), entry->key_len};
+                    std::optional<LookupResult> result = lookup_internal(key_span);
+                    if (result && result->locator.get_position() == PayloadLocator(log_idx, chunk_idx, epoch, read_pos).pos) {
+                        live_bytes += entry_size;
+                        skip_size = entry_size;
+                    } else if (IMM_MARK_INVALID && !torn) {
+                        entry->flags |= std::byte(0b1);
+                    }
+                }
+                read_pos += skip_size;
+            }
+            chunk.live_bytes = (static_cast<uint64_t>(epoch) << 32) | live_bytes;
+            chunk.recovering = false;
+        }
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::recover_single_log(uint64_t log_idx, RecoveryPartitions &partitions) {
     Log &log = logs[log_idx];
 
     // Just replay ALL chunks.
     // This is fine, even if we crashed during compaction:
     // If we were compacting, a valid entry might be duplicated: At its old position and at the compaction target.
     // This, however, is not an issue, as the reinsert()-Method will check all existing DRAM entries and will just skip
-    // duplicates.
+    // duplicates. Compaction targets precede the chunks they were compacted from, so log order is still commit order.
     // If we crashed during recovery, this is also not an issue, as we don't write anything to persistent memory
     // during recovery. Recovery therefore is idempotent by design.
     int chunk_idx = log.persistent_state->first_chunk;
+    bool before_write_chunk = true;
 
     while (chunk_idx != -1) {
         LogChunk& cur_chunk = log.chunks[chunk_idx];
         cur_chunk.reserved = 0;
         cur_chunk.size = 0;
+        before_write_chunk &= chunk_idx != log.persistent_state->write_chunk;
 
-        for (int i = 0; i < (1 << (DRAM_BITS - LOG_NUM_BITS)); ++i) {
-            cur_chunk.max_epochs[i] = INT_MAX; // We assume everything has to be recovered -> amortize over runtime
+        // The chunk header tells us whether any of its entries has not been persisted yet
+        bool can_skip = before_write_chunk && !is_pinned(log_idx, cur_chunk);
+
+        if (can_skip) {
+            // Nobody writes to this chunk anymore and compaction won't look at its entries either
+            cur_chunk.reserved = MAX_LOG_ENTRIES;
+            cur_chunk.size = MAX_LOG_ENTRIES;
+            chunk_idx = log.persistent_state->next_of[chunk_idx];
+            continue;
         }
+
         bool expected_valid_bit = log.persistent_state->valid_bits[chunk_idx];
 
-        for (int read_pos = 0; read_pos < MAX_LOG_ENTRIES; ++read_pos) {
-            auto &log_entry = cur_chunk.entries[read_pos];
-            uint64_t key = log_entry.get_key();
+        // Nothing was written behind the high-water mark
+        int scan_end = std::min<int>(cur_chunk.high_water->load(), MAX_LOG_ENTRIES);
+        cur_chunk.durable_high_water = scan_end;
 
-            uint64_t entry_idx;
-            if constexpr (!std::is_integral_v<KeyType>) {
-                assert(pType == PartitionType::Hash);
-                entry_idx = key & (DRAM_DIRECTORY_SIZE - 1);
+        for (int read_pos = 0; read_pos < scan_end;) {
+            __mmask8 valid;
+            __mmask8 live;
+            int batch_size = std::min(8, scan_end - read_pos);
+            if (SIMD_LOG_SCAN && batch_size == 8) {
+                live = filter_log_entries(cur_chunk.entries + read_pos, expected_valid_bit, &valid);
             } else {
-                uint64_t subdivision_idx;
-                entry_idx = get_dram_directory_entry_idx(key, &subdivision_idx);
+                live = filter_log_entries_scalar(cur_chunk.entries + read_pos, batch_size, expected_valid_bit, &valid);
             }
 
+            for (; live != 0; live &= live - 1) {
+                auto &log_entry = cur_chunk.entries[read_pos + __builtin_ctz(live)];
+                uint64_t entry_idx = get_logged_dram_directory_entry_idx(log_entry.get_key());
+                partitions[entry_idx * partitions.size() / DRAM_DIRECTORY_SIZE].emplace_back(log_entry.get_key(), log_entry.get_value());
+            }
 
-            if (log_entry.is_valid(expected_valid_bit)) {
-                if (log_entry.get_epoch() >= dram_table[entry_idx].epoch) {
-                    reinsert(log_entry.get_key(), log_entry.get_value());
-                }
-                ++cur_chunk.reserved;
-                ++cur_chunk.size;
+            if (valid != 0) {
+                // Entries might have been written out of order before the crash, continue behind the last valid one
+                cur_chunk.reserved = read_pos + 32 - __builtin_clz(valid);
+                cur_chunk.size = cur_chunk.reserved.load();
             }
+            read_pos += batch_size;
         }
 
         if (cur_chunk.reserved > 0) {
@@ -841,40 +2219,158 @@ void Hashtable<KeyType, ValType, pType>::recover_single_log(uint64_t log_idx) {
 }
 
 template <class KeyType, class ValType, PartitionType pType>
-void Hashtable<KeyType, ValType, pType>::recover_fingerprints_and_allocator_status(uint64_t thread_idx, uint64_t* allocator_status_array) {
+void Hashtable<KeyType, ValType, pType>::ensure_recovered(uint64_t dram_idx) {
+    if (!recovery_complete.load(std::memory_order_acquire) &&
+            logs[dram_idx & (LOG_NUM - 1)].recovery.load() != LogRecovery::Recovered) {
+        recover_log_partition(dram_idx & (LOG_NUM - 1));
+    }
+}
 
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::recover_log_partition(uint64_t log_idx) {
+    Log &log = logs[log_idx];
 
-    int max_bucket_idx = 0;
-    int level = 0;
+    LogRecovery state = LogRecovery::Pending;
+    if (!log.recovery.compare_exchange_strong(state, LogRecovery::Replaying)) {
+        // Somebody else replays the log
+        while (state != LogRecovery::Recovered) {
+            log.recovery.wait(state);
+            state = log.recovery.load();
+        }
+        return;
+    }
 
-    while (level < cur_pmem_levels->load() && level <= MAX_DRAM_FILTER_LEVEL) {
-        int step = PMEM_DIRECTORY_SIZES[level] / FILTER_RECOVERY_THREAD_NUM;
+    // Nobody else touches the log's DRAM directory entries or the PMem directory entries below them until we are done
+    for (uint64_t dram_idx = log_idx; dram_idx < DRAM_DIRECTORY_SIZE; dram_idx += LOG_NUM) {
+        recover_dram_epoch(dram_idx);
+    }
 
-        uint64_t start_idx = thread_idx * step;
-        uint64_t end_idx = (thread_idx + 1) * step;
-        for (uint64_t directory_idx = start_idx; directory_idx < end_idx; ++directory_idx) {
-            PMEMDirectoryEntry *entry = get_directory_entry(level, directory_idx);
+    for (int level = 0; !filters_restored && level < cur_pmem_levels->load() && level <= MAX_DRAM_FILTER_LEVEL; ++level) {
+        for (uint64_t dram_idx = log_idx; dram_idx < DRAM_DIRECTORY_SIZE; dram_idx += LOG_NUM) {
+            if constexpr (pType == PartitionType::Hash) {
+                // The entries below keep the DRAM directory entry's hash bits
+                for (uint64_t directory_idx = dram_idx; directory_idx < PMEM_DIRECTORY_SIZES[level]; directory_idx += DRAM_DIRECTORY_SIZE) {
+                    recover_fingerprints(level, directory_idx);
+                }
+            } else {
+                // The entries below split the DRAM directory entry's range
+                int shift = PMEM_BITS - DRAM_BITS + FANOUT_BITS * level;
+                for (uint64_t directory_idx = dram_idx << shift; directory_idx < (dram_idx + 1) << shift; ++directory_idx) {
+                    recover_fingerprints(level, directory_idx);
+                }
+            }
+        }
+    }
 
-            // Check if we have to populate DRAM filters
-            int elems_remaining = entry->size;
-            int bucket_idx = 0;
+    RecoveryPartitions entries(1);
+    recover_single_log(log_idx, entries);
+    for (auto [key, value] : entries[0]) {
+        reinsert(key, value);
+    }
 
-            while (elems_remaining > 0) {
-                Bucket *bucket;
-                int count = std::min(elems_remaining, KEYS_PER_BUCKET);
+    log.recovery = LogRecovery::Recovered;
+    log.recovery.notify_all();
+    recovered_logs.fetch_add(1);
+}
 
-                if (level <= MAX_BUCKET_PREALLOC_LEVEL) {
-                    bucket = &get_prealloced_bucket(level, directory_idx, bucket_idx);
-                } else {
-                    uint64_t bucket_pointer = entry->bucket_pointers[bucket_idx];
-                    bucket = &get_bucket(bucket_pointer);
-                }
-                insert_into_filter(reinterpret_cast<const uint64_t *>(bucket->keys), count, level, directory_idx, bucket_idx);
-                ++bucket_idx;
-                elems_remaining -= count;
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::recovery_sweep() {
+    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
+
+    // Replaying a log might need new buckets, so we start with the allocator
+    if (!filters_restored) {
+        recover_allocator_status(false);
+    }
+    allocator_recovered = true;
+    allocator_recovered.notify_all();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < recovery_threads; ++i) {
+        threads.emplace_back([&, i]() {
+            for (int log_idx = i; log_idx < LOG_NUM; log_idx += recovery_threads) {
+                recover_log_partition(log_idx);
             }
-            assert(elems_remaining == 0);
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    std::chrono::time_point<std::chrono::high_resolution_clock> log_end = std::chrono::high_resolution_clock::now();
+
+    if constexpr (!std::is_integral_v<KeyType>) {
+        threads.clear();
+        for (uint64_t i = 0; i < PAYLOAD_LOG_NUM; ++i) {
+            threads.emplace_back(&Hashtable::recover_payload_log, this, i);
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+        payload_gc_paused = false;
+        payload_compaction_requests.fetch_add(1);
+        payload_compaction_requests.notify_all();
+    }
+    std::chrono::time_point<std::chrono::high_resolution_clock> end = std::chrono::high_resolution_clock::now();
+
+    recovery_complete = true;
+    recovery_complete.notify_all();
+
+#if LOG_METRICS
+    std::cout << "[Recovery]";
+    std::cout << "(Logs and Filters: " << std::chrono::duration_cast<std::chrono::milliseconds>(log_end - start).count() << " ms), ";
+    if constexpr (!std::is_integral_v<KeyType>) {
+        std::cout << "(Payload Logs: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - log_end).count() << " ms), ";
+    }
+    std::cout << "(Sweep: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms)" << std::endl;
+#endif
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+double Hashtable<KeyType, ValType, pType>::recovery_progress() const {
+    return static_cast<double>(recovered_logs.load()) / LOG_NUM;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::wait_for_recovery() {
+    recovery_complete.wait(false);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::recover_allocator_status(bool fingerprints) {
+    std::vector<uint64_t> max_bucket_ids(recovery_threads);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < recovery_threads; ++i) {
+        threads.emplace_back(&Hashtable::recover_fingerprints_and_allocator_status, this, i, max_bucket_ids.data(), fingerprints);
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    for (int i = 0; i < recovery_threads; ++i) {
+        if (max_bucket_ids[i] > next_empty_bucket_idx) {
+            next_empty_bucket_idx = max_bucket_ids[i];
+        }
+    }
+
+    if (next_empty_bucket_idx > 0) {
+        next_empty_bucket_idx.fetch_add(1, std::memory_order::relaxed);
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::recover_fingerprints_and_allocator_status(uint64_t thread_idx, uint64_t* allocator_status_array, bool fingerprints) {
+
+
+    int max_bucket_idx = 0;
+    int level = 0;
+
+    while (fingerprints && level < cur_pmem_levels->load() && level <= MAX_DRAM_FILTER_LEVEL) {
+        uint64_t start_idx = PMEM_DIRECTORY_SIZES[level] * thread_idx / recovery_threads;
+        uint64_t end_idx = PMEM_DIRECTORY_SIZES[level] * (thread_idx + 1) / recovery_threads;
+        for (uint64_t directory_idx = start_idx; directory_idx < end_idx; ++directory_idx) {
+            PMEMDirectoryEntry *entry = get_directory_entry(level, directory_idx);
 
+            // Check if we have to populate DRAM filters
+            recover_fingerprints(level, directory_idx);
 
             // Check if we have to find the largest used bucket idx
             if (level > MAX_BUCKET_PREALLOC_LEVEL) {
@@ -891,10 +2387,8 @@ void Hashtable<KeyType, ValType, pType>::recover_fingerprints_and_allocator_stat
     // We now only have to find the largest bucket for the remaining levels
     while (level < cur_pmem_levels->load()) {
         if (level > MAX_BUCKET_PREALLOC_LEVEL) {
-            int step = PMEM_DIRECTORY_SIZES[level] / FILTER_RECOVERY_THREAD_NUM;
-
-            uint64_t start_idx = thread_idx * step;
-            uint64_t end_idx = (thread_idx + 1) * step;
+            uint64_t start_idx = PMEM_DIRECTORY_SIZES[level] * thread_idx / recovery_threads;
+            uint64_t end_idx = PMEM_DIRECTORY_SIZES[level] * (thread_idx + 1) / recovery_threads;
             for (uint64_t directory_idx = start_idx; directory_idx < end_idx; ++directory_idx) {
                 PMEMDirectoryEntry *entry = get_directory_entry(level, directory_idx);
 
@@ -903,14 +2397,106 @@ void Hashtable<KeyType, ValType, pType>::recover_fingerprints_and_allocator_stat
                         max_bucket_idx = cur_idx;
                     }
 
-                }
-            }
+                }
+            }
+
+        }
+        ++level;
+    }
+
+    allocator_status_array[thread_idx] = max_bucket_idx;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::recover_fingerprints(int level, uint64_t directory_idx) {
+    PMEMDirectoryEntry *entry = get_directory_entry(level, directory_idx);
+    int elems_remaining = entry->size;
+    int bucket_idx = 0;
+
+    while (elems_remaining > 0) {
+        Bucket *bucket;
+        int count = std::min(elems_remaining, KEYS_PER_BUCKET);
+
+        if (level <= MAX_BUCKET_PREALLOC_LEVEL) {
+            bucket = &get_prealloced_bucket(level, directory_idx, bucket_idx);
+        } else {
+            uint64_t bucket_pointer = entry->bucket_pointers[bucket_idx];
+            bucket = &get_bucket(bucket_pointer);
+        }
+        insert_into_filter(reinterpret_cast<const uint64_t *>(bucket->keys), count, level, directory_idx, bucket_idx);
+        ++bucket_idx;
+        elems_remaining -= count;
+    }
+    assert(elems_remaining == 0);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+size_t Hashtable<KeyType, ValType, pType>::dram_fingerprint_size() const {
+    size_t size = 0;
+    for (int level = 0; level < cur_pmem_levels->load() && level <= MAX_DRAM_FILTER_LEVEL; ++level) {
+        size += PMEM_DIRECTORY_SIZES[level] * sizeof(DirectoryFingerprint);
+    }
+    return size;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+uint64_t Hashtable<KeyType, ValType, pType>::snapshot_checksum(const uint8_t *data, size_t size) {
+    uint64_t crc = ~0ul;
+    for (size_t pos = 0; pos < size; pos += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + pos, sizeof(uint64_t));
+        crc = _mm_crc32_u64(crc, word);
+    }
+    return ~crc;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::restore_snapshot() {
+    if constexpr (!SHUTDOWN_SNAPSHOT) {
+        return false;
+    }
+    bool clean = snapshot->magic == SNAPSHOT_MAGIC && snapshot->pmem_levels == cur_pmem_levels->load();
+
+    // The table changes from now on, a crash must not find the snapshot valid anymore
+    snapshot->magic = 0;
+    _mm_clflush(snapshot);
+    _mm_sfence();
+
+    if (!clean) {
+        return false;
+    }
 
-        }
-        ++level;
+    size_t size = dram_fingerprint_size();
+    auto *data = reinterpret_cast<uint8_t *>(dram_fingerprint_data.get());
+    fastMemcpy(data, reinterpret_cast<uint8_t *>(snapshot + 1), size);
+    if (snapshot_checksum(data, size) != snapshot->checksum) {
+        memset(data, 0, size);
+        return false;
+    }
+    next_empty_bucket_idx = snapshot->next_empty_bucket_idx;
+    return true;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::save_snapshot() {
+    if constexpr (!SHUTDOWN_SNAPSHOT) {
+        return;
     }
+    size_t size = dram_fingerprint_size();
+    auto *data = reinterpret_cast<uint8_t *>(dram_fingerprint_data.get());
+    reserve_pmem(snapshot_fd, sizeof(PersistentSnapshot), size);
+    fastMemcpy(reinterpret_cast<uint8_t *>(snapshot + 1), data, size);
+
+    snapshot->checksum = snapshot_checksum(data, size);
+    snapshot->next_empty_bucket_idx = next_empty_bucket_idx;
+    snapshot->pmem_levels = cur_pmem_levels->load();
+    _mm_clflush(snapshot);
+    _mm_sfence();
 
-    allocator_status_array[thread_idx] = max_bucket_idx;
+    // Only now the snapshot is complete
+    snapshot->magic = SNAPSHOT_MAGIC;
+    _mm_clflush(snapshot);
+    _mm_sfence();
 }
 
 template <class KeyType, class ValType, PartitionType pType>
@@ -952,6 +2538,12 @@ template <class KeyType, class ValType, PartitionType pType>
 void Hashtable<KeyType, ValType, pType>::migrate(uint64_t directory_entry_idx, int source_level, int target_level) {
     PMEMDirectoryEntry *entry = get_directory_entry(source_level, directory_entry_idx);
 
+    if constexpr (pType == PartitionType::Range) {
+        if (source_level < REFINED_SPLIT_LEVELS) {
+            refine_range_partitions(source_level, directory_entry_idx);
+        }
+    }
+
     uint64_t keys[BUCKETS_PER_DIRECTORY_ENTRY * MAX_VALUES_PER_BUCKET_AFTER_REHASH];
     uint64_t values[BUCKETS_PER_DIRECTORY_ENTRY * MAX_VALUES_PER_BUCKET_AFTER_REHASH];
     int sizes[BUCKETS_PER_DIRECTORY_ENTRY] = {0};
@@ -1001,17 +2593,208 @@ void Hashtable<KeyType, ValType, pType>::migrate(uint64_t directory_entry_idx, i
 
 
     entry->size = 0;
+    entry->merges.store(0, std::memory_order_relaxed);
     _mm_clflushopt(&entry->size);
 
     _mm_sfence();
 
+    get_merge_counters(source_level).drains.fetch_add(1, std::memory_order_relaxed);
+    IOCounters &io = get_io_counters();
+    io.directory_bytes.fetch_add(64, std::memory_order_relaxed);
+    if (source_level > MAX_DRAM_FILTER_LEVEL) {
+        io.fingerprint_bytes.fetch_add(sizeof(DirectoryFingerprint), std::memory_order_relaxed);
+    }
+
     //We don't need to clear the tombstones as we overwrite them when inserting anyway
 }
 
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::should_merge_in_place(int level, PMEMDirectoryEntry *entry) const {
+    switch (merge_policies[level].load(std::memory_order_relaxed)) {
+        case MergePolicy::Tiered:
+            return entry->merges < TIERED_MERGE_RUNS;
+        case MergePolicy::Lazy:
+            if (entry->merges >= TIERED_MERGE_RUNS) {
+                return false;
+            }
+            // Summing up the counters of all stripes on every overflow would cost more than the merge saves
+            if (lazy_merge_checks[level].fetch_add(1, std::memory_order_relaxed) % LAZY_MERGE_SAMPLE_INTERVAL == 0) {
+                lazy_merge_read_amp_high[level].store(merge_stats(level).read_amplification() > LAZY_MERGE_READ_AMP, std::memory_order_relaxed);
+            }
+            return lazy_merge_read_amp_high[level].load(std::memory_order_relaxed);
+        default:
+            return false;
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::merge_in_place(uint64_t directory_entry_idx, int level, int incoming) {
+    constexpr int capacity = BUCKETS_PER_DIRECTORY_ENTRY * KEYS_PER_BUCKET;
+    constexpr int slot_count = 2 * capacity;
+
+    PMEMDirectoryEntry *entry = get_directory_entry(level, directory_entry_idx);
+    const int size = entry->size.load(std::memory_order_relaxed);
+
+    Bucket *entry_buckets[BUCKETS_PER_DIRECTORY_ENTRY];
+    for (int bucket_idx = 0; bucket_idx * KEYS_PER_BUCKET < size; ++bucket_idx) {
+        if (level <= MAX_BUCKET_PREALLOC_LEVEL) {
+            entry_buckets[bucket_idx] = &get_prealloced_bucket(level, directory_entry_idx, bucket_idx);
+        } else {
+            entry_buckets[bucket_idx] = &get_bucket(entry->bucket_pointers[bucket_idx]);
+        }
+    }
+
+    uint64_t keys[capacity];
+    uint64_t values[capacity];
+    for (int i = 0; i < size; ++i) {
+        keys[i] = entry_buckets[i / KEYS_PER_BUCKET]->keys[i % KEYS_PER_BUCKET].load(std::memory_order_relaxed);
+        values[i] = entry_buckets[i / KEYS_PER_BUCKET]->val_ptrs[i % KEYS_PER_BUCKET].load(std::memory_order_relaxed);
+    }
+
+    // Nothing below us could still hold an older version a tombstone has to shadow
+    const bool drop_tombstones = level == cur_pmem_levels->load() - 1;
+
+    // Walk from newest to oldest, a record survives if no newer record carries the same key.
+    // The open addressing table stores record index + 1 of every survivor.
+    int slots[slot_count] = {0};
+    bool keep[capacity];
+    int survivors = 0;
+
+    for (int i = size - 1; i >= 0; --i) {
+        keep[i] = false;
+
+        if constexpr (!std::is_integral_v<KeyType>) {
+            PayloadLocator locator(values[i]);
+            if (is_collected(locator)) {
+                // Entry is no longer reachable as it has been garbage collected in the log -> skip it
+                continue;
+            }
+        }
+
+        uint64_t slot = get_key_or_hash(keys[i]) & (slot_count - 1);
+        bool superseded = false;
+        for (; slots[slot] != 0; slot = (slot + 1) & (slot_count - 1)) {
+            int newer = slots[slot] - 1;
+            if (keys[newer] != keys[i]) {
+                continue;
+            }
+            if constexpr (std::is_integral_v<KeyType>) {
+                superseded = true;
+                break;
+            } else {
+                PayloadLocator locatorA(values[i]);
+                PayloadLocator locatorB(values[newer]);
+
+                if (is_same_key(locatorA, locatorB)) {
+                    mark_payload_dead(locatorA);
+                    superseded = true;
+                    break;
+                }
+            }
+        }
+
+        if (superseded) {
+            continue;
+        }
+        slots[slot] = i + 1;
+
+        if (drop_tombstones && is_deleted(*entry_buckets[i / KEYS_PER_BUCKET], i % KEYS_PER_BUCKET)) {
+            continue;
+        }
+        keep[i] = true;
+        ++survivors;
+    }
+
+    // Remember the attempt even if it was in vain, so the tiered policy eventually drains entries full of unique keys
+    entry->merges.fetch_add(1, std::memory_order_relaxed);
+
+    if (survivors == size || survivors + incoming > capacity) {
+        return false;
+    }
+
+    if constexpr (!std::is_integral_v<KeyType>) {
+        for (int i = 0; drop_tombstones && i < size; ++i) {
+            if (!keep[i] && is_deleted(*entry_buckets[i / KEYS_PER_BUCKET], i % KEYS_PER_BUCKET)) {
+                mark_payload_dead(PayloadLocator(values[i]));
+            }
+        }
+    }
+
+    MergeCounters &counters = get_merge_counters(level);
+
+    uint64_t survivor_keys[capacity];
+    int write_pos = 0;
+    for (int i = 0; i < size; ++i) {
+        if (keep[i]) {
+            survivor_keys[write_pos] = keys[i];
+            // Make the fingerprints a superset of the old and the new content before moving anything
+            insert_into_filter(keys + i, 1, level, directory_entry_idx, write_pos / KEYS_PER_BUCKET);
+            ++write_pos;
+        }
+    }
+
+    // Every survivor moves to a position <= its old one, so the records are still readable after a crash
+    // at any point. Concurrent readers retry while the sequence is odd or if it changed meanwhile.
+    std::atomic<int> &merge_seq = dram_table[get_dram_directory_entry_idx(level, directory_entry_idx)].merge_seq;
+    merge_seq.fetch_add(1);
+    write_pos = 0;
+    uint64_t records_written = 0;
+    for (int i = 0; i < size; ++i) {
+        if (!keep[i]) {
+            continue;
+        }
+        if (write_pos != i) {
+            Bucket *bucket = entry_buckets[write_pos / KEYS_PER_BUCKET];
+            _mm_stream_si64((long long *) (bucket->keys + write_pos % KEYS_PER_BUCKET), keys[i]);
+            _mm_stream_si64((long long *) (bucket->val_ptrs + write_pos % KEYS_PER_BUCKET), values[i]);
+            ++records_written;
+        }
+        ++write_pos;
+    }
+    _mm_sfence();
+
+    entry->size.store(survivors, std::memory_order_relaxed);
+    _mm_clflushopt(&entry->size);
+    _mm_sfence();
+
+    // Now shrink the fingerprints to the surviving keys again
+    for (int bucket_idx = 0; bucket_idx < BUCKETS_PER_DIRECTORY_ENTRY; ++bucket_idx) {
+        BucketFingerprint *fingerprint;
+        if (level <= MAX_DRAM_FILTER_LEVEL) {
+            fingerprint = &dram_fingerprints[level][directory_entry_idx].bucket_fingerprints[bucket_idx];
+        } else {
+            fingerprint = &static_cast<PMEMDirectoryEntryWithFP *>(entry)->fingerprint.bucket_fingerprints[bucket_idx];
+        }
+        fingerprint->fp_part[0].store(0, std::memory_order_relaxed);
+        fingerprint->fp_part[1].store(0, std::memory_order_relaxed);
+        insert_into_filter(survivor_keys + bucket_idx * KEYS_PER_BUCKET, get_size_of_bucket(survivors, bucket_idx), level, directory_entry_idx, bucket_idx);
+    }
+
+    if (level > MAX_DRAM_FILTER_LEVEL) {
+        // 4 Fingerprints fit into the same cache line
+        for (int i = 0; i < BUCKETS_PER_DIRECTORY_ENTRY; i += 4) {
+            _mm_clflushopt(&static_cast<PMEMDirectoryEntryWithFP *>(entry)->fingerprint.bucket_fingerprints[i]);
+        }
+        _mm_sfence();
+    }
+    merge_seq.fetch_add(1, std::memory_order_release);
+
+    counters.in_place_merges.fetch_add(1, std::memory_order_relaxed);
+    counters.records_written.fetch_add(records_written, std::memory_order_relaxed);
+    counters.records_dropped.fetch_add(size - survivors, std::memory_order_relaxed);
+    IOCounters &io = get_io_counters();
+    io.directory_bytes.fetch_add(64, std::memory_order_relaxed);
+    if (level > MAX_DRAM_FILTER_LEVEL) {
+        io.fingerprint_bytes.fetch_add(sizeof(DirectoryFingerprint), std::memory_order_relaxed);
+    }
+    return true;
+}
+
 template <class KeyType, class ValType, PartitionType pType>
 void Hashtable<KeyType, ValType, pType>::bulk_level_insert(int level, int epoch, const uint64_t *keys, const uint64_t *values, const int *sizes) {
 
     if (level >= *cur_pmem_levels) {
+        reserve_level(level);
         bool bla = cur_pmem_levels->compare_exchange_strong(level, level +1);
 
         if (bla) {
@@ -1035,7 +2818,9 @@ void Hashtable<KeyType, ValType, pType>::bulk_level_insert(int level, int epoch,
         PMEMDirectoryEntry *directory_entry = get_directory_entry(level, directory_entry_idx);
 
         if (directory_entry->size + sizes[i] > BUCKETS_PER_DIRECTORY_ENTRY * KEYS_PER_BUCKET) {
-            migrate(directory_entry_idx, level, level + 1);
+            if (!should_merge_in_place(level, directory_entry) || !merge_in_place(directory_entry_idx, level, sizes[i])) {
+                migrate(directory_entry_idx, level, level + 1);
+            }
         }
 
 
@@ -1070,10 +2855,6 @@ void Hashtable<KeyType, ValType, pType>::rehash(Bucket &bucket, int size, int le
             uint64_t divisor = level == 0 ? 1 << (PMEM_BITS - DRAM_BITS) : 1 << FANOUT_BITS;
 
             uint64_t base_bucket = (directory_idx / divisor) * divisor;
-            if (level >= 1 && base_bucket % 16 != 0) {
-                std::cout << "Error!" << std::endl;
-            }
-            //std::cout << level << ", " << directory_idx << std::endl;
             directory_idx -= base_bucket;
             assert(directory_idx <= 15);
         }
@@ -1095,26 +2876,21 @@ void Hashtable<KeyType, ValType, pType>::rehash(Bucket &bucket, int size, int le
                 PayloadLocator locatorA(bucket.val_ptrs[key_idx]);
                 PayloadLocator locatorB(values[directory_idx * MAX_VALUES_PER_BUCKET_AFTER_REHASH + offset]);
 
-                if (locatorA.get_epoch() != payload_logs[locatorA.get_log_id()].persistent_state->log_epochs[locatorA.get_chunk_id()]) {
+                if (is_collected(locatorA)) {
                     // Entry is no longer reachable as it has been garbage collected in the log -> skip it
                     continue;
                 }
                 // locatorB must point to a valid entry as otherwise it wouldn't have been added to the values to migrate in the first place
 
-                auto *entryA = reinterpret_cast<PayloadLogEntry *>(payload_logs[locatorA.get_log_id()].chunks[locatorA.get_chunk_id()].entries + locatorA.get_offset());
-                auto *entryB = reinterpret_cast<PayloadLogEntry *>(payload_logs[locatorB.get_log_id()].chunks[locatorB.get_chunk_id()].entries + locatorB.get_offset());
-
-
-                if (entryA->key_len == entryB->key_len && memcmp(entryA+1, entryB+1, entryA->key_len) == 0) {
+                if (is_same_key(locatorA, locatorB)) {
                     values[directory_idx * MAX_VALUES_PER_BUCKET_AFTER_REHASH + offset] = bucket.val_ptrs[key_idx];
 
-                    if (IMM_MARK_INVALID) {
-                        // We DON'T add a persistency barrier here BY DESIGN.
-                        // If we crash, we have to look at all unmarked tuples anyway.
-                        // If it turns out that one flag wasn't updated, we will notice when we try to look it up during compaction.
-                        // This saves us a lot of cost during runtime at only a really small cost during recovery
-                        entryA->flags |= std::byte(0b1);
-                    }
+                    // The bucket is in insertion order, so B is the superseded entry.
+                    // We DON'T add a persistency barrier here BY DESIGN.
+                    // If we crash, we have to look at all unmarked tuples anyway.
+                    // If it turns out that one flag wasn't updated, we will notice when we try to look it up during compaction.
+                    // This saves us a lot of cost during runtime at only a really small cost during recovery
+                    mark_payload_dead(locatorB);
                     continue;
                 }
             }
@@ -1122,7 +2898,7 @@ void Hashtable<KeyType, ValType, pType>::rehash(Bucket &bucket, int size, int le
 
         if constexpr (!std::is_integral_v<KeyType>) {
             PayloadLocator locator(bucket.val_ptrs[key_idx]);
-            if (locator.get_epoch() != payload_logs[locator.get_log_id()].persistent_state->log_epochs[locator.get_chunk_id()]) {
+            if (is_collected(locator)) {
                 // Entry is no longer reachable as it has been garbage collected in the log -> skip it
                 continue;
             }
@@ -1198,7 +2974,7 @@ int Hashtable<KeyType, ValType, pType>::try_bulk_insert(int level, uint64_t dire
             _mm_clflushopt(&static_cast<PMEMDirectoryEntryWithFP*>(directory_entry)->fingerprint.bucket_fingerprints[i]);
         }
     }
-    if (allocated_new_bucket && level < MAX_BUCKET_PREALLOC_LEVEL) {
+    if (allocated_new_bucket && level > MAX_BUCKET_PREALLOC_LEVEL) {
         // 8 Bucket pointers fit into the same cache line
         for (int i = 0; i < BUCKETS_PER_DIRECTORY_ENTRY; i += 8) {
             _mm_clflushopt(&directory_entry->bucket_pointers[i]);
@@ -1217,40 +2993,422 @@ int Hashtable<KeyType, ValType, pType>::try_bulk_insert(int level, uint64_t dire
     _mm_clflushopt(&directory_entry->size);
     _mm_sfence();
 
+    MergeCounters &counters = get_merge_counters(level);
+    counters.entries_written.fetch_add(1, std::memory_order_relaxed);
+    counters.records_written.fetch_add(elems_inserted, std::memory_order_relaxed);
+    IOCounters &io = get_io_counters();
+    io.directory_bytes.fetch_add(allocated_new_bucket && level > MAX_BUCKET_PREALLOC_LEVEL ? 3 * 64 : 64, std::memory_order_relaxed);
+    if (level > MAX_DRAM_FILTER_LEVEL) {
+        io.fingerprint_bytes.fetch_add(sizeof(DirectoryFingerprint), std::memory_order_relaxed);
+    }
+
     return elems_inserted;
 }
 
 
-//Source: https://github.com/FastFilter/fastfilter_cpp/blob/master/src/bloom/simd-block.h
-inline __m128i MakeMask(const uint32_t hash) noexcept {
-    const __m128i ones = _mm_set1_epi32(1);
-    // Odd contants for hashing:
-    const __m128i rehash = _mm_setr_epi32(0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
-                                          0xa2b7289dU);
-    // Load hash into a YMM register, repeated eight times
-    __m128i hash_data = _mm_set1_epi32(hash);
-    // Multiply-shift hashing ala Dietzfelbinger et al.: multiply 'hash' by four different
-    // odd constants, then keep the 5 most significant bits from each product.
-    hash_data = _mm_mullo_epi32(rehash, hash_data);
-    hash_data = _mm_srli_epi32(hash_data, 27);
-    // Use these 5 bits to shift a single bit to a location in each 32-bit lane
-    return _mm_sllv_epi32(ones, hash_data);
+//Source: https://github.com/FastFilter/fastfilter_cpp/blob/master/src/bloom/simd-block.h
+inline __m128i MakeMask(const uint32_t hash) noexcept {
+    const __m128i ones = _mm_set1_epi32(1);
+    // Odd contants for hashing:
+    const __m128i rehash = _mm_setr_epi32(0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
+                                          0xa2b7289dU);
+    // Load hash into a YMM register, repeated eight times
+    __m128i hash_data = _mm_set1_epi32(hash);
+    // Multiply-shift hashing ala Dietzfelbinger et al.: multiply 'hash' by four different
+    // odd constants, then keep the 5 most significant bits from each product.
+    hash_data = _mm_mullo_epi32(rehash, hash_data);
+    hash_data = _mm_srli_epi32(hash_data, 27);
+    // Use these 5 bits to shift a single bit to a location in each 32-bit lane
+    return _mm_sllv_epi32(ones, hash_data);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::bulk_load_directory_entry(int level, uint64_t directory_entry_idx,
+                                                                    const uint64_t *keys,
+                                                                    const uint64_t *values,
+                                                                    int size) {
+    PMEMDirectoryEntry *directory_entry = get_directory_entry(level, directory_entry_idx);
+    const int num_buckets = (size + KEYS_PER_BUCKET - 1) / KEYS_PER_BUCKET;
+
+    // The buckets of an entry are allocated in one go
+    uint64_t first_bucket_id = 0;
+    if (level > MAX_BUCKET_PREALLOC_LEVEL) {
+        first_bucket_id = next_empty_bucket_idx.fetch_add(num_buckets, std::memory_order_relaxed) + 1;
+    }
+
+    for (int n = 0; n < num_buckets; ++n) {
+        Bucket *bucket;
+        if (level <= MAX_BUCKET_PREALLOC_LEVEL) {
+            bucket = &get_prealloced_bucket(level, directory_entry_idx, n);
+        } else {
+            directory_entry->bucket_pointers[n] = first_bucket_id + n;
+            bucket = &get_bucket(first_bucket_id + n);
+        }
+
+        int bucket_size = std::min(KEYS_PER_BUCKET, size - n * KEYS_PER_BUCKET);
+        alignas(64) uint64_t slots[2 * KEYS_PER_BUCKET] = {};
+        memcpy(slots, keys + n * KEYS_PER_BUCKET, bucket_size * sizeof(uint64_t));
+        memcpy(slots + KEYS_PER_BUCKET, values + n * KEYS_PER_BUCKET, bucket_size * sizeof(uint64_t));
+
+        // Whole buckets are written, so they never have to be read into the cache
+        for (int i = 0; i < 2 * KEYS_PER_BUCKET; i += 8) {
+            _mm512_stream_si512(reinterpret_cast<__m512i *>(bucket) + i / 8, _mm512_load_si512(slots + i));
+        }
+
+        insert_into_filter(keys + n * KEYS_PER_BUCKET, bucket_size, level, directory_entry_idx, n);
+    }
+
+    directory_entry->size.store(size, std::memory_order_relaxed);
+    directory_entry->merges.store(0, std::memory_order_relaxed);
+
+    if (level > MAX_DRAM_FILTER_LEVEL) {
+        // 4 Fingerprints fit into the same cache line
+        for (int i = 0; i < BUCKETS_PER_DIRECTORY_ENTRY; i += 4) {
+            _mm_clflushopt(&static_cast<PMEMDirectoryEntryWithFP*>(directory_entry)->fingerprint.bucket_fingerprints[i]);
+        }
+    }
+    if (level > MAX_BUCKET_PREALLOC_LEVEL) {
+        // 8 Bucket pointers fit into the same cache line
+        for (int i = 0; i < BUCKETS_PER_DIRECTORY_ENTRY; i += 8) {
+            _mm_clflushopt(&directory_entry->bucket_pointers[i]);
+        }
+    }
+    _mm_clflushopt(&directory_entry->size);
+
+    MergeCounters &counters = get_merge_counters(level);
+    counters.entries_written.fetch_add(1, std::memory_order_relaxed);
+    counters.records_written.fetch_add(size, std::memory_order_relaxed);
+    IOCounters &io = get_io_counters();
+    io.directory_bytes.fetch_add(level > MAX_BUCKET_PREALLOC_LEVEL ? 3 * 64 : 64, std::memory_order_relaxed);
+    if (level > MAX_DRAM_FILTER_LEVEL) {
+        io.fingerprint_bytes.fetch_add(sizeof(DirectoryFingerprint), std::memory_order_relaxed);
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::lookup(KeyType key, uint8_t *data) {
+
+    IOCounters &io = get_io_counters();
+    io.lookups.fetch_add(1, std::memory_order_relaxed);
+
+    // Pinned before the locator is read, so that its chunk can't be reused while we copy from it
+    PinnedValue pinned;
+    if constexpr (!std::is_integral_v<KeyType>) {
+        pinned.pin = pin_payload_chunks();
+    }
+
+    for (;;) {
+        std::optional<LookupResult> result = lookup_internal(key);
+        if (result && !result->deleted) {
+            if constexpr (std::is_integral_v<KeyType>) {
+                memcpy(data, &result->locator.pos, sizeof(ValType));
+                io.logical_bytes_read.fetch_add(sizeof(ValType), std::memory_order_relaxed);
+            } else if (result->locator.is_inline()) {
+                memcpy(data, &result->locator.pos, result->locator.get_inline_value_len());
+                io.logical_bytes_read.fetch_add(result->locator.get_inline_value_len(), std::memory_order_relaxed);
+            } else {
+                PayloadLogEntry *entry = get_payload_entry(result->locator);
+                if (entry == nullptr) {
+                    if (!still_points_to(key, result->locator)) {
+                        continue;
+                    }
+                    throw std::runtime_error("Corrupt payload log entry.");
+                }
+                uint8_t *stored = reinterpret_cast<uint8_t*>(entry+1) + entry->key_len;
+                if ((static_cast<uint8_t>(entry->flags) & PAYLOAD_ENTRY_COMPRESSED) != 0) {
+                    uint32_t raw_len;
+                    memcpy(&raw_len, stored, sizeof(uint32_t));
+                    if (!LzCodec::decompress(stored + sizeof(uint32_t), entry->val_len - sizeof(uint32_t), data, raw_len)) {
+                        if (!still_points_to(key, result->locator)) {
+                            continue;
+                        }
+                        throw std::runtime_error("Corrupt compressed payload log entry.");
+                    }
+                    io.logical_bytes_read.fetch_add(raw_len, std::memory_order_relaxed);
+                } else {
+                    fastMemcpy(data, stored, entry->val_len);
+                    io.logical_bytes_read.fetch_add(entry->val_len, std::memory_order_relaxed);
+                }
+                io.pmem_bytes_read.fetch_add(sizeof(PayloadLogEntry) + entry->key_len + entry->val_len, std::memory_order_relaxed);
+            }
+            return true;
+        }
+        return false;
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+std::optional<size_t> Hashtable<KeyType, ValType, pType>::value_size(KeyType key) {
+    PinnedValue pinned;
+    if constexpr (!std::is_integral_v<KeyType>) {
+        pinned.pin = pin_payload_chunks();
+    }
+
+    for (;;) {
+        std::optional<LookupResult> result = lookup_internal(key);
+        if (!result || result->deleted) {
+            return {};
+        }
+        if constexpr (std::is_integral_v<KeyType>) {
+            return sizeof(ValType);
+        } else if (result->locator.is_inline()) {
+            return result->locator.get_inline_value_len();
+        } else {
+            PayloadLogEntry *entry = get_payload_entry(result->locator);
+            if (entry == nullptr) {
+                if (!still_points_to(key, result->locator)) {
+                    continue;
+                }
+                throw std::runtime_error("Corrupt payload log entry.");
+            }
+            if ((static_cast<uint8_t>(entry->flags) & PAYLOAD_ENTRY_COMPRESSED) == 0) {
+                get_io_counters().pmem_bytes_read.fetch_add(sizeof(PayloadLogEntry), std::memory_order_relaxed);
+                return entry->val_len;
+            }
+            uint32_t raw_len;
+            memcpy(&raw_len, reinterpret_cast<uint8_t *>(entry + 1) + entry->key_len, sizeof(uint32_t));
+            get_io_counters().pmem_bytes_read.fetch_add(sizeof(PayloadLogEntry) + entry->key_len + sizeof(uint32_t), std::memory_order_relaxed);
+            return raw_len;
+        }
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+std::optional<size_t> Hashtable<KeyType, ValType, pType>::lookup_range(KeyType key, size_t offset, size_t len, uint8_t *data) {
+
+    IOCounters &io = get_io_counters();
+    io.lookups.fetch_add(1, std::memory_order_relaxed);
+
+    PinnedValue pinned;
+    if constexpr (!std::is_integral_v<KeyType>) {
+        pinned.pin = pin_payload_chunks();
+    }
+
+    for (;;) {
+        std::optional<LookupResult> result = lookup_internal(key);
+        if (!result || result->deleted) {
+            return {};
+        }
+
+        // Values kept in the table itself are at most 8 bytes
+        auto copy_small = [&](size_t size) {
+            size_t copied = offset < size ? std::min(len, size - offset) : 0;
+            memcpy(data, reinterpret_cast<uint8_t *>(&result->locator.pos) + offset, copied);
+            io.logical_bytes_read.fetch_add(copied, std::memory_order_relaxed);
+            return copied;
+        };
+
+        if constexpr (std::is_integral_v<KeyType>) {
+            return copy_small(sizeof(ValType));
+        } else if (result->locator.is_inline()) {
+            return copy_small(result->locator.get_inline_value_len());
+        } else {
+            PayloadLogEntry *entry = get_payload_entry(result->locator);
+            if (entry == nullptr) {
+                if (!still_points_to(key, result->locator)) {
+                    continue;
+                }
+                throw std::runtime_error("Corrupt payload log entry.");
+            }
+            uint8_t *stored = reinterpret_cast<uint8_t*>(entry+1) + entry->key_len;
+            size_t copied;
+
+            if ((static_cast<uint8_t>(entry->flags) & PAYLOAD_ENTRY_COMPRESSED) != 0) {
+                uint32_t raw_len;
+                memcpy(&raw_len, stored, sizeof(uint32_t));
+                copied = offset < raw_len ? std::min(len, raw_len - offset) : 0;
+
+                // Compressed values can only be decoded from their start, but we stop after the requested bytes
+                bool valid;
+                if (offset == 0) {
+                    valid = LzCodec::decompress_prefix(stored + sizeof(uint32_t), entry->val_len - sizeof(uint32_t), data, copied);
+                } else {
+                    auto prefix = std::make_unique<uint8_t[]>(offset + copied);
+                    valid = LzCodec::decompress_prefix(stored + sizeof(uint32_t), entry->val_len - sizeof(uint32_t), prefix.get(), offset + copied);
+                    memcpy(data, prefix.get() + offset, copied);
+                }
+                if (!valid) {
+                    if (!still_points_to(key, result->locator)) {
+                        continue;
+                    }
+                    throw std::runtime_error("Corrupt compressed payload log entry.");
+                }
+                io.pmem_bytes_read.fetch_add(sizeof(PayloadLogEntry) + entry->key_len + entry->val_len, std::memory_order_relaxed);
+            } else {
+                copied = offset < entry->val_len ? std::min<size_t>(len, entry->val_len - offset) : 0;
+                if (copied >= STREAMING_READ_MIN_SIZE) {
+                    fastMemcpy(data, stored + offset, copied);
+                } else {
+                    memcpy(data, stored + offset, copied);
+                }
+                io.pmem_bytes_read.fetch_add(sizeof(PayloadLogEntry) + copied, std::memory_order_relaxed);
+            }
+            io.logical_bytes_read.fetch_add(copied, std::memory_order_relaxed);
+            return copied;
+        }
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+std::optional<class Hashtable<KeyType, ValType, pType>::PinnedValue> Hashtable<KeyType, ValType, pType>::lookup_view(KeyType key) {
+
+    IOCounters &io = get_io_counters();
+    io.lookups.fetch_add(1, std::memory_order_relaxed);
+
+    // Pinned before the locator is read, so that its chunk can't be reused before we point into it
+    PinnedValue view;
+    view.pin = pin_payload_chunks();
+
+    for (;;) {
+        std::optional<LookupResult> result = lookup_internal(key);
+        if (!result || result->deleted) {
+            return {};
+        }
+
+        if constexpr (std::is_integral_v<KeyType>) {
+            view.small_value = result->locator.pos;
+            view.size = sizeof(ValType);
+        } else if (result->locator.is_inline()) {
+            view.small_value = result->locator.pos;
+            view.size = result->locator.get_inline_value_len();
+        } else {
+            PayloadLogEntry *entry = get_payload_entry(result->locator);
+            if (entry == nullptr) {
+                if (!still_points_to(key, result->locator)) {
+                    continue;
+                }
+                throw std::runtime_error("Corrupt payload log entry.");
+            }
+            auto *stored = reinterpret_cast<std::byte *>(entry + 1) + entry->key_len;
+            if ((static_cast<uint8_t>(entry->flags) & PAYLOAD_ENTRY_COMPRESSED) != 0) {
+                uint32_t raw_len;
+                memcpy(&raw_len, stored, sizeof(uint32_t));
+                view.decompressed = std::make_unique<std::byte[]>(raw_len);
+                if (!LzCodec::decompress(reinterpret_cast<uint8_t *>(stored) + sizeof(uint32_t), entry->val_len - sizeof(uint32_t),
+                                         reinterpret_cast<uint8_t *>(view.decompressed.get()), raw_len)) {
+                    if (!still_points_to(key, result->locator)) {
+                        continue;
+                    }
+                    throw std::runtime_error("Corrupt compressed payload log entry.");
+                }
+                view.size = raw_len;
+                io.pmem_bytes_read.fetch_add(sizeof(PayloadLogEntry) + entry->key_len + entry->val_len, std::memory_order_relaxed);
+            } else {
+                // Views may be held for long, so they pin only their chunk. The reclamation epoch keeps the chunk from
+                // being reused until the chunk pin is seen.
+                std::atomic<int64_t> &chunk_pin = payload_logs[result->locator.get_log_id()].chunks[result->locator.get_chunk_id()].view_pins;
+                chunk_pin.fetch_add(1);
+                view.pin->fetch_sub(1);
+                view.pin = &chunk_pin;
+                view.data = stored;
+                view.size = entry->val_len;
+                io.pmem_bytes_read.fetch_add(sizeof(PayloadLogEntry), std::memory_order_relaxed);
+            }
+        }
+
+        if (view.data == nullptr) {
+            // Copied values don't need the pin
+            view.pin->fetch_sub(1);
+            view.pin = nullptr;
+        }
+        io.logical_bytes_read.fetch_add(view.size, std::memory_order_relaxed);
+        return view;
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+Hashtable<KeyType, ValType, pType>::PinnedValue::PinnedValue(PinnedValue &&other) noexcept {
+    *this = std::move(other);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+class Hashtable<KeyType, ValType, pType>::PinnedValue &Hashtable<KeyType, ValType, pType>::PinnedValue::operator=(PinnedValue &&other) noexcept {
+    if (this != &other) {
+        if (pin != nullptr) {
+            pin->fetch_sub(1);
+        }
+        pin = std::exchange(other.pin, nullptr);
+        data = std::exchange(other.data, nullptr);
+        size = std::exchange(other.size, 0);
+        small_value = other.small_value;
+        decompressed = std::move(other.decompressed);
+    }
+    return *this;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+Hashtable<KeyType, ValType, pType>::PinnedValue::~PinnedValue() {
+    if (pin != nullptr) {
+        pin->fetch_sub(1);
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+std::span<const std::byte> Hashtable<KeyType, ValType, pType>::PinnedValue::value() const {
+    if (data != nullptr) {
+        return {data, size};
+    }
+    if (decompressed) {
+        return {decompressed.get(), size};
+    }
+    return {reinterpret_cast<const std::byte *>(&small_value), size};
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+std::atomic<int64_t> *Hashtable<KeyType, ValType, pType>::pin_payload_chunks() {
+    ReaderPins &pins = reader_pins[get_stat_stripe()];
+    while (true) {
+        uint64_t epoch = reclamation_epoch.load();
+        std::atomic<int64_t> &count = pins.count[epoch & 1];
+        count.fetch_add(1);
+        // If the epoch advanced meanwhile, the pin might not have been seen
+        if (reclamation_epoch.load() == epoch) {
+            return &count;
+        }
+        count.fetch_sub(1);
+    }
 }
 
 template <class KeyType, class ValType, PartitionType pType>
-bool Hashtable<KeyType, ValType, pType>::lookup(KeyType key, uint8_t *data) {
+void Hashtable<KeyType, ValType, pType>::try_advance_reclamation_epoch() {
+    uint64_t epoch = reclamation_epoch.load();
+    // The previous epoch has the other parity, its counters are reused by the next one
+    for (int i = 0; i < STAT_STRIPES; ++i) {
+        if (reader_pins[i].count[(epoch + 1) & 1].load() != 0) {
+            return;
+        }
+    }
+    reclamation_epoch.compare_exchange_strong(epoch, epoch + 1);
+}
 
-    std::optional<LookupResult> result = lookup_internal(key);
-    if (result && !result->deleted) {
-        if constexpr (std::is_integral_v<KeyType>) {
-            memcpy(data, &result->locator.pos, sizeof(ValType));
-        } else {
-            auto *entry = reinterpret_cast<PayloadLogEntry *>(payload_logs[result->locator.get_log_id()].chunks[result->locator.get_chunk_id()].entries + result->locator.get_offset());
-            fastMemcpy(data, reinterpret_cast<uint8_t*>(entry+1) + entry->key_len, entry->val_len);
+template <class KeyType, class ValType, PartitionType pType>
+int Hashtable<KeyType, ValType, pType>::next_free_payload_chunk(PayloadLog &log, int chunk_idx) {
+    bool pinned = false;
+    for (int idx = (chunk_idx + 1) & (CHUNKS_PER_PAYLOAD_LOG - 1); ; idx = (idx + 1) & (CHUNKS_PER_PAYLOAD_LOG - 1)) {
+        if (log.persistent_state->free[idx]) {
+            if (is_reusable(log.chunks[idx])) {
+                return idx;
+            }
+            pinned = true;
+        }
+        if (idx == chunk_idx) {
+            if (!pinned) {
+                throw std::runtime_error("Payload log full! No free chunks left.");
+            }
+            // All free chunks might still be read, the caller has to wait for the pinned values without the log lock
+            return -1;
         }
-        return true;
     }
-    return false;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::is_reusable(const PayloadLogChunk &chunk) {
+    // A chunk freed in epoch e is reusable once values pinned in e - 1 and e are released
+    for (int i = 0; i < 2 && reclamation_epoch.load() < chunk.reusable_at; ++i) {
+        try_advance_reclamation_epoch();
+    }
+    // Views pin their chunk before releasing the epoch pin, so they are seen once the epoch advanced
+    return reclamation_epoch.load() >= chunk.reusable_at && chunk.view_pins.load() == 0;
 }
 
 template <class KeyType, class ValType, PartitionType pType>
@@ -1258,6 +3416,7 @@ std::optional<class Hashtable<KeyType, ValType, pType>::LookupResult> Hashtable<
 
     uint64_t subdivision_idx;
     uint64_t entry_idx = get_dram_directory_entry_idx(key, &subdivision_idx);
+    ensure_recovered(entry_idx);
 
     uint64_t subdivision_start = subdivision_idx * BUCKETS_PER_SUBDIVISION;
     uint64_t subdivision_end = subdivision_idx * BUCKETS_PER_SUBDIVISION + BUCKETS_PER_SUBDIVISION - 1;
@@ -1266,9 +3425,10 @@ std::optional<class Hashtable<KeyType, ValType, pType>::LookupResult> Hashtable<
 
 RETRY:
     int epoch = directory_entry.epoch;
+    uint8_t sizes[BUCKETS_PER_DIRECTORY_ENTRY];
 
     for (int idx = subdivision_start; idx <= subdivision_end; ++idx) {
-        Bucket &bucket = dram_buckets[entry_idx * BUCKETS_PER_DIRECTORY_ENTRY + idx];
+        sizes[idx - subdivision_start] = directory_entry.sizes[idx].load(std::memory_order_acquire);
         auto result = lookup_in_DRAM_bucket(entry_idx, idx, key);
 
         if (result) {
@@ -1283,14 +3443,25 @@ RETRY:
     // We didn't have a hit in DRAM, so let's look in the PMEM layers.
     int level = 0;
 
-    while (level < *cur_pmem_levels) {
-        auto result = lookup_in_level(level, key);
-        if (result) {
-            return result;
-        }
+    std::optional<LookupResult> result;
+    while (!result && level < *cur_pmem_levels) {
+        result = lookup_in_level(level, key);
         ++level;
     }
-    return {};
+
+    if constexpr (!std::is_integral_v<KeyType>) {
+        // A version inserted after we scanned DRAM supersedes the ones we found, and the cleaner may have collected
+        // them already - look again instead of missing the key
+        for (int idx = subdivision_start; idx <= subdivision_end; ++idx) {
+            if (directory_entry.sizes[idx].load(std::memory_order_acquire) != sizes[idx - subdivision_start]) {
+                goto RETRY;
+            }
+        }
+        if (directory_entry.epoch != epoch) {
+            goto RETRY;
+        }
+    }
+    return result;
 }
 
 
@@ -1299,9 +3470,21 @@ std::optional<class Hashtable<KeyType, ValType, pType>::LookupResult> Hashtable<
         int level, KeyType key) {
     uint64_t directory_entry_idx = get_pmem_directory_entry_idx(level, get_key_representation(key));
     const __m128i mask = MakeMask(hash_key(key) >> 32);
+    MergeCounters &counters = get_merge_counters(level);
+    IOCounters &io = get_io_counters();
+    counters.lookups.fetch_add(1, std::memory_order_relaxed);
+
+    std::atomic<int> &merge_seq = dram_table[get_dram_directory_entry_idx(level, directory_entry_idx)].merge_seq;
 
 RETRY:
     BucketFingerprint *fingerprint;
+    // In-place merges move records and rebuild the fingerprints, so nothing we read is valid if one ran meanwhile
+    int seq = merge_seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+        _mm_pause();
+        goto RETRY;
+    }
+    io.pmem_bytes_read.fetch_add(level <= MAX_DRAM_FILTER_LEVEL ? 64 : 64 + sizeof(DirectoryFingerprint), std::memory_order_relaxed);
 
     for (int i = BUCKETS_PER_DIRECTORY_ENTRY - 1; i >= 0; --i) { //TODO: Only lock in buckets with elements!
         if (level <= MAX_DRAM_FILTER_LEVEL) {
@@ -1312,6 +3495,8 @@ RETRY:
         }
 
         if (_mm_testc_si128(*reinterpret_cast<__m128i *>(fingerprint), mask)) {
+            counters.bucket_probes.fetch_add(1, std::memory_order_relaxed);
+            io.pmem_bytes_read.fetch_add(sizeof(Bucket), std::memory_order_relaxed);
             PMEMDirectoryEntry *directory_entry = get_directory_entry(level, directory_entry_idx);
             Bucket *bucket;
             if (level <= MAX_BUCKET_PREALLOC_LEVEL) {
@@ -1327,7 +3512,8 @@ RETRY:
 
             auto result = lookup_in_bucket(*directory_entry, *bucket, i, key);
             if (result) {
-                if (directory_entry->epoch == epoch && directory_entry->size == size) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (directory_entry->epoch == epoch && directory_entry->size == size && merge_seq.load(std::memory_order_relaxed) == seq) {
                     return result;
                 } else {
                     goto RETRY;
@@ -1335,6 +3521,10 @@ RETRY:
             }
         }
     }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (merge_seq.load(std::memory_order_relaxed) != seq) {
+        goto RETRY;
+    }
     return {};
 }
 
@@ -1364,10 +3554,10 @@ std::optional<class Hashtable<KeyType, ValType, pType>::LookupResult> Hashtable<
                 if constexpr (std::is_integral_v<KeyType>) {
                     return LookupResult{is_deleted(bucket, index + offset), PayloadLocator(bucket.val_ptrs[index + offset]), &bucket, false, static_cast<short>(index + offset) };
                 } else {
-                    PayloadLocator locator(bucket.val_ptrs[index + offset]);
+                    PayloadLocator locator;
                     bool deleted = is_deleted(bucket, index + offset);
 
-                    if (deleted || is_alive(locator, key)) {
+                    if (slot_matches(bucket, index + offset, key, deleted, &locator)) {
                         return LookupResult{deleted, locator, &bucket, false, static_cast<short>(index + offset) };
                     }
                 }
@@ -1378,11 +3568,34 @@ std::optional<class Hashtable<KeyType, ValType, pType>::LookupResult> Hashtable<
     return {};
 }
 
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::slot_matches(const Bucket &bucket, int slot, KeyType key, bool deleted, PayloadLocator *locator) {
+    *locator = PayloadLocator(bucket.val_ptrs[slot]);
+    while (true) {
+        if (deleted ? matches_tag(*locator, key) : is_alive(*locator, key)) {
+            return true;
+        }
+        // Cleaning swaps in the new locator before it marks the old chunk as collected. If that happened since we
+        // read the slot, it holds the moved value by now. Otherwise the record is an old version whose value is gone.
+        PayloadLocator again(bucket.val_ptrs[slot]);
+        if (!is_collected(*locator) || again.pos == locator->pos) {
+            return false;
+        }
+        *locator = again;
+    }
+}
+
 template <class KeyType, class ValType, PartitionType pType>
 bool Hashtable<KeyType, ValType, pType>::is_alive(PayloadLocator locator, KeyType key) {
     if constexpr (!std::is_integral_v<KeyType>) {
+        if (!matches_tag(locator, key)) {
+            return false;
+        }
+        if (locator.is_inline()) {
+            return true;
+        }
         // Find out whether the log has been compacted since we've been inserted.
-        if (payload_logs[locator.get_log_id()].persistent_state->log_epochs[locator.get_chunk_id()] == locator.get_epoch()) {
+        if (!is_collected(locator)) {
             auto *entryA = reinterpret_cast<PayloadLogEntry *>(payload_logs[locator.get_log_id()].chunks[locator.get_chunk_id()].entries + locator.get_offset());
             if (entryA->key_len == key.size() && memcmp(entryA+1, key.data(), entryA->key_len) == 0) {
                 return true;
@@ -1407,12 +3620,12 @@ std::optional<class Hashtable<KeyType, ValType, pType>::LookupResult> Hashtable<
                 return LookupResult{is_deleted(bucket, i), PayloadLocator(bucket.val_ptrs[i]), &bucket, true, i };
             }
         } else {
-            PayloadLocator locator(bucket.val_ptrs[i]);
+            PayloadLocator locator;
             uint64_t key_hash = hash_key(key);
             if (bucket.keys[i] == key_hash) {
                 bool deleted = is_deleted(bucket, i);
-                if (deleted || is_alive(locator, key)) {
-                    return LookupResult{deleted, PayloadLocator(bucket.val_ptrs[i]), &bucket, true, i };
+                if (slot_matches(bucket, i, key, deleted, &locator)) {
+                    return LookupResult{deleted, locator, &bucket, true, i };
                 }
             }
         }
@@ -1463,7 +3676,7 @@ void Hashtable<KeyType, ValType, pType>::scan_dram_directory_entry(
 
 
     DRAMDirectoryEntry &entry = dram_table[entry_idx];
-    for (int bucket_idx = BUCKETS_PER_DIRECTORY_ENTRY; bucket_idx > 0; --bucket_idx) {
+    for (int bucket_idx = BUCKETS_PER_DIRECTORY_ENTRY - 1; bucket_idx >= 0; --bucket_idx) {
         Bucket &bucket = dram_buckets[entry_idx * BUCKETS_PER_DIRECTORY_ENTRY + bucket_idx];
         uint8_t size = entry.sizes[bucket_idx];
 
@@ -1479,10 +3692,9 @@ void Hashtable<KeyType, ValType, pType>::scan_dram_directory_entry(
 
     // If we didn't find enough elements in this partition, repeat for the next one, tail recursion style
     ++entry_idx;
-    if (results.size() < num_items) {
+    if (results.size() < num_items && entry_idx < DRAM_DIRECTORY_SIZE) {
         //std::cout << "Going to next entry on DRAM: " << entry_idx << std::endl;
-        uint64_t step = std::max(1ul,(MAX-MIN) / DRAM_DIRECTORY_SIZE);
-        uint64_t bucket_min_value = entry_idx * step;
+        uint64_t bucket_min_value = dram_range_lower_bounds[entry_idx << (PMEM_BITS - DRAM_BITS)];
 
         if constexpr (std::is_integral_v<KeyType>) {
             scan_dram_directory_entry(entry_idx, num_items, bucket_min_value, results);
@@ -1524,9 +3736,11 @@ void Hashtable<KeyType, ValType, pType>::scan_pmem_directory_entry(
     }
 
 
-    uint64_t step = std::max(1ul,(MAX-MIN) / PMEM_DIRECTORY_SIZES[level]);
     ++entry_idx;
-    uint64_t bucket_min_value = entry_idx * step;
+    uint64_t bucket_min_value = 0;
+    if (entry_idx % (1 << FANOUT_BITS) != 0) {
+        bucket_min_value = get_range_bounds(level, entry_idx).lower;
+    }
 
     //std::cout << "Test2, :" << entry_idx << std::endl;
 
@@ -1551,15 +3765,192 @@ bool Hashtable<KeyType, ValType, pType>::is_deleted(const Bucket& bucket, uint8_
     if constexpr (std::is_integral_v<KeyType>) {
         return bucket.val_ptrs[pos] == TOMBSTONE_MARKER;
     } else {
-        auto locator = PayloadLocator(bucket.val_ptrs[pos]);
-        auto *entry = reinterpret_cast<PayloadLogEntry *>(payload_logs[locator.get_log_id()].chunks[locator.get_chunk_id()].entries + locator.get_offset());
-        return entry->key_len == 8 && *reinterpret_cast<uint64_t*>(reinterpret_cast<uint8_t*>(entry+1) + entry->key_len) == TOMBSTONE_MARKER;
+        return PayloadLocator(bucket.val_ptrs[pos]).is_tombstone();
+    }
+
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::matches_tag(PayloadLocator locator, KeyType key) const {
+    if constexpr (std::is_integral_v<KeyType>) {
+        return true;
+    } else if (locator.is_inline()) {
+        // The caller compared the hashes
+        return locator.get_inline_key_len() == key.size();
+    } else {
+        return locator.get_tag() == key_tag(key);
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::is_collected(PayloadLocator locator) const {
+    return !locator.is_inline() &&
+           payload_logs[locator.get_log_id()].persistent_state->log_epochs[locator.get_chunk_id()] != locator.get_epoch();
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+typename Hashtable<KeyType, ValType, pType>::PayloadLogEntry *Hashtable<KeyType, ValType, pType>::get_payload_entry(PayloadLocator locator) const {
+    auto *entry = reinterpret_cast<PayloadLogEntry *>(payload_logs[locator.get_log_id()].chunks[locator.get_chunk_id()].entries + locator.get_offset());
+    // Cleaned chunks are reused without zeroing them, so the header tells whether the entry is still the one we want
+    if (entry->epoch != locator.get_epoch() || entry->check != payload_log_entry_check(entry->key_len, entry->val_len, entry->epoch) ||
+        locator.get_offset() + payload_entry_size(entry->key_len, entry->val_len) > PAYLOAD_CHUNK_SIZE) {
+        return nullptr;
+    }
+    return entry;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::still_points_to(KeyType key, PayloadLocator locator) {
+    std::optional<LookupResult> result = lookup_internal(key);
+    return result && !result->deleted && result->locator.pos == locator.pos && !is_collected(locator);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+bool Hashtable<KeyType, ValType, pType>::is_same_key(PayloadLocator a, PayloadLocator b) const {
+    auto key_len = [&](PayloadLocator locator) {
+        if (locator.is_inline()) {
+            return locator.get_inline_key_len();
+        }
+        return reinterpret_cast<PayloadLogEntry *>(payload_logs[locator.get_log_id()].chunks[locator.get_chunk_id()].entries + locator.get_offset())->key_len;
+    };
+
+    if (!a.is_inline() && !b.is_inline() && a.get_tag() != b.get_tag()) {
+        return false;
+    }
+    if (key_len(a) != key_len(b)) {
+        return false;
+    }
+    if (a.is_inline() || b.is_inline()) {
+        // Small keys of the same length have the same hash only if they are equal
+        return true;
+    }
+    auto *entryA = reinterpret_cast<PayloadLogEntry *>(payload_logs[a.get_log_id()].chunks[a.get_chunk_id()].entries + a.get_offset());
+    auto *entryB = reinterpret_cast<PayloadLogEntry *>(payload_logs[b.get_log_id()].chunks[b.get_chunk_id()].entries + b.get_offset());
+    return memcmp(entryA + 1, entryB + 1, entryA->key_len) == 0;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::set_merge_policy(int level, MergePolicy policy) {
+    assert(level >= 0 && level < MAX_PMEM_LEVELS);
+    merge_policies[level].store(policy);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::set_ready_log_chunks(int chunks) {
+    assert(chunks >= 0 && LOG_COMPACTION_RESERVE + chunks <= CHUNKS_PER_LOG - 2);
+    ready_log_chunks.store(chunks);
+    log_compaction_requests.fetch_add(1);
+    log_compaction_requests.notify_all();
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::set_payload_watermarks(int low, int high) {
+    assert(0 < low && low <= high && high <= CHUNKS_PER_PAYLOAD_LOG - 2);
+    payload_low_watermark.store(low);
+    payload_high_watermark.store(high);
+    payload_compaction_requests.fetch_add(1);
+    payload_compaction_requests.notify_all();
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::set_payload_codec(PayloadCodec codec) {
+    payload_codec.store(codec);
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+MergePolicy Hashtable<KeyType, ValType, pType>::get_merge_policy(int level) const {
+    assert(level >= 0 && level < MAX_PMEM_LEVELS);
+    return merge_policies[level].load();
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+typename Hashtable<KeyType, ValType, pType>::MergeStats Hashtable<KeyType, ValType, pType>::merge_stats(int level) const {
+    assert(level >= 0 && level < MAX_PMEM_LEVELS);
+    MergeStats stats{};
+    for (int stripe = 0; stripe < STAT_STRIPES; ++stripe) {
+        const MergeCounters &counters = merge_counters[stripe * MAX_PMEM_LEVELS + level];
+        stats.drains += counters.drains.load(std::memory_order_relaxed);
+        stats.in_place_merges += counters.in_place_merges.load(std::memory_order_relaxed);
+        stats.entries_written += counters.entries_written.load(std::memory_order_relaxed);
+        stats.records_written += counters.records_written.load(std::memory_order_relaxed);
+        stats.records_dropped += counters.records_dropped.load(std::memory_order_relaxed);
+        stats.lookups += counters.lookups.load(std::memory_order_relaxed);
+        stats.bucket_probes += counters.bucket_probes.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+typename Hashtable<KeyType, ValType, pType>::Stats Hashtable<KeyType, ValType, pType>::stats() const {
+    Stats stats{};
+    for (int stripe = 0; stripe < STAT_STRIPES; ++stripe) {
+        const IOCounters &counters = io_counters[stripe];
+        stats.logical_bytes_written += counters.logical_bytes_written.load(std::memory_order_relaxed);
+        stats.logical_bytes_read += counters.logical_bytes_read.load(std::memory_order_relaxed);
+        stats.lookups += counters.lookups.load(std::memory_order_relaxed);
+        stats.wal_bytes += counters.wal_bytes.load(std::memory_order_relaxed);
+        stats.payload_log_bytes += counters.payload_log_bytes.load(std::memory_order_relaxed);
+        stats.directory_bytes += counters.directory_bytes.load(std::memory_order_relaxed);
+        stats.fingerprint_bytes += counters.fingerprint_bytes.load(std::memory_order_relaxed);
+        stats.compaction_bytes += counters.compaction_bytes.load(std::memory_order_relaxed);
+        stats.pmem_bytes_read += counters.pmem_bytes_read.load(std::memory_order_relaxed);
+        stats.wal_compaction_stalls += counters.wal_compaction_stalls.load(std::memory_order_relaxed);
+        stats.log_pressure_migrations += counters.log_pressure_migrations.load(std::memory_order_relaxed);
+        stats.checkpointer_migrations += counters.checkpointer_migrations.load(std::memory_order_relaxed);
+        stats.payload_gc_stalls += counters.payload_gc_stalls.load(std::memory_order_relaxed);
+        stats.payload_value_bytes += counters.payload_value_bytes.load(std::memory_order_relaxed);
+        stats.payload_stored_value_bytes += counters.payload_stored_value_bytes.load(std::memory_order_relaxed);
+    }
+
+    // A bucket slot is a key and a value pointer
+    for (int level = 0; level < MAX_PMEM_LEVELS; ++level) {
+        stats.level_bytes[level] = merge_stats(level).records_written * 2 * sizeof(uint64_t);
+    }
+
+    for (int level = 0; level < *cur_pmem_levels; ++level) {
+        if (level <= MAX_DRAM_FILTER_LEVEL) {
+            stats.pmem_bytes_allocated += PMEM_DIRECTORY_SIZES[level] * sizeof(PMEMDirectoryEntry);
+        } else {
+            stats.pmem_bytes_allocated += PMEM_DIRECTORY_SIZES[level] * sizeof(PMEMDirectoryEntryWithFP);
+        }
+    }
+    // Preallocated buckets of the first levels are included in the bucket index
+    stats.pmem_bytes_allocated += next_empty_bucket_idx * sizeof(Bucket);
+    stats.pmem_bytes_allocated += LOG_NUM * LOG_MEMORY_SIZE;
+
+    if constexpr (!std::is_integral_v<KeyType>) {
+        for (int log_idx = 0; log_idx < PAYLOAD_LOG_NUM; ++log_idx) {
+            for (int chunk_idx = 0; chunk_idx < CHUNKS_PER_PAYLOAD_LOG; ++chunk_idx) {
+                if (!payload_logs[log_idx].persistent_state->free[chunk_idx]) {
+                    stats.pmem_bytes_allocated += PAYLOAD_CHUNK_SIZE;
+                    stats.payload_live_bytes += payload_logs[log_idx].chunks[chunk_idx].live_bytes & LIVE_BYTES_MASK;
+                }
+            }
+        }
     }
+    return stats;
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+typename Hashtable<KeyType, ValType, pType>::IOCounters &Hashtable<KeyType, ValType, pType>::get_io_counters() {
+    return io_counters[get_stat_stripe()];
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+int Hashtable<KeyType, ValType, pType>::get_stat_stripe() {
+    static std::atomic<int> next_stripe{0};
+    thread_local int stripe = next_stripe.fetch_add(1) & (STAT_STRIPES - 1);
+    return stripe;
+}
 
+template <class KeyType, class ValType, PartitionType pType>
+typename Hashtable<KeyType, ValType, pType>::MergeCounters &Hashtable<KeyType, ValType, pType>::get_merge_counters(int level) {
+    return merge_counters[get_stat_stripe() * MAX_PMEM_LEVELS + level];
 }
 
 template <class KeyType, class ValType, PartitionType pType>
 long Hashtable<KeyType, ValType, pType>::count() {
+    wait_for_recovery();
     long total_size = 0;
     long dram_size = 0;
     long dram_max_size = DRAM_DIRECTORY_SIZE * BUCKETS_PER_DIRECTORY_ENTRY * KEYS_PER_BUCKET;
@@ -1595,6 +3986,27 @@ long Hashtable<KeyType, ValType, pType>::count() {
 
 template <class KeyType, class ValType, PartitionType pType>
 Hashtable<KeyType, ValType, pType>::~Hashtable() {
+    if (recovery_sweeper.joinable()) {
+        recovery_sweeper.join();
+    }
+    stop_checkpointer = true;
+    checkpointer.join();
+    stop_log_compaction = true;
+    log_compaction_requests.fetch_add(1);
+    log_compaction_requests.notify_all();
+    for (std::thread &compactor : log_compactors) {
+        compactor.join();
+    }
+    payload_compaction_requests.fetch_add(1);
+    payload_compaction_requests.notify_all();
+    for (std::thread &compactor : payload_compactors) {
+        compactor.join();
+    }
+
+    save_snapshot();
+    munmap(snapshot, snapshot_size);
+    close(snapshot_fd);
+
     munmap(directories[0], max_directory_entries_size);
     munmap(buckets, max_num_buckets * sizeof(Bucket));
 
@@ -1602,9 +4014,14 @@ Hashtable<KeyType, ValType, pType>::~Hashtable() {
     close(buckets_fd);
     close(metadata_fd);
 
+    if (partitions_fd >= 0) {
+        munmap(partitions, partitions_size);
+        close(partitions_fd);
+    }
+
 
     for (int idx = 0; idx < LOG_NUM; ++idx) {
-        munmap(logs[idx].chunks[0].entries, LOG_MEMORY_SIZE);
+        munmap(logs[idx].persistent_state, LOG_MEMORY_SIZE);
         int fd = log_fds[idx];
         close(fd);
     }
@@ -1619,7 +4036,9 @@ Hashtable<KeyType, ValType, pType>::~Hashtable() {
 }
 
 template <class KeyType, class ValType, PartitionType pType>
-Hashtable<KeyType, ValType, pType>::Hashtable(const std::string &pmem_dir, bool reset) {
+Hashtable<KeyType, ValType, pType>::Hashtable(const std::string &pmem_dir, bool reset, int recovery_threads,
+                                              RecoveryMode recovery_mode)
+        : recovery_threads(std::max(recovery_threads, 1)) {
 
 
     std::string directories_file = pmem_dir + "/directories.dat";
@@ -1629,11 +4048,15 @@ Hashtable<KeyType, ValType, pType>::Hashtable(const std::string &pmem_dir, bool
     std::string pmem_payload_log_file_prefix = pmem_dir + "/payload_log";
 
     std::string metadata_file = pmem_dir + "/metadata.dat";
+    std::string partitions_file = pmem_dir + "/partitions.dat";
+    std::string snapshot_file = pmem_dir + "/snapshot.dat";
 
     if (reset) {
         std::remove(directories_file.c_str());
         std::remove(buckets_file.c_str());
         std::remove(metadata_file.c_str());
+        std::remove(partitions_file.c_str());
+        std::remove(snapshot_file.c_str());
 
         for (int i = 0; i < LOG_NUM; ++i) {
             std::string pmem_log_file = pmem_log_file_prefix + std::to_string(i);
@@ -1680,6 +4103,10 @@ Hashtable<KeyType, ValType, pType>::Hashtable(const std::string &pmem_dir, bool
         pos += PMEM_DIRECTORY_SIZES[i];
     }
 
+    for (int i = 0; i < MAX_PMEM_LEVELS; ++i) {
+        merge_policies[i].store(DEFAULT_MERGE_POLICY);
+    }
+
     pos = 0;
     for (int i = 0; i <= MAX_BUCKET_PREALLOC_LEVEL; ++i) {
         BUCKET_OFFSETS[i] = pos;
@@ -1688,9 +4115,55 @@ Hashtable<KeyType, ValType, pType>::Hashtable(const std::string &pmem_dir, bool
     next_empty_bucket_idx = pos;
 
     directories_fd = mmap_pmem_file(directories_file, max_directory_entries_size, &directories[0]);
-    metadata_fd = mmap_pmem_file(metadata_file, sizeof(int), reinterpret_cast<char **>(&cur_pmem_levels));
+    metadata_fd = mmap_pmem_file(metadata_file, sizeof(PersistentMetadata), reinterpret_cast<char **>(&metadata));
+    cur_pmem_levels = &metadata->pmem_levels;
+    if (reset) {
+        metadata->locator_layout = LOCATOR_LAYOUT;
+        metadata->key_hash_version = KEY_HASH_VERSION;
+        metadata->log_format_version = LOG_FORMAT_VERSION;
+        metadata->partition_type = static_cast<int>(pType) + 1;
+        _mm_clflush(metadata);
+        _mm_sfence();
+    } else {
+        LocatorLayout recorded = metadata->locator_layout;
+        if (recorded.chunk_size == 0) {
+            recorded = DEFAULT_LOCATOR_LAYOUT;
+        }
+        if (recorded != LOCATOR_LAYOUT) {
+            throw std::runtime_error("The table was created with another payload locator layout.");
+        }
+        // The buckets and logs hold the keys' hashes, another hash wouldn't find them
+        if (std::max(metadata->key_hash_version, 1) != KEY_HASH_VERSION) {
+            throw std::runtime_error("The table was created with another key hash.");
+        }
+        if (metadata->log_format_version > LOG_FORMAT_VERSION) {
+            throw std::runtime_error("The table was created with a newer log format.");
+        }
+        // Replaying unpacked entries would read them at the wrong offsets
+        if (metadata->log_format_version < 1) {
+            throw std::runtime_error("The table was created with an older log format.");
+        }
+        // Keys are spread over the directories by the partitioning, the other one would look for them elsewhere
+        if (metadata->partition_type == 0) {
+            metadata->partition_type = static_cast<int>(pType) + 1;
+            _mm_clflush(metadata);
+            _mm_sfence();
+        } else if (metadata->partition_type != static_cast<int>(pType) + 1) {
+            throw std::runtime_error("The table was created with another partitioning.");
+        }
+    }
     buckets_fd = mmap_pmem_file(buckets_file, max_num_buckets * sizeof(Bucket), reinterpret_cast<char **>(&buckets));
 
+    snapshot_size = sizeof(PersistentSnapshot) + num_dram_fingerprints * sizeof(DirectoryFingerprint);
+    snapshot_fd = mmap_pmem_file(snapshot_file, snapshot_size, reinterpret_cast<char **>(&snapshot));
+    if (!reset) {
+        filters_restored = restore_snapshot();
+    }
+
+    if constexpr (pType == PartitionType::Range) {
+        init_partitions(partitions_file, reset);
+    }
+
     //memset(directories_data, 0, max_directory_entries_size);
 
     logs = std::make_unique<Log[]>(LOG_NUM);
@@ -1708,13 +4181,22 @@ Hashtable<KeyType, ValType, pType>::Hashtable(const std::string &pmem_dir, bool
         log_fds.push_back(mmap_pmem_file(pmem_log_file, LOG_MEMORY_SIZE, &log_data));
 
         logs[i].persistent_state = reinterpret_cast<PersistentLogState *>(log_data);
+        logs[i].recovery = reset || recovery_mode == RecoveryMode::Blocking ? LogRecovery::Recovered : LogRecovery::Pending;
 
         for (int idx = 0; idx < CHUNKS_PER_LOG; ++idx) {
-            logs[i].chunks[idx].entries = reinterpret_cast<LogEntry *>(log_data + sizeof(PersistentLogState) + idx * CHUNK_SIZE);
+            char *chunk_data = log_data + sizeof(PersistentLogState) + idx * CHUNK_SIZE;
+            logs[i].chunks[idx].max_epochs = reinterpret_cast<std::atomic<int> *>(chunk_data);
+            logs[i].chunks[idx].high_water = &logs[i].persistent_state->high_water[idx];
+            logs[i].chunks[idx].entries = reinterpret_cast<LogEntry *>(chunk_data + LOG_CHUNK_HEADER_SIZE);
         }
 
         if (reset) {
-            memset(log_data, 0, LOG_MEMORY_SIZE);
+            // The file was just created, so it is zeroed already
+            if constexpr (LAZY_PMEM_ALLOCATION) {
+                reserve_pmem(log_fds.back(), 0, LOG_MEMORY_SIZE);
+            } else {
+                memset(log_data, 0, LOG_MEMORY_SIZE);
+            }
             // Initialize the persistent state
             // Keep chunks 0, 1 and 2 free for compaction
             logs[i].persistent_state->write_chunk = 3;
@@ -1736,7 +4218,27 @@ Hashtable<KeyType, ValType, pType>::Hashtable(const std::string &pmem_dir, bool
                 logs[i].persistent_state->next_of[idx] = idx+1;
             }
             logs[i].persistent_state->next_of[CHUNKS_PER_LOG - 1] = -1;
+        } else if (metadata->log_format_version < 2) {
+            // The marks were never written, so any entry of a chunk might be in use
+            for (int idx = 0; idx < CHUNKS_PER_LOG; ++idx) {
+                logs[i].persistent_state->high_water[idx] = MAX_LOG_ENTRIES;
+            }
+            _mm_clflush(logs[i].persistent_state->high_water);
         }
+
+        int free_chunks = 0;
+        for (int idx = logs[i].persistent_state->first_free_chunk; idx != -1; idx = logs[i].persistent_state->next_of[idx]) {
+            ++free_chunks;
+        }
+        logs[i].free_chunk_count = free_chunks;
+    }
+
+    if (metadata->log_format_version < LOG_FORMAT_VERSION) {
+        // Only recorded once the marks of all logs are persisted
+        _mm_sfence();
+        metadata->log_format_version = LOG_FORMAT_VERSION;
+        _mm_clflush(metadata);
+        _mm_sfence();
     }
 
     if constexpr (!std::is_integral_v<KeyType>) {
@@ -1766,22 +4268,32 @@ Hashtable<KeyType, ValType, pType>::Hashtable(const std::string &pmem_dir, bool
 
                 payload_logs[i].chunks[0].size = 0;
                 payload_logs[i].chunks[0].reserved = 0;
+                payload_logs[i].chunks[0].live_bytes = 1ul << 32;
                 payload_logs[i].chunks[1].size = 0;
                 payload_logs[i].chunks[1].reserved = 0;
+                payload_logs[i].chunks[1].live_bytes = 1ul << 32;
 
-                payload_logs[i].free_chunk_count = CHUNKS_PER_PAYLOAD_LOG - 2; // TODO: Also calculate that in recovery
+                payload_logs[i].free_chunk_count = CHUNKS_PER_PAYLOAD_LOG - 2;
 
                 for (int idx = 2; idx < CHUNKS_PER_PAYLOAD_LOG; ++idx) {
                     payload_logs[i].persistent_state->free[idx] = true;
                     payload_logs[i].persistent_state->log_epochs[idx] = 1;
                     payload_logs[i].chunks[idx].size = 0;
                     payload_logs[i].chunks[idx].reserved = 0;
+                    payload_logs[i].chunks[idx].live_bytes = 1ul << 32;
 
                 }
             }
         }
 
-        if (reset) {
+        if constexpr (LAZY_PMEM_ALLOCATION) {
+            if (reset) {
+                for (int i = 0; i < PAYLOAD_LOG_NUM; ++i) {
+                    reserve_payload_chunk(i, 0);
+                    reserve_payload_chunk(i, 1);
+                }
+            }
+        } else if (reset) {
             std::vector<std::thread> workers;
 
             for (uint64_t i = 0; i < PAYLOAD_LOG_NUM ; ++i) {
@@ -1810,12 +4322,36 @@ Hashtable<KeyType, ValType, pType>::Hashtable(const std::string &pmem_dir, bool
         }
     }
 
+    if (reset) {
+        reserve_level(0);
+    }
+
     for (int i = 0; i < DRAM_DIRECTORY_SIZE; ++i) {
         dram_table[i].epoch = 1;
     }
 
-    if (!reset) {
+    if (reset) {
+        recovered_logs = LOG_NUM;
+    } else if (recovery_mode == RecoveryMode::Blocking) {
         recover_from_log();
+        recovered_logs = LOG_NUM;
+    } else {
+        // Chunks in use can't be cleaned before the table knows which of their entries are live
+        reopen_payload_logs();
+        payload_gc_paused = true;
+        allocator_recovered = false;
+        recovery_complete = false;
+        recovery_sweeper = std::thread(&Hashtable::recovery_sweep, this);
+    }
+
+    for (int i = 0; i < LOG_COMPACTION_THREADS; ++i) {
+        log_compactors.emplace_back(&Hashtable::log_compaction_runner, this, i);
+    }
+    checkpointer = std::thread(&Hashtable::checkpointer_runner, this);
+    if constexpr (!std::is_integral_v<KeyType>) {
+        for (int i = 0; i < PAYLOAD_COMPACTION_THREADS; ++i) {
+            payload_compactors.emplace_back(&Hashtable::payload_compaction_runner, this, i);
+        }
     }
 }
 
@@ -1832,12 +4368,41 @@ int Hashtable<KeyType, ValType, pType>::mmap_pmem_file(const std::string &filena
                 "Could not allocate " + std::to_string(max_size) + " bytes at storage location: " + filename);
     }
 
-    *target = static_cast<char *>(mmap(nullptr, max_size, PROT_READ | PROT_WRITE, MAP_SYNC | MAP_SHARED_VALIDATE | MAP_POPULATE, fd, 0));
+    int flags = MAP_SYNC | MAP_SHARED_VALIDATE | (LAZY_PMEM_ALLOCATION ? 0 : MAP_POPULATE);
+    *target = static_cast<char *>(mmap(nullptr, max_size, PROT_READ | PROT_WRITE, flags, fd, 0));
 
-    madvise(target, max_size, MADV_SEQUENTIAL);
+    madvise(*target, max_size, MADV_SEQUENTIAL);
     return fd;
 }
 
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::reserve_pmem(int fd, size_t offset, size_t length) {
+    if constexpr (!LAZY_PMEM_ALLOCATION) {
+        // The whole file was populated when mapping it
+        return;
+    }
+    if (fallocate(fd, 0, offset, length) != 0 && errno != EOPNOTSUPP) {
+        throw std::runtime_error("Could not allocate " + std::to_string(length) + " bytes of PMem: " + strerror(errno));
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::reserve_level(int level) {
+    size_t entry_size = level <= MAX_DRAM_FILTER_LEVEL ? sizeof(PMEMDirectoryEntry) : sizeof(PMEMDirectoryEntryWithFP);
+    reserve_pmem(directories_fd, directories[level] - directories[0], PMEM_DIRECTORY_SIZES[level] * entry_size);
+
+    // Buckets of the other levels are handed out one by one and faulted in when written
+    if (level <= MAX_BUCKET_PREALLOC_LEVEL) {
+        reserve_pmem(buckets_fd, BUCKET_OFFSETS[level] * sizeof(Bucket),
+                     PMEM_DIRECTORY_SIZES[level] * BUCKETS_PER_DIRECTORY_ENTRY * sizeof(Bucket));
+    }
+}
+
+template <class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::reserve_payload_chunk(int log_idx, int chunk_idx) {
+    reserve_pmem(payload_log_fds[log_idx], sizeof(PersistentPayloadLogState) + chunk_idx * PAYLOAD_CHUNK_SIZE, PAYLOAD_CHUNK_SIZE);
+}
+
 template <class KeyType, class ValType, PartitionType pType>
 class Hashtable<KeyType, ValType, pType>::Bucket &Hashtable<KeyType, ValType, pType>::get_bucket(uint64_t bucket_idx) {
     return buckets[bucket_idx];
@@ -1853,6 +4418,8 @@ class Hashtable<KeyType, ValType, pType>::Bucket &Hashtable<KeyType, ValType, pT
 
 template <class KeyType, class ValType, PartitionType pType>
 uint64_t Hashtable<KeyType, ValType, pType>::allocate_empty_bucket() {
+    // An OnDemand recovery might not know yet which buckets are in use
+    allocator_recovered.wait(false);
     uint64_t bucket_idx = ++next_empty_bucket_idx;
     new (&buckets[bucket_idx]) Bucket();
     return bucket_idx;
@@ -1909,6 +4476,17 @@ uint64_t Hashtable<KeyType, ValType, pType>::get_pmem_directory_entry_idx(int le
 }
 
 
+template <class KeyType, class ValType, PartitionType pType>
+uint64_t Hashtable<KeyType, ValType, pType>::get_dram_directory_entry_idx(int level, uint64_t pmem_entry_idx) const {
+    if constexpr (pType == PartitionType::Hash) {
+        // The entries below keep the DRAM directory entry's hash bits
+        return pmem_entry_idx & (DRAM_DIRECTORY_SIZE - 1);
+    } else {
+        // The entries below split the DRAM directory entry's range
+        return pmem_entry_idx >> (PMEM_BITS - DRAM_BITS + FANOUT_BITS * level);
+    }
+}
+
 template <class KeyType, class ValType, PartitionType pType>
 uint64_t Hashtable<KeyType, ValType, pType>::get_dram_directory_entry_idx(const KeyType key, uint64_t* subdivision_idx) {
 
@@ -1921,10 +4499,8 @@ uint64_t Hashtable<KeyType, ValType, pType>::get_dram_directory_entry_idx(const
         *subdivision_idx = (key_hash & ((NUM_SUBDIVISIONS - 1) << DRAM_BITS)) >> DRAM_BITS;
     } else {
         //pType == Range
-        // We range-partition: Find the right bin
-        static uint64_t step = std::max(1ul,(MAX-MIN) / DRAM_DIRECTORY_SIZE);
-
-        entry_idx = key / step;
+        // We range-partition: Each DRAM entry covers the ranges of its level 0 entries
+        entry_idx = range_partition_key(key, 0) >> (PMEM_BITS - DRAM_BITS);
 
         *subdivision_idx = 0 ;
     }
@@ -1952,9 +4528,9 @@ uint64_t Hashtable<KeyType, ValType, pType>::get_log_entry_idx(KeyType key) {
     } else {
         assert(std::is_integral_v<KeyType>); //TODO: We currently don't support range partitioning for variable sized keys
         //pType == Range
-        // We range-partition: Find the right bin
-        uint64_t step = (MAX-MIN) / LOG_NUM + 1;
-        return key / step;
+        // Interleave DRAM entries over the logs, compaction relies on log_idx being the lower bits of the DRAM index
+        uint64_t subdivision_idx;
+        return get_dram_directory_entry_idx(key, &subdivision_idx) & (LOG_NUM - 1);
     }
 }
 
@@ -2007,6 +4583,7 @@ void Hashtable<KeyType, ValType, pType>::remove(KeyType key) {
 }
 template<class KeyType, class ValType, PartitionType pType>
 int Hashtable<KeyType, ValType, pType>::scan(KeyType key, int num_items, std::map<KeyType, ValType> &results) {
+    wait_for_recovery();
     uint64_t subdivision_idx;
     uint64_t entry_idx = get_dram_directory_entry_idx(key, &subdivision_idx);
 
@@ -2016,6 +4593,154 @@ int Hashtable<KeyType, ValType, pType>::scan(KeyType key, int num_items, std::ma
     return 0;
 }
 
+template<class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::scan_partition(int partition, int num_partitions,
+                                                        const std::function<void(KeyType, std::span<const std::byte>)> &visitor) {
+    assert(partition >= 0 && partition < num_partitions);
+    wait_for_recovery();
+
+    uint64_t start_idx = DRAM_DIRECTORY_SIZE * partition / num_partitions;
+    uint64_t end_idx = DRAM_DIRECTORY_SIZE * (partition + 1) / num_partitions;
+    for (uint64_t dram_idx = start_idx; dram_idx < end_idx; ++dram_idx) {
+        scan_subtree(dram_idx, visitor);
+    }
+}
+
+template<class KeyType, class ValType, PartitionType pType>
+void Hashtable<KeyType, ValType, pType>::scan_subtree(uint64_t dram_idx,
+                                                      const std::function<void(KeyType, std::span<const std::byte>)> &visitor) {
+    DRAMDirectoryEntry &directory_entry = dram_table[dram_idx];
+
+    // The live records are copied while the entry is locked and visited once it is unlocked, so that the visitor can
+    // call into the table
+    std::vector<std::pair<uint64_t, uint64_t>> records; // Integer keys and their values
+    std::vector<std::byte> payloads;                    // Variable sized keys and their values, back to back
+    std::vector<std::pair<size_t, size_t>> payload_lengths;
+
+    {
+        // Nothing migrates or cleans the entry's records while we hold its lock, so they form a consistent snapshot
+        std::lock_guard<std::mutex> lock(directory_entry.m);
+        // Payload entries we read from aren't written again until the view is destroyed
+        PinnedValue view;
+        view.pin = pin_payload_chunks();
+
+        // Keys or key hashes of all records visited so far, with the locator of the first one
+        std::unordered_multimap<uint64_t, uint64_t> seen;
+
+        auto copy_payload = [&](std::span<const std::byte> key, std::span<const std::byte> value) {
+            payloads.insert(payloads.end(), key.begin(), key.end());
+            payloads.insert(payloads.end(), value.begin(), value.end());
+            payload_lengths.emplace_back(key.size(), value.size());
+        };
+
+        // Records are visited from newest to oldest, in the order lookups probe them
+        auto visit = [&](Bucket &bucket, int size) {
+            for (int i = size - 1; i >= 0; --i) {
+                PayloadLocator locator(bucket.val_ptrs[i]);
+                if constexpr (std::is_integral_v<KeyType>) {
+                    uint64_t key = bucket.keys[i];
+                    if (seen.contains(key)) {
+                        continue;
+                    }
+                    seen.emplace(key, locator.pos);
+                    if (!is_deleted(bucket, i)) {
+                        records.emplace_back(key, locator.pos);
+                    }
+                } else {
+                    if (is_collected(locator)) {
+                        // Superseded, the newest version of a key is moved along when its chunk is cleaned
+                        continue;
+                    }
+                    auto [first, last] = seen.equal_range(bucket.keys[i]);
+                    if (std::any_of(first, last, [&](auto &newer) { return is_same_key(PayloadLocator(newer.second), locator); })) {
+                        continue;
+                    }
+                    seen.emplace(bucket.keys[i], locator.pos);
+                    if (is_deleted(bucket, i)) {
+                        continue;
+                    }
+
+                    if (locator.is_inline()) {
+                        uint64_t key = unhash_small_key(bucket.keys[i]);
+                        uint64_t value = locator.pos;
+                        copy_payload(std::as_bytes(std::span(&key, 1)).first(locator.get_inline_key_len()),
+                                     std::as_bytes(std::span(&value, 1)).first(locator.get_inline_value_len()));
+                        continue;
+                    }
+                    PayloadLogEntry *entry = get_payload_entry(locator);
+                    if (entry == nullptr) {
+                        throw std::runtime_error("Corrupt payload log entry.");
+                    }
+                    auto *stored = reinterpret_cast<uint8_t *>(entry + 1) + entry->key_len;
+                    std::span<const std::byte> key(reinterpret_cast<const std::byte *>(entry + 1), entry->key_len);
+                    if ((static_cast<uint8_t>(entry->flags) & PAYLOAD_ENTRY_COMPRESSED) == 0) {
+                        copy_payload(key, std::span(reinterpret_cast<const std::byte *>(stored), entry->val_len));
+                        continue;
+                    }
+
+                    // Compressed values are decompressed right behind their key
+                    uint32_t raw_len;
+                    memcpy(&raw_len, stored, sizeof(uint32_t));
+                    copy_payload(key, {});
+                    size_t value_pos = payloads.size();
+                    payloads.resize(value_pos + raw_len);
+                    if (!LzCodec::decompress(stored + sizeof(uint32_t), entry->val_len - sizeof(uint32_t),
+                                             reinterpret_cast<uint8_t *>(payloads.data() + value_pos), raw_len)) {
+                        throw std::runtime_error("Corrupt compressed payload log entry.");
+                    }
+                    payload_lengths.back().second = raw_len;
+                }
+            }
+        };
+
+        for (int bucket_idx = 0; bucket_idx < BUCKETS_PER_DIRECTORY_ENTRY; ++bucket_idx) {
+            visit(dram_buckets[dram_idx * BUCKETS_PER_DIRECTORY_ENTRY + bucket_idx], directory_entry.sizes[bucket_idx]);
+        }
+
+        auto visit_pmem_entry = [&](int level, uint64_t entry_idx) {
+            PMEMDirectoryEntry *pmem_entry = get_directory_entry(level, entry_idx);
+            for (int bucket_idx = BUCKETS_PER_DIRECTORY_ENTRY - 1; bucket_idx >= 0; --bucket_idx) {
+                int size = get_size_of_bucket(pmem_entry->size.load(std::memory_order_relaxed), bucket_idx);
+                if (size == 0) {
+                    continue;
+                }
+                if (level <= MAX_BUCKET_PREALLOC_LEVEL) {
+                    visit(get_prealloced_bucket(level, entry_idx, bucket_idx), size);
+                } else {
+                    visit(get_bucket(pmem_entry->bucket_pointers[bucket_idx]), size);
+                }
+            }
+        };
+
+        for (int level = 0; level < *cur_pmem_levels; ++level) {
+            if constexpr (pType == PartitionType::Hash) {
+                // The entries below keep the DRAM directory entry's hash bits
+                for (uint64_t entry_idx = dram_idx; entry_idx < PMEM_DIRECTORY_SIZES[level]; entry_idx += DRAM_DIRECTORY_SIZE) {
+                    visit_pmem_entry(level, entry_idx);
+                }
+            } else {
+                // The entries below split the DRAM directory entry's range
+                int shift = PMEM_BITS - DRAM_BITS + FANOUT_BITS * level;
+                for (uint64_t entry_idx = dram_idx << shift; entry_idx < (dram_idx + 1) << shift; ++entry_idx) {
+                    visit_pmem_entry(level, entry_idx);
+                }
+            }
+        }
+    }
+
+    if constexpr (std::is_integral_v<KeyType>) {
+        for (auto &[key, value] : records) {
+            visitor(key, std::as_bytes(std::span(&value, 1)));
+        }
+    } else {
+        size_t pos = 0;
+        for (auto [key_len, value_len] : payload_lengths) {
+            visitor(std::span<const std::byte>(payloads.data() + pos, key_len), std::span<const std::byte>(payloads.data() + pos + key_len, value_len));
+            pos += key_len + value_len;
+        }
+    }
+}
+
 template class Hashtable<uint64_t, uint64_t, PartitionType::Hash>;
 template class Hashtable<uint64_t, uint64_t, PartitionType::Range>;
 
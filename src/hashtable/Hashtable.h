@@ -10,13 +10,16 @@
 #include <climits>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
 #include <immintrin.h>
 #include <limits>
 #include <memory>
 #include <optional>
-#include <queue>
 #include <set>
 #include <span>
+#include <thread>
 #include <vector>
 #include <map>
 
@@ -25,6 +28,53 @@
 
 enum PartitionType { Hash, Range };
 
+// What a PMem level does with a directory entry that cannot absorb the next batch from the level above it.
+enum MergePolicy {
+    Leveled, // Drain the whole entry into the next level (lowest read amplification)
+    Tiered,  // Merge superseded versions in place up to TIERED_MERGE_RUNS times before draining (lowest write amplification)
+    Lazy     // Like Tiered, but only merges in place while lookups on the level see high read amplification
+};
+
+// How the variable sized table stores values in the payload log. Every entry records whether it is compressed, so the
+// codec can be changed at any time.
+enum PayloadCodec {
+    NoCompression,
+    LZ // LZ4 block format, see LzCodec.h
+};
+
+// How an existing table is recovered when it is opened
+enum RecoveryMode {
+    Blocking, // The constructor returns once the whole table is recovered
+    OnDemand  // The constructor returns right away. A log is replayed the first time one of its keys is accessed, a
+              // background thread replays the others.
+};
+
+// How the variable sized table addresses its payload logs, see PayloadLocator. Every table records the layout it was
+// created with and can only be opened with the same one.
+struct LocatorLayout {
+    long chunk_size;      // Bytes per payload log chunk
+    int log_bits;         // Number of payload logs
+    int chunk_bits;       // Chunks per payload log
+    int granularity_bits; // Payload log entries start at multiples of 2^granularity_bits bytes
+
+    // Bits of a chunk offset
+    [[nodiscard]] constexpr int offset_bits() const {
+        int bits = 0;
+        while ((1l << bits) < (chunk_size >> granularity_bits)) {
+            ++bits;
+        }
+        return bits;
+    }
+
+    bool operator==(const LocatorLayout &other) const = default;
+};
+
+// 32 logs of 64 chunks of 50 MiB, about 100 GB of payloads
+inline constexpr LocatorLayout DEFAULT_LOCATOR_LAYOUT{50l * 1024 * 1024, 5, 6, 0};
+
+// 32 logs of 1024 chunks of 256 MiB, 8 TiB of payloads. Entries are 8 byte aligned, chunk epochs wrap after 2^17 reuses.
+inline constexpr LocatorLayout LARGE_LOCATOR_LAYOUT{256l * 1024 * 1024, 5, 10, 3};
+
 template <class KeyType, class ValType, PartitionType pType>
 class Hashtable {
 
@@ -33,11 +83,14 @@ private:
 
     friend class PibenchWrapper;
     friend class PibenchWrapperVar;
+    friend class LogScanBenchmark;
 
     // Only needed for range partitioning mode - ignore if you don't exactly know why you need to change it
-    static constexpr uint64_t MIN = 0;
-    //static constexpr uint64_t MAX = UINT64_MAX;
-    static constexpr uint64_t MAX = 268435456l;
+    // Until train_partitions() is called, level 0 splits [0, DEFAULT_RANGE_MAX) into equal ranges. Larger keys
+    // are still accepted, they end up in the last partition.
+    static constexpr uint64_t DEFAULT_RANGE_MAX = 268435456l;
+    static constexpr uint64_t PARTITIONS_MAGIC = 0x504c555348524e47;
+    static constexpr uint64_t SNAPSHOT_MAGIC = 0x504c55534853534e;
 
 
     static constexpr uint64_t TOMBSTONE_MARKER = 0xFEEDC0FFEE22AA77;
@@ -49,31 +102,146 @@ private:
     static constexpr const int DRAM_SUBDIVISION_BITS = 4;
     static constexpr const int LOG_NUM_BITS = 6;
 
-    static constexpr int PAYLOAD_LOG_NUM_BITS = 5;
-    static constexpr int PAYLOAD_CHUNK_NUM_BITS = 6;
+    // Layout of the payload locators, which also sizes the payload logs
+    static constexpr LocatorLayout LOCATOR_LAYOUT = DEFAULT_LOCATOR_LAYOUT;
+
+    static constexpr int PAYLOAD_LOG_NUM_BITS = LOCATOR_LAYOUT.log_bits;
+    static constexpr int PAYLOAD_CHUNK_NUM_BITS = LOCATOR_LAYOUT.chunk_bits;
 
     static constexpr int CHUNKS_PER_LOG = 6;
 
     static constexpr int CHUNK_SIZE = 5 * 1024 * 1024;
-    static constexpr long PAYLOAD_CHUNK_SIZE = 50 * 1024 * 1024;
+    static constexpr long PAYLOAD_CHUNK_SIZE = LOCATOR_LAYOUT.chunk_size;
 
     static constexpr int MAX_DRAM_FILTER_LEVEL = 1;
     static constexpr int MAX_BUCKET_PREALLOC_LEVEL = 1;
 
     // If set to true, payload log entries are marked for garbage collection immediately, when
     // the hash table entry pointing to it is discovered as being invalid.
+    // The live byte counts of the payload log chunks rely on the marks to count every entry once, without them
+    // chunks count as fully live until they are cleaned.
     static constexpr bool IMM_MARK_INVALID = true;
 
+    // If set to true, variable sized records with small keys and values are kept in the bucket instead of the
+    // payload log. The bucket holds a bijective hash of such keys, so that the key itself can be compared there.
+    static constexpr bool INLINE_SMALL_RECORDS = true;
+    static constexpr size_t INLINE_MAX_KEY_SIZE = 8;
+    static constexpr size_t INLINE_MAX_VALUE_SIZE = 6;
+
+    // Version of hash_key() that a table's buckets and logs were written with: 1 hashes every key with
+    // std::_Hash_bytes, 2 hashes variable sized keys of up to INLINE_MAX_KEY_SIZE bytes with a bijective finalizer
+    static constexpr int KEY_HASH_VERSION = std::is_integral_v<KeyType> || !INLINE_SMALL_RECORDS ? 1 : 2;
+
+    // Codec every table starts with, can be changed per table with set_payload_codec()
+    static constexpr PayloadCodec DEFAULT_PAYLOAD_CODEC = PayloadCodec::NoCompression;
+
+    // Values smaller than this are always logged raw, their headers would eat most of what compression saves
+    static constexpr size_t COMPRESSION_MIN_VALUE_SIZE = 128;
+
+    // If set to true, log compaction and recovery decode and filter 8 log entries at a time with AVX-512. The
+    // log_scan_benchmark target compares both filters.
+    static constexpr bool SIMD_LOG_SCAN = true;
+
+    // Ranged reads of at least this many bytes are copied with non-temporal loads and stores
+    static constexpr size_t STREAMING_READ_MIN_SIZE = 4096;
+
+    // If set to true, the PMem files are created sparse and mapped without populating them. Directories, buckets and
+    // payload chunks are only allocated once the table takes them into use
+    static constexpr bool LAZY_PMEM_ALLOCATION = true;
+
+    // If set to true, closing the table saves the DRAM filters and the bucket allocator, so that the next open doesn't
+    // have to rebuild them from the buckets
+    static constexpr bool SHUTDOWN_SNAPSHOT = true;
+
     static constexpr int KEYS_PER_BUCKET_BITS = 4;
 
     static constexpr int MAX_PMEM_LEVELS = 4;
 
+    // Merge policy every level starts with, can be changed per table and level with set_merge_policy()
+    static constexpr MergePolicy DEFAULT_MERGE_POLICY = MergePolicy::Leveled;
+
+    // Number of in-place merges a directory entry may see before it is drained into the next level anyway
+    static constexpr int TIERED_MERGE_RUNS = 4;
+
+    // Bucket probes per lookup on a level above which the lazy policy starts merging in place
+    static constexpr double LAZY_MERGE_READ_AMP = 1.5;
+
+    // Overflowing entries of a level between two reads of its read amplification by the lazy policy
+    static constexpr uint64_t LAZY_MERGE_SAMPLE_INTERVAL = 256;
+
+    // Range mode: directory entries on levels below this learn the split points of their children when they are
+    // first migrated, deeper ones always split their range into equal parts
+    static constexpr int REFINED_SPLIT_LEVELS = 2;
+
+    // Range mode: children only get learned split points if the migrated keys cover less than 1/x of the entry's
+    // range, i.e. if an equal split would put (nearly) all of them into the same child
+    static constexpr uint64_t REFINE_MIN_SPREAD = 256;
+    static_assert(REFINED_SPLIT_LEVELS < MAX_PMEM_LEVELS);
+
+    // Threads compacting the logs in the background, every thread is responsible for a fixed set of logs
+    static constexpr int LOG_COMPACTION_THREADS = 4;
+
+    // Free chunks per log only compaction may use: the new head of the chain and one more in case the
+    // compacted entries don't fit into it
+    static constexpr int LOG_COMPACTION_RESERVE = 2;
+
+    // Log entries a chunk's persisted high-water mark is raised by at once. Recovery scans at most this many unwritten
+    // entries per chunk.
+    static constexpr int LOG_HIGH_WATER_INTERVAL = 1024;
+
+    // Version of the WAL's persistent format: 1 packs the entries into 24 bytes behind a per-chunk epoch header, 2 also
+    // persists the chunks' high-water marks. Opening a version 1 table sets the marks of all chunks to their end, so
+    // that its entries are found before the marks are raised. Older tables hold unpacked entries and are rejected.
+    static constexpr int LOG_FORMAT_VERSION = 2;
+
+    // Free chunks per log the background compaction keeps ready for inserts on top of its reserve,
+    // can be changed per table with set_ready_log_chunks()
+    static constexpr int DEFAULT_READY_LOG_CHUNKS = 1;
+    static_assert(LOG_COMPACTION_RESERVE + DEFAULT_READY_LOG_CHUNKS <= CHUNKS_PER_LOG - 2);
+
+    // Threads cleaning the payload logs in the background, every thread is responsible for a fixed set of logs
+    static constexpr int PAYLOAD_COMPACTION_THREADS = 2;
+
+    // Free chunks per payload log: the background cleaning works until the high watermark is free again, inserts
+    // only clean synchronously once the low watermark is reached. Can be changed per table with
+    // set_payload_watermarks()
+    static constexpr int DEFAULT_PAYLOAD_LOW_WATERMARK = 2;
+    static constexpr int DEFAULT_PAYLOAD_HIGH_WATERMARK = 8;
+    static_assert(0 < DEFAULT_PAYLOAD_LOW_WATERMARK && DEFAULT_PAYLOAD_LOW_WATERMARK <= DEFAULT_PAYLOAD_HIGH_WATERMARK);
+
+    // Once a chunk it cleaned held less garbage than this share, the background cleaning leaves the log alone until
+    // the next chunk fills up, copying mostly live chunks over and over would cost more writes than it frees
+    static constexpr double PAYLOAD_GC_MIN_GARBAGE = 0.25;
+
+    // Payload chunks with a larger share of live bytes aren't worth cleaning, even if a log runs full
+    static constexpr double PAYLOAD_GC_MAX_LIVE = 0.95;
+
+    // A log is under pressure if its ready chunks are used up or if more than this share of its DRAM directory entries
+    // still have unpersisted entries in the chunk compacted next. Those entries are then migrated before compacting,
+    // so that compaction can drop their log entries instead of copying them.
+    static constexpr double LOG_PRESSURE_PINNED_SHARE = 0.5;
+
+    // How often the background checkpointer compares the log bytes a restart would replay to set_max_replay_bytes()
+    static constexpr int CHECKPOINTER_INTERVAL_MS = 10;
+
+    // bulk_load() loads into the first level that holds all records at this fill factor, the free space absorbs
+    // uneven partitions and later migrations into the level
+    static constexpr double BULK_LOAD_FILL = 0.5;
+
+    // Changes serve_changes() sends at once, and how long it sleeps if there are none
+    static constexpr size_t CHANGE_BATCH_SIZE = 4096;
+    static constexpr int CHANGE_POLL_INTERVAL_US = 50;
+
+    // Counters are striped over this many cache lines so that threads don't contend on them
+    static constexpr int STAT_STRIPES = 64;
+
     const int LOG_NUM = 1 << LOG_NUM_BITS;
     const int PAYLOAD_LOG_NUM = 1 << PAYLOAD_LOG_NUM_BITS;
     static constexpr long CHUNKS_PER_PAYLOAD_LOG = 1 << PAYLOAD_CHUNK_NUM_BITS;
 
-    //Note: all pmem level sizes must be divisible by FILTER_RECOVERY_THREAD_NUM without remainder
-    const int FILTER_RECOVERY_THREAD_NUM = 32;
+    // Threads that replay the logs and rebuild the filters after a restart, unless the constructor is told otherwise
+    static constexpr int DEFAULT_RECOVERY_THREADS = 32;
+    static constexpr RecoveryMode DEFAULT_RECOVERY_MODE = RecoveryMode::Blocking;
 
     static constexpr int BUCKETS_PER_DIRECTORY_ENTRY = 16; // 256 Byte * 16 = 4 KiB
     static constexpr int KEYS_PER_BUCKET = 1 << KEYS_PER_BUCKET_BITS;
@@ -95,6 +263,29 @@ private:
     int buckets_fd;
     int metadata_fd;
 
+    struct PersistentMetadata {
+        std::atomic<int> pmem_levels;
+        LocatorLayout locator_layout; // All zero in tables created before it was recorded, which use the default layout
+        int key_hash_version;         // Zero in tables created before it was recorded, which use version 1
+        int log_format_version;       // Zero in tables created before the WAL entries were packed
+        int partition_type;           // PartitionType + 1, zero in tables created before it was recorded
+    };
+
+    PersistentMetadata *metadata;
+
+    // Written when the table is closed, the DRAM filters of the levels that existed then follow it
+    struct alignas(64) PersistentSnapshot {
+        std::atomic<uint64_t> magic; // SNAPSHOT_MAGIC until the table is opened again
+        uint64_t checksum;           // CRC32C of the filters
+        uint64_t next_empty_bucket_idx;
+        int pmem_levels;
+    };
+
+    PersistentSnapshot *snapshot;
+    int snapshot_fd;
+    size_t snapshot_size;
+    bool filters_restored = false;
+
     std::vector<int> log_fds;
     std::vector<int> payload_log_fds;
 
@@ -106,15 +297,23 @@ private:
        std::atomic<uint64_t> val_ptrs[KEYS_PER_BUCKET];
     };
 
+    // Cleaned chunks aren't zeroed, an entry belongs to the chunk's current generation only if it carries its epoch
     struct alignas(8) PayloadLogEntry {
         uint64_t key_len;
         uint64_t val_len;
-        std::byte flags; // Last bit: is this entry still valid?
+        uint32_t epoch;  // Epoch of the chunk when the entry was written
+        std::byte flags; // Last bit: is this entry still valid? Second to last bit: is the value compressed?
+        uint8_t padding;
+        uint16_t check;  // Checksum of the lengths and the epoch, so that stale bytes are unlikely to pass as an entry
     };
+    static_assert(sizeof(PayloadLogEntry) == 24);
+
+    // A compressed value starts with its raw length, followed by the compressed block. val_len is the stored length.
+    static constexpr uint8_t PAYLOAD_ENTRY_COMPRESSED = 0b10;
 
 
-    struct alignas(32) LogEntry {
-        // Layout:
+    struct alignas(8) LogEntry {
+        // Layout, entries are packed and may span two cache lines:
         // content[0] = KKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKB
         // content[1] = VVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVVB
         // content[2] = KV.............................EEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEB
@@ -135,27 +334,35 @@ private:
             content[1].fetch_xor((-bit ^ content[1]) & 1UL, std::memory_order::relaxed);
             content[2].fetch_xor((-bit ^ content[2]) & 1UL, std::memory_order::relaxed);
 
-            _mm_clflushopt(&content[0]);
+            flush();
             _mm_sfence();
         }
 
-        bool is_valid(bool expected_valid_bit) {
+        void flush() {
+            // Every word carries its own valid bit, so it doesn't matter if the cache lines are persisted separately
+            _mm_clflushopt(&content[0]);
+            if ((reinterpret_cast<uintptr_t>(&content[0]) >> 6) != (reinterpret_cast<uintptr_t>(&content[2]) >> 6)) {
+                _mm_clflushopt(&content[2]);
+            }
+        }
+
+        bool is_valid(bool expected_valid_bit) const {
             unsigned long bit = !!expected_valid_bit;    // Booleanize to force 0 or 1
             return (content[0] & 0b1) == bit && (content[1] & 0b1) == bit && (content[2] & 0b1) == bit;
         }
 
-        uint64_t get_key() {
+        uint64_t get_key() const {
             uint64_t key = (content[0] >> 1) | (content[2] & (1UL << 63));
             return key;
         }
 
-        uint64_t get_value() {
+        uint64_t get_value() const {
             uint64_t value = (content[1] >> 1) | ((content[2] & (1UL << 62)) << 1);
             return value;
 
         }
 
-        int get_epoch() {
+        int get_epoch() const {
             int epoch = (content[2] & ((1UL << 34)-1)) >> 1;
             return epoch;
         }
@@ -173,6 +380,7 @@ private:
         std::atomic<int> size;
         std::atomic<int> epoch;
         uint64_t bucket_pointers[BUCKETS_PER_DIRECTORY_ENTRY];
+        std::atomic<int> merges; // In-place merges since the entry was last drained, lives in the alignment padding
     };
 
     struct PMEMDirectoryEntryWithFP : public PMEMDirectoryEntry {
@@ -183,6 +391,7 @@ private:
         std::atomic<uint8_t> sizes[BUCKETS_PER_DIRECTORY_ENTRY];
         std::atomic<int> epoch;
         std::mutex m;
+        std::atomic<int> merge_seq; // Odd while an in-place merge moves records of a PMem entry below this one
     };
 
     size_t max_directory_entries_size = 0;
@@ -197,6 +406,32 @@ private:
     char* directories[MAX_PMEM_LEVELS];
     DirectoryFingerprint* dram_fingerprints[MAX_PMEM_LEVELS];
 
+    struct alignas(64) PersistentPartitions {
+        uint64_t magic;     // PARTITIONS_MAGIC once the split points are persisted
+        uint64_t range_max; // Inclusive upper bound of the last partition when deriving equal splits
+    };
+
+    // Lower bounds of children 1 to 15 of a directory entry, child 0 starts where its parent starts
+    struct alignas(128) ChildSplits {
+        uint64_t lower_bounds[BUCKETS_PER_DIRECTORY_ENTRY - 1];
+        std::atomic<uint64_t> valid;
+    };
+
+    // Range mode: keys in [lower, end) belong to a directory entry. The last entry of every level is open, i.e. it
+    // also takes all keys >= end, which is then only the end of the range we expect keys in.
+    struct RangeBounds {
+        uint64_t lower;
+        unsigned __int128 end;
+        bool open;
+    };
+
+    PersistentPartitions* partitions = nullptr;
+    uint64_t* range_lower_bounds = nullptr; // One per level 0 directory entry, the first one is always 0
+    std::unique_ptr<uint64_t[]> dram_range_lower_bounds; // DRAM copy of range_lower_bounds, which every key is looked up in
+    ChildSplits* child_splits[REFINED_SPLIT_LEVELS] = {};
+    int partitions_fd = -1;
+    size_t partitions_size = 0;
+
     struct alignas(256) PersistentLogState {
         std::atomic<int> write_chunk; // The chunk we currently write new values to
         std::atomic<int> first_chunk; // The head pointer, i.e. the first chunk in the chain with values
@@ -205,6 +440,10 @@ private:
 
         std::atomic<bool> valid_bits[CHUNKS_PER_LOG];
         std::atomic<int> next_of[CHUNKS_PER_LOG];
+
+        // No entry at or behind a chunk's mark was written since the chunk was freed. Kept apart from the chain, as
+        // it changes while every inserter reads the write chunk.
+        alignas(64) std::atomic<int> high_water[CHUNKS_PER_LOG];
     };
 
     struct alignas(512) PersistentPayloadLogState {
@@ -213,13 +452,17 @@ private:
 
         std::atomic<int> log_epochs[CHUNKS_PER_PAYLOAD_LOG];
         std::atomic<bool> free[CHUNKS_PER_PAYLOAD_LOG];
+        // Chunks that were written to when we crashed, they might have gaps where entries were reserved but not written
+        std::atomic<bool> torn[CHUNKS_PER_PAYLOAD_LOG];
     };
 
 
     struct alignas(64) LogChunk {
         std::atomic<size_t> size;
         std::atomic<size_t> reserved;
-        std::atomic<int> max_epochs[1 << (DRAM_BITS - LOG_NUM_BITS)];
+        std::atomic<int>* max_epochs; // Persistent header: the largest epoch of each DRAM entry in this chunk
+        std::atomic<int>* high_water; // The chunk's persistent high-water mark
+        std::atomic<int> durable_high_water; // The high-water mark that is known to be persisted
         LogEntry* entries;
 
     };
@@ -227,34 +470,82 @@ private:
     struct alignas(64) PayloadLogChunk {
         std::atomic<size_t> size;
         std::atomic<size_t> reserved;
+        // Upper half: the chunk's epoch, lower half: bytes of entries the table might still point to.
+        // Superseded entries are only subtracted while the epoch matches, so that late updates can't hit a reused chunk.
+        std::atomic<uint64_t> live_bytes;
+        uint64_t sealed_seq;            // When the chunk was filled up, 0 if it isn't a cleaning candidate
+        std::atomic<bool> cleaning;     // Entries that aren't in the table yet won't be kept
+        std::atomic<uint64_t> reusable_at; // Reclamation epoch from which on no pinned value points into the chunk
+        std::atomic<int64_t> view_pins; // Views returned by lookup_view() that point into the chunk
+        bool recovering;                // In use when the table was opened, its live bytes are counted after recovery
         uint8_t* entries;
     };
 
+    // Recovery state of a log and the DRAM directory entries it belongs to
+    enum class LogRecovery { Pending, Replaying, Recovered };
+
     struct alignas(256) Log {
         PersistentLogState *persistent_state;
-        std::atomic_flag is_compacting;
+        std::atomic<LogRecovery> recovery;
+        std::atomic_flag is_compacting; // Held while a chunk is compacted
+        std::atomic_flag is_switching;  // Held by the inserter that switches to a new write chunk
+        std::mutex m;                   // Protects the free list and the links of the chain
+        std::atomic<int> free_chunk_count;
+        std::atomic<int> cursors_in_chunk[CHUNKS_PER_LOG]; // Change cursors that haven't finished a chunk yet
+        std::atomic<uint32_t> cursor_generations[CHUNKS_PER_LOG]; // Bumped when inserts overtake the cursors in a chunk
         LogChunk chunks[CHUNKS_PER_LOG];
     };
 
+    static constexpr uint64_t LIVE_BYTES_MASK = (1ul << 32) - 1;
+    static_assert(PAYLOAD_CHUNK_SIZE <= LIVE_BYTES_MASK);
+
     struct alignas(256) PayloadLog {
-        std::queue<size_t> compact_order;
-        std::atomic<size_t> free_chunk_count;
+        std::atomic<int> free_chunk_count;
+        uint64_t seal_count;            // Chunks filled up so far, the clock of the cleaning's age estimate
+        std::atomic<bool> gc_paused;    // Background cleaning stopped paying off, until an insert fills up a chunk
         PersistentPayloadLogState *persistent_state;
-        std::mutex m;
+        std::atomic_flag is_compacting; // Held while a chunk is cleaned
+        std::mutex m;                   // Protects the free list, the write and compact chunk and the sealed chunks
         PayloadLogChunk chunks[CHUNKS_PER_PAYLOAD_LOG];
     };
 
-    static constexpr long MAX_LOG_ENTRIES = CHUNK_SIZE / sizeof(LogEntry);
+    static constexpr long LOG_CHUNK_HEADER_SIZE = sizeof(std::atomic<int>) << (DRAM_BITS - LOG_NUM_BITS);
+    static_assert(LOG_CHUNK_HEADER_SIZE % 64 == 0);
+    static constexpr long MAX_LOG_ENTRIES = (CHUNK_SIZE - LOG_CHUNK_HEADER_SIZE) / sizeof(LogEntry);
 
     struct PayloadLocator {
 
         static constexpr uint64_t LOG_NUM_MASK = ((1ul << PAYLOAD_LOG_NUM_BITS) - 1) << (63 - PAYLOAD_LOG_NUM_BITS);
         static constexpr uint64_t LOG_CHUNK_MASK = ((1ul << PAYLOAD_CHUNK_NUM_BITS) - 1) << (63 - PAYLOAD_LOG_NUM_BITS - PAYLOAD_CHUNK_NUM_BITS);
-        static constexpr uint64_t LOG_EPOCH_MASK = ((1ul << (32 - PAYLOAD_LOG_NUM_BITS - PAYLOAD_CHUNK_NUM_BITS)) - 1) << 31;
 
-        // Layout: LLLLLCCCCCCEEEEEEEEEEEEEEEEEEEEOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOO
+        static constexpr int OFFSET_BITS = LOCATOR_LAYOUT.offset_bits();
+        static constexpr int GRANULARITY_BITS = LOCATOR_LAYOUT.granularity_bits;
+        static constexpr int TAG_BITS = 5;
+        static constexpr int EPOCH_SHIFT = OFFSET_BITS + TAG_BITS + 1;
+        static constexpr int FREE_BITS = 63 - PAYLOAD_LOG_NUM_BITS - PAYLOAD_CHUNK_NUM_BITS - EPOCH_SHIFT;
+        static constexpr int EPOCH_BITS = FREE_BITS < 31 ? FREE_BITS : 31; // Epochs are ints
+        static_assert(EPOCH_BITS >= 16, "Chunk epochs would wrap too often");
+
+        // Chunk epochs count from 1 to MAX_EPOCH and then wrap
+        static constexpr int MAX_EPOCH = static_cast<int>((1l << EPOCH_BITS) - 1);
+
+        static constexpr uint64_t LOG_EPOCH_MASK = static_cast<uint64_t>(MAX_EPOCH) << EPOCH_SHIFT;
+        static constexpr uint64_t OFFSET_MASK = (1ul << OFFSET_BITS) - 1;
+        static constexpr uint64_t TAG_MASK = ((1ul << TAG_BITS) - 1) << OFFSET_BITS;
+        static constexpr uint64_t TOMBSTONE_FLAG = 1ul << (OFFSET_BITS + TAG_BITS);
+
+        // Default layout: 0LLLLLCCCCCCEEEEEEEEEEEEEEEEEEEETGGGGGOOOOOOOOOOOOOOOOOOOOOOOOOO
+        // (log, chunk, epoch, tombstone, key tag, offset in units of the layout's granularity). Tombstones and keys
+        // with a different tag are recognized without reading the payload log.
+        // Inline records instead carry their value:
+        //         1TKKKKVVV.......DDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDD
+        // (flag, tombstone, key length, value length, value bytes)
         uint64_t pos;
 
+        static constexpr uint64_t INLINE_FLAG = 1ul << 63;
+        static constexpr uint64_t INLINE_TOMBSTONE = 1ul << 62;
+        static_assert(INLINE_MAX_KEY_SIZE < 16 && INLINE_MAX_VALUE_SIZE * 8 <= 55);
+
 
         PayloadLocator() {
             pos = 0;
@@ -268,8 +559,8 @@ private:
             pos = 0;
             pos |= (log_id << (63 - PAYLOAD_LOG_NUM_BITS));
             pos |= (chunk_id << (63 - PAYLOAD_LOG_NUM_BITS - PAYLOAD_CHUNK_NUM_BITS));
-            pos |= (log_epoch << 32);
-            pos |= offset;
+            pos |= (log_epoch << EPOCH_SHIFT);
+            pos |= offset >> GRANULARITY_BITS;
         }
 
         [[nodiscard]] uint64_t get_log_id() const {
@@ -278,7 +569,7 @@ private:
         }
 
         [[nodiscard]] uint64_t get_epoch() const {
-            uint64_t epoch = (pos & LOG_EPOCH_MASK) >> 32;
+            uint64_t epoch = (pos & LOG_EPOCH_MASK) >> EPOCH_SHIFT;
             return epoch;
         }
 
@@ -288,7 +579,44 @@ private:
         }
 
         [[nodiscard]] uint64_t get_offset() const {
-            return pos & ~LOG_NUM_MASK & ~LOG_CHUNK_MASK & ~LOG_EPOCH_MASK;
+            return (pos & OFFSET_MASK) << GRANULARITY_BITS;
+        }
+
+        [[nodiscard]] uint64_t get_tag() const {
+            return (pos & TAG_MASK) >> OFFSET_BITS;
+        }
+
+        // The locator without its key tag and tombstone flag, as built from the entry's position
+        [[nodiscard]] uint64_t get_position() const {
+            return pos & ~TAG_MASK & ~TOMBSTONE_FLAG;
+        }
+
+        // Takes over the key tag and tombstone flag of the locator of the same entry at another position
+        [[nodiscard]] PayloadLocator with_tag_of(PayloadLocator other) const {
+            return PayloadLocator((pos & ~TAG_MASK & ~TOMBSTONE_FLAG) | (other.pos & (TAG_MASK | TOMBSTONE_FLAG)));
+        }
+
+        static PayloadLocator make_inline(size_t key_len, std::span<const std::byte> value, bool tombstone) {
+            PayloadLocator locator;
+            memcpy(&locator.pos, value.data(), value.size());
+            locator.pos |= INLINE_FLAG | (tombstone ? INLINE_TOMBSTONE : 0) | (key_len << 58) | (value.size() << 55);
+            return locator;
+        }
+
+        [[nodiscard]] bool is_inline() const {
+            return (pos & INLINE_FLAG) != 0;
+        }
+
+        [[nodiscard]] bool is_tombstone() const {
+            return (pos & (is_inline() ? INLINE_TOMBSTONE : TOMBSTONE_FLAG)) != 0;
+        }
+
+        [[nodiscard]] size_t get_inline_key_len() const {
+            return (pos >> 58) & 0xF;
+        }
+
+        [[nodiscard]] size_t get_inline_value_len() const {
+            return (pos >> 55) & 0x7;
         }
     };
 
@@ -300,14 +628,207 @@ private:
         short offset;
     };
 
+    struct alignas(64) MergeCounters {
+        std::atomic<uint64_t> drains;
+        std::atomic<uint64_t> in_place_merges;
+        std::atomic<uint64_t> entries_written;
+        std::atomic<uint64_t> records_written;
+        std::atomic<uint64_t> records_dropped;
+        std::atomic<uint64_t> lookups;
+        std::atomic<uint64_t> bucket_probes;
+    };
+
+    struct alignas(64) IOCounters {
+        std::atomic<uint64_t> logical_bytes_written;
+        std::atomic<uint64_t> logical_bytes_read;
+        std::atomic<uint64_t> lookups;
+        std::atomic<uint64_t> wal_bytes;
+        std::atomic<uint64_t> payload_log_bytes;
+        std::atomic<uint64_t> directory_bytes;
+        std::atomic<uint64_t> fingerprint_bytes;
+        std::atomic<uint64_t> compaction_bytes;
+        std::atomic<uint64_t> pmem_bytes_read;
+        std::atomic<uint64_t> wal_compaction_stalls;
+        std::atomic<uint64_t> log_pressure_migrations;
+        std::atomic<uint64_t> checkpointer_migrations;
+        std::atomic<uint64_t> payload_gc_stalls;
+        std::atomic<uint64_t> payload_value_bytes;
+        std::atomic<uint64_t> payload_stored_value_bytes;
+    };
+
     std::unique_ptr<Log[]> logs;
     std::unique_ptr<PayloadLog[]> payload_logs;
 
+    std::atomic<MergePolicy> merge_policies[MAX_PMEM_LEVELS];
+    // The lazy policy's last verdict on each level's read amplification, refreshed every LAZY_MERGE_SAMPLE_INTERVAL checks
+    mutable std::atomic<uint64_t> lazy_merge_checks[MAX_PMEM_LEVELS] = {};
+    mutable std::atomic<bool> lazy_merge_read_amp_high[MAX_PMEM_LEVELS] = {};
+    std::unique_ptr<MergeCounters[]> merge_counters = std::make_unique<MergeCounters[]>(STAT_STRIPES * MAX_PMEM_LEVELS);
+    std::unique_ptr<IOCounters[]> io_counters = std::make_unique<IOCounters[]>(STAT_STRIPES);
+
+    // Pinned values per stripe, by the parity of the reclamation epoch they were pinned in
+    struct alignas(64) ReaderPins {
+        std::atomic<int64_t> count[2];
+    };
+    std::unique_ptr<ReaderPins[]> reader_pins = std::make_unique<ReaderPins[]>(STAT_STRIPES);
+    std::atomic<uint64_t> reclamation_epoch = 0;
+
     std::atomic<uint64_t> next_empty_bucket_idx;
 
+    int recovery_threads;
+
+    std::thread recovery_sweeper; // Replays the logs nobody accessed yet after an OnDemand restart
+    std::atomic<int> recovered_logs = 0;
+    std::atomic<bool> allocator_recovered = true; // Buckets are only allocated once we know which ones are in use
+    std::atomic<bool> recovery_complete = true;
+
+    std::vector<std::thread> log_compactors;
+    std::atomic<bool> stop_log_compaction = false;
+    std::atomic<uint64_t> log_compaction_requests = 0; // Bumped whenever a log might need compaction
+    std::atomic<int> ready_log_chunks = DEFAULT_READY_LOG_CHUNKS;
+
+    std::thread checkpointer;
+    std::atomic<bool> stop_checkpointer = false;
+    std::atomic<size_t> max_replay_bytes = 0; // 0 if the checkpointer is off
+
+    std::vector<std::thread> payload_compactors;
+    std::atomic<uint64_t> payload_compaction_requests = 0; // Bumped whenever a payload log might need cleaning
+    std::atomic<int> payload_low_watermark = DEFAULT_PAYLOAD_LOW_WATERMARK;
+    std::atomic<int> payload_high_watermark = DEFAULT_PAYLOAD_HIGH_WATERMARK;
+    std::atomic<bool> payload_gc_paused = false; // Set while bulk_load() logs payloads the table doesn't point to yet
+    std::atomic<PayloadCodec> payload_codec = DEFAULT_PAYLOAD_CODEC;
+
 public:
 
-    explicit Hashtable(const std::string& pmem_dir, bool reset);
+    struct MergeStats {
+        uint64_t drains;          // Entries drained into the next level
+        uint64_t in_place_merges; // Entries compacted without leaving the level
+        uint64_t entries_written; // Entries migrations and bulk loads wrote records into
+        uint64_t records_written; // Records written into the level by migrations and in-place merges
+        uint64_t records_dropped; // Superseded versions and tombstones removed by in-place merges
+        uint64_t lookups;         // Lookups that reached the level
+        uint64_t bucket_probes;   // Buckets read on the level because their fingerprint matched
+
+        [[nodiscard]] double read_amplification() const {
+            return lookups == 0 ? 0 : static_cast<double>(bucket_probes) / lookups;
+        }
+    };
+
+    // An insert or remove read from the WAL. Keys and values are as handed to insert().
+    struct Change {
+        uint64_t key;
+        uint64_t value;
+        int epoch;      // Epoch of the key's DRAM directory entry when it was logged
+        bool tombstone;
+    };
+
+    /**
+     * Reads the changes that are logged after it was opened. Changes of the same key are returned in the order they
+     * were committed. The cursor holds back the compaction of log chunks it hasn't read yet, but inserts don't wait
+     * for it: once a log runs full, a cursor still reading its oldest chunk is overtaken and returns no more changes.
+     * It must be closed before the table.
+     */
+    class ChangeCursor {
+    public:
+        explicit ChangeCursor(Hashtable &table);
+
+        ~ChangeCursor();
+
+        // Appends up to max_changes new changes and returns how many were appended
+        size_t poll(std::vector<Change> &changes, size_t max_changes);
+
+        // Whether the cursor fell so far behind that changes were compacted before it read them
+        [[nodiscard]] bool overtaken() const;
+
+    private:
+        Hashtable &table;
+        std::vector<int> chunks;
+        std::vector<uint32_t> generations;
+        std::vector<uint64_t> positions;
+        int next_log = 0;
+        bool is_overtaken = false;
+    };
+
+    /**
+     * A value read in place from its payload log chunk. While the view is alive, cleaning may still move the value,
+     * but the chunk isn't written again. Values kept in the table and compressed values are copied into the view.
+     */
+    class PinnedValue {
+    public:
+        PinnedValue() = default;
+
+        PinnedValue(PinnedValue &&other) noexcept;
+
+        PinnedValue &operator=(PinnedValue &&other) noexcept;
+
+        ~PinnedValue();
+
+        [[nodiscard]] std::span<const std::byte> value() const;
+
+    private:
+        friend class Hashtable;
+
+        std::atomic<int64_t> *pin = nullptr; // Released with the view, nullptr if it doesn't point into a chunk
+        const std::byte *data = nullptr;     // nullptr if the value was copied
+        size_t size = 0;
+        uint64_t small_value = 0;
+        std::unique_ptr<std::byte[]> decompressed;
+    };
+
+    // All PMem byte counts are what the CPU writes back or loads (cache lines for flushed metadata),
+    // not what the media writes internally
+    struct Stats {
+        uint64_t logical_bytes_written;          // Key and value bytes handed to insert() and remove()
+        uint64_t logical_bytes_read;             // Value bytes returned by lookup()
+        uint64_t lookups;
+        uint64_t wal_bytes;                      // Log entries
+        uint64_t payload_log_bytes;              // Payload log entries
+        uint64_t level_bytes[MAX_PMEM_LEVELS];   // Records written into the buckets of each level
+        uint64_t directory_bytes;                // Directory entry sizes, epochs and bucket pointers
+        uint64_t fingerprint_bytes;              // Fingerprints of levels that keep them on PMem
+        uint64_t compaction_bytes;               // Entries copied by WAL and payload log compaction
+        uint64_t pmem_bytes_read;                // Fingerprints, buckets and payloads read by lookups
+        uint64_t pmem_bytes_allocated;           // Directories, buckets and log chunks currently in use
+        uint64_t wal_compaction_stalls;          // Inserts that had to compact a log themselves
+        uint64_t log_pressure_migrations;        // DRAM directory entries migrated early to free log space
+        uint64_t checkpointer_migrations;        // DRAM directory entries migrated to bound the replayable log bytes
+        uint64_t payload_gc_stalls;              // Inserts that had to clean a payload log themselves
+        uint64_t payload_live_bytes;             // Payload log entries the table might still point to
+        uint64_t payload_value_bytes;            // Values written to the payload logs, before compression
+        uint64_t payload_stored_value_bytes;     // The same values as stored in the payload logs
+
+        [[nodiscard]] uint64_t pmem_bytes_written() const {
+            uint64_t total = wal_bytes + payload_log_bytes + directory_bytes + fingerprint_bytes + compaction_bytes;
+            for (uint64_t bytes : level_bytes) {
+                total += bytes;
+            }
+            return total;
+        }
+
+        [[nodiscard]] double write_amplification() const {
+            return logical_bytes_written == 0 ? 0 : static_cast<double>(pmem_bytes_written()) / logical_bytes_written;
+        }
+
+        [[nodiscard]] double read_amplification() const {
+            return logical_bytes_read == 0 ? 0 : static_cast<double>(pmem_bytes_read) / logical_bytes_read;
+        }
+
+        [[nodiscard]] double compression_ratio() const {
+            return payload_stored_value_bytes == 0 ? 0 : static_cast<double>(payload_value_bytes) / payload_stored_value_bytes;
+        }
+
+        // The table can't know how many of the inserted bytes are still live, the caller has to tell it
+        [[nodiscard]] double space_amplification(uint64_t live_bytes) const {
+            return live_bytes == 0 ? 0 : static_cast<double>(pmem_bytes_allocated) / live_bytes;
+        }
+    };
+
+    /**
+     * Opens the table stored in pmem_dir, or creates an empty one if reset is set. Opening an existing table replays
+     * its logs with recovery_threads threads, see RecoveryMode for when.
+     */
+    explicit Hashtable(const std::string& pmem_dir, bool reset, int recovery_threads = DEFAULT_RECOVERY_THREADS,
+                       RecoveryMode recovery_mode = DEFAULT_RECOVERY_MODE);
 
     ~Hashtable();
 
@@ -317,13 +838,126 @@ public:
 
     bool lookup(KeyType key, uint8_t *data);
 
+    /**
+     * Size of the key's value in bytes, or nothing if the key doesn't exist. Compressed values report their raw size.
+     */
+    std::optional<size_t> value_size(KeyType key);
+
+    /**
+     * Copies up to len bytes of the key's value, starting at offset, to data and returns how many were copied. Only
+     * the requested bytes are read, large reads bypass the cache. Returns nothing if the key doesn't exist.
+     */
+    std::optional<size_t> lookup_range(KeyType key, size_t offset, size_t len, uint8_t *data);
+
+    /**
+     * Returns a view of the key's value without copying it out of the payload log, or nothing if the key doesn't
+     * exist. Views should be short-lived: chunks that are freed while a view is alive can't be reused until it is
+     * destroyed, and inserts wait for that once no other chunk is free.
+     */
+    std::optional<PinnedValue> lookup_view(KeyType key);
+
     //TODO: Only supports fixed-size values for now
     int scan(KeyType lower_bound, int num_items, std::map<KeyType, ValType> &results);
 
+    /**
+     * Calls visitor with every live key and its newest value, in no particular order. The keys are split into
+     * num_partitions disjoint partitions by their DRAM directory entry, which can be scanned in parallel. The records of
+     * an entry are copied under its lock and visited once it is released, so the visitor may call into the table.
+     * Keys and values are only valid during the call.
+     */
+    void scan_partition(int partition, int num_partitions,
+                        const std::function<void(KeyType, std::span<const std::byte>)> &visitor);
+
+    // Migrates all DRAM directory entries to PMem with thread_count threads, so that a restart has nothing to replay
     void checkpoint(int thread_count);
 
+    // Runs checkpoint() in the background, the future is ready once it is done
+    std::future<void> checkpoint_async(int thread_count);
+
+    /**
+     * Bounds the log bytes a restart has to replay. A background thread migrates the DRAM directory entries with the
+     * oldest unpersisted log entries whenever the logs exceed it. 0, the default, switches it off.
+     *
+     * Replay time grows linearly with these bytes: recovery reads every replayed log entry from PMem and reinserts it
+     * into DRAM, spread over the recovery threads. To bound the time instead, measure the replay rate once, as
+     * replayable_log_bytes() before a restart over the log time that recovery prints, and pass the tolerated time
+     * multiplied by that rate.
+     */
+    void set_max_replay_bytes(size_t bytes);
+
+    // Log bytes a restart would have to replay right now
+    size_t replayable_log_bytes() const;
+
     long count();
 
+    /**
+     * Range mode only: Learns the level 0 split points from a sample of the keys that will be inserted.
+     * Must be called on an empty table. Keys outside the sample's range are still supported.
+     */
+    void train_partitions(std::span<const uint64_t> sample);
+
+    /**
+     * Loads the records into an empty table with num_threads threads. They bypass the DRAM buffer and the WAL and are
+     * written straight into the first level that can hold them. Of records with the same key, the last one wins.
+     * Must not run concurrently with other operations. If we crash before it returns, the table has to be reset.
+     */
+    void bulk_load(std::span<const std::pair<KeyType, ValType>> records, int num_threads);
+
+    /**
+     * Sends the changes the cursor reads to fd, a connected Unix socket, until stop is set and all changes logged so
+     * far are sent, until the other side disconnects, or until the cursor is overtaken. Both sides have to run the
+     * same build.
+     */
+    void serve_changes(ChangeCursor &cursor, int fd, const std::atomic<bool> &stop);
+
+    /**
+     * Replica mode: Applies the changes read from fd until it is closed. Changes are applied like log entries during
+     * recovery, without logging them again, so a replica that crashes has to be reset and fed from scratch.
+     */
+    void apply_changes(int fd);
+
+    void apply_change(const Change &change);
+
+    void set_merge_policy(int level, MergePolicy policy);
+
+    MergePolicy get_merge_policy(int level) const;
+
+    MergeStats merge_stats(int level) const;
+
+    /**
+     * Number of free chunks the background compaction keeps ready per log, so that inserts only have to switch
+     * chunks. Inserts compact synchronously only if no chunk is ready, which is counted in Stats.
+     */
+    void set_ready_log_chunks(int chunks);
+
+    /**
+     * Free chunks per payload log the background cleaning aims for (high) and below which inserts wait for cleaning
+     * (low). Inserts that have to clean a log themselves are counted in Stats.
+     */
+    void set_payload_watermarks(int low, int high);
+
+    /**
+     * Codec for values logged from now on. Values below COMPRESSION_MIN_VALUE_SIZE and values that don't shrink are
+     * logged raw. Lookups decompress into the caller's buffer, which has to hold the raw value.
+     */
+    void set_payload_codec(PayloadCodec codec);
+
+    // Share of each log's capacity that is taken by entries, compaction keeps this below 1
+    std::vector<double> log_fill_levels() const;
+
+    // Payload log that values of the variable sized key are appended to, e.g. for tests that fill a single log
+    [[nodiscard]] uint64_t payload_log_of(std::span<const std::byte> key);
+
+    Stats stats() const;
+
+    // Share of the logs that have been replayed since the table was opened
+    double recovery_progress() const;
+
+    /**
+     * Blocks until the table is fully recovered. Scans, checkpoints, bulk loads and change cursors wait for this
+     * themselves, payload log cleaning only starts afterwards.
+     */
+    void wait_for_recovery();
 
 private:
 
@@ -336,12 +970,23 @@ private:
 
     void migrateDRAM(uint64_t entry_idx);
 
+    /**
+     * Removes superseded versions (and tombstones on the last level) from a full directory entry without moving it
+     * to the next level. Survivors keep their relative order, so the newest version of a key always stays in front
+     * of older ones even if we crash halfway through.
+     * @return true if the entry has room for 'incoming' more records afterwards
+     */
+    bool merge_in_place(uint64_t directory_entry_idx, int level, int incoming);
+
+    bool should_merge_in_place(int level, PMEMDirectoryEntry* entry) const;
+
     int try_bulk_insert(int level, uint64_t directory_entry_idx, int epoch,
                         const uint64_t* keys,
                         const uint64_t* values,
                         int size);
 
-    void reinsert(uint64_t key, uint64_t val);
+    // Exclusive callers own the key's DRAM directory entry, so it isn't locked
+    void reinsert(uint64_t key, uint64_t val, bool exclusive = false);
 
     std::optional<LookupResult> lookup_internal(KeyType key);
 
@@ -355,12 +1000,18 @@ private:
 
     void scan_pmem_directory_entry(uint64_t entry_idx, int level, int num_items, KeyType lower_bound, std::map<KeyType, ValType> &results);
 
+    // Visits the newest live version of every key in the DRAM directory entry and the PMem entries below it
+    void scan_subtree(uint64_t dram_idx, const std::function<void(KeyType, std::span<const std::byte>)> &visitor);
+
     void update_keyset(Bucket &bucket, int bucket_size, int num_items, KeyType lower_bound, std::map<KeyType, ValType> &results);
 
     inline uint64_t get_pmem_directory_entry_idx(int level, uint64_t key);
 
     inline uint64_t get_dram_directory_entry_idx(KeyType key, uint64_t* subdivision_idx);
 
+    // The DRAM directory entry whose subtree holds the PMem directory entry
+    inline uint64_t get_dram_directory_entry_idx(int level, uint64_t pmem_entry_idx) const;
+
     inline uint64_t get_payloadlog_entry_idx(std::span<const std::byte> key);
 
     inline uint64_t get_log_entry_idx(KeyType key);
@@ -391,25 +1042,100 @@ private:
 
     void bulk_level_insert(int level, int epoch, const uint64_t *keys, const uint64_t *values, const int *sizes);
 
+    // Writes size records into an empty directory entry with streaming stores, the caller has to fence
+    void bulk_load_directory_entry(int level, uint64_t directory_entry_idx, const uint64_t *keys, const uint64_t *values, int size);
+
     void insert_into_DRAM_bucket(uint64_t entry_idx, int bucket_idx, int pos, uint64_t key,
                                  PayloadLocator value);
 
     void log_to_pmem(KeyType key, PayloadLocator value, int epoch);
 
-    PayloadLocator log_payload(std::span<const std::byte> key, std::span<const std::byte> value);
+    PayloadLocator log_payload(std::span<const std::byte> key, std::span<const std::byte> value, bool tombstone = false);
+
+    bool compact_log(uint64_t log_idx);
+
+    void log_compaction_runner(int thread_idx);
+
+    void relieve_log_pressure(uint64_t log_idx, bool force);
+
+    // Migrates the DRAM directory entries of a log that still have unpersisted entries in the chunk, nothing if the
+    // chunk was freed in the meantime
+    uint64_t migrate_pinning_entries(uint64_t log_idx, int chunk_idx);
 
-    void compact_log(uint64_t log_idx);
+    // Whether recovery would replay the chunk, i.e. whether any DRAM directory entry has unpersisted entries in it
+    bool is_pinned(uint64_t log_idx, const LogChunk &chunk) const;
 
-    void compact_payload_log(uint64_t log_idx);
+    // Entries of the log's chunks that recovery would replay, and the oldest of these chunks
+    size_t replayable_log_entries(uint64_t log_idx, int *oldest_pinned_chunk) const;
+
+    void checkpointer_runner();
+
+    bool advance_write_chunk(Log &log, int keep_free);
+
+    int pop_free_log_chunk(Log &log, int keep_free);
+
+    // Releases the change cursors that keep the next chunk to compact, returns false if there are none
+    bool overtake_change_cursors(Log &log);
+
+    /**
+     * Cleans the sealed chunk of a payload log with the best cost-benefit ratio. The caller has to hold the log's
+     * is_compacting flag.
+     * @return The share of the chunk that was garbage, negative if there was no sealed chunk
+     */
+    double compact_payload_log(uint64_t log_idx);
+
+    void payload_compaction_runner(int thread_idx);
+
+    // Marks the payload log entry a locator points to as superseded, so that cleaning can skip it
+    void mark_payload_dead(PayloadLocator locator);
 
     void recover_from_log();
 
-    void recover_single_log(uint64_t log_idx);
+    // Assumes that every chunk in use is full, the live entries are only known once the table is recovered
+    void reopen_payload_logs();
+
+    void recover_dram_epoch(uint64_t dram_idx);
+
+    // Replays the log of an OnDemand table's DRAM directory entry, unless that happened already
+    inline void ensure_recovered(uint64_t dram_idx);
+
+    // Rebuilds the DRAM filters of the log's directory entries and replays it. Waits if another thread is replaying it.
+    void recover_log_partition(uint64_t log_idx);
+
+    // Recovers the allocator, the logs nobody accessed yet and the payload logs of an OnDemand table
+    void recovery_sweep();
+
+    // Entries that survived the log scan, by the recovery partition of their DRAM directory entry. A partition is a
+    // contiguous range of DRAM directory entries.
+    using RecoveryPartitions = std::vector<std::vector<std::pair<uint64_t, uint64_t>>>;
+
+    // Collects the live entries of a log in log order, without replaying them yet
+    void recover_single_log(uint64_t log_idx, RecoveryPartitions &partitions);
+
+    // Rebuilds the live byte counts of a payload log's chunks and marks the entries the table doesn't point to
+    void recover_payload_log(uint64_t log_idx);
 
-    void recover_fingerprints_and_allocator_status(uint64_t thread_idx, uint64_t* allocator_status_array);
+    // Finds the buckets in use and, if fingerprints is set, rebuilds the DRAM filters with recovery_threads threads
+    void recover_allocator_status(bool fingerprints);
+
+    void recover_fingerprints_and_allocator_status(uint64_t thread_idx, uint64_t* allocator_status_array, bool fingerprints);
+
+    void recover_fingerprints(int level, uint64_t directory_idx);
+
+    // Loads the DRAM filters and the allocator from the snapshot of a cleanly closed table, and invalidates it
+    bool restore_snapshot();
+
+    void save_snapshot();
+
+    // Bytes of the DRAM filters of the levels that exist
+    size_t dram_fingerprint_size() const;
+
+    static uint64_t snapshot_checksum(const uint8_t *data, size_t size);
 
     void checkpoint_runner(uint64_t start_idx, uint64_t end_idx);
 
+    bool is_empty();
+
     /**
      * Returns whether the supplied payload locator fits the given key, i.e.:
      * The payload entry its pointing to is still living and has the same key
@@ -418,23 +1144,129 @@ private:
      */
     bool is_alive(PayloadLocator locator, KeyType key);
 
+    // Whether the locator might belong to the key, decided from the locator alone
+    bool matches_tag(PayloadLocator locator, KeyType key) const;
+
+    // Whether the payload log entry the locator points to has been cleaned, inline records never are
+    bool is_collected(PayloadLocator locator) const;
+
+    // Whether the bucket slot, whose bucket key matches, holds a record of the key, and the record's locator. Lookups
+    // don't lock the DRAM directory entry, so cleaning might move the record meanwhile
+    bool slot_matches(const Bucket &bucket, int slot, KeyType key, bool deleted, PayloadLocator *locator);
+
+    // Whether two records whose bucket keys are equal belong to the same key
+    bool is_same_key(PayloadLocator a, PayloadLocator b) const;
+
+    // The payload log entry the locator points to, or nullptr if its chunk was reused since the locator was read.
+    // Readers have to pin the payload chunks before they read the locator, so that the entry stays valid afterwards
+    PayloadLogEntry *get_payload_entry(PayloadLocator locator) const;
+
+    // Whether the key's newest record still has the locator. Lookups read payloads without a lock, so a payload that
+    // looks corrupt might just have been cleaned meanwhile, and the lookup has to be retried
+    bool still_points_to(KeyType key, PayloadLocator locator);
+
     bool is_deleted(const Bucket& bucket, uint8_t pos) const;
 
     [[nodiscard]] static uint64_t hash_key(const uint64_t &key);
 
+    [[nodiscard]] static __m512i hash_keys(__m512i keys);
+
+    // The DRAM directory entry a log entry belongs to, variable sized keys are logged as their hash
+    uint64_t get_logged_dram_directory_entry_idx(uint64_t logged_key);
+
+    /**
+     * Decodes the 8 log entries starting at entries and returns which of them have the expected valid bit (valid_mask)
+     * and were not persisted by a migration of their DRAM directory entry yet (return value)
+     */
+    __mmask8 filter_log_entries(const LogEntry *entries, bool expected_valid_bit, __mmask8 *valid_mask);
+
+    // The same for the count (at most 8) entries starting at entries, one entry at a time
+    __mmask8 filter_log_entries_scalar(const LogEntry *entries, int count, bool expected_valid_bit, __mmask8 *valid_mask);
+
     [[nodiscard]] uint64_t range_partition_key(const uint64_t &key, uint64_t level) const;
 
+    [[nodiscard]] RangeBounds get_range_bounds(int level, uint64_t entry_idx) const;
+
+    // Bounds of a child of the entry with the given bounds, from the lower bounds of its children 1 to 15
+    [[nodiscard]] static RangeBounds get_child_bounds(const RangeBounds &bounds, const uint64_t *lower_bounds, int child);
+
+    // Writes the lower bounds of the entry's children 1 to 15 to lower_bounds
+    void get_child_lower_bounds(int level, uint64_t entry_idx, const RangeBounds &bounds, uint64_t *lower_bounds) const;
+
+    // Learns the split points of the entry's children from its keys on its first migration, or freezes the current ones
+    void refine_range_partitions(int level, uint64_t entry_idx);
+
+    // Persists the current split points of the entry's children, so that refining them can't strand records that
+    // were loaded into deeper levels
+    void pin_range_partitions(int level, uint64_t entry_idx);
+
+    void init_partitions(const std::string &partitions_file, bool reset);
+
+    // Changing the level 0 split points is framed by these two: range_lower_bounds is written in between
+    void invalidate_partitions();
+
+    void commit_partitions(uint64_t range_max);
+
     [[nodiscard]] static uint64_t hash_key(const std::span<const std::byte> &key);
 
+    // Inverts hash_key() for keys of up to INLINE_MAX_KEY_SIZE bytes, whose hashes are all that inline records keep
+    [[nodiscard]] static uint64_t unhash_small_key(uint64_t hash);
+
+    // Secondary fingerprint of the key stored in its payload locators, independent of hash_key()
+    [[nodiscard]] static uint64_t key_tag(const std::span<const std::byte> &key);
+
     uint64_t get_key_representation(const KeyType &key);
 
     static uint64_t get_key_or_hash(uint64_t key);
 
-    static bool move_log_entry(const LogChunk &source, LogChunk &target,  uint64_t read_pos, bool target_valid_bit);
+    static int get_stat_stripe();
+
+    // Keeps the payload log chunks the caller reads from from being reused, returns the counter to release
+    std::atomic<int64_t> *pin_payload_chunks();
+
+    // Advances the reclamation epoch unless values pinned in the previous one are left
+    void try_advance_reclamation_epoch();
 
-    static void move_payload_log_entry(PayloadLogEntry* source, PayloadLogEntry* target);
+    // The next free chunk after chunk_idx that no pinned value points into, -1 if all free chunks are still pinned
+    int next_free_payload_chunk(PayloadLog &log, int chunk_idx);
+
+    // Whether no pinned value or view can point into the freed chunk anymore, so that it can be written again
+    bool is_reusable(const PayloadLogChunk &chunk);
+
+    MergeCounters &get_merge_counters(int level);
+
+    IOCounters &get_io_counters();
+
+    static bool move_log_entry(const LogChunk &source, LogChunk &target, uint64_t read_pos, int epoch_idx, bool target_valid_bit);
+
+    // Persists a high-water mark of the chunk behind pos, has to be called before the entry at pos is written
+    static void raise_high_water_mark(LogChunk &chunk, size_t pos);
+
+    static void move_payload_log_entry(PayloadLogEntry* source, PayloadLogEntry* target, uint32_t target_epoch);
+
+    static void init_payload_log_entry(PayloadLogEntry* entry, uint64_t key_len, uint64_t val_len, std::byte flags, uint32_t epoch);
+
+    static uint16_t payload_log_entry_check(uint64_t key_len, uint64_t val_len, uint32_t epoch);
+
+    /**
+     * Position of the first entry of the chunk's current generation at or after read_pos, or end if there is none.
+     * Entries are written back to back, so the first stale one ends the chunk, unless the chunk is torn. Headers
+     * found behind a gap might lie within another entry, so callers only skip over entries the table points to.
+     */
+    size_t next_payload_log_entry(const PayloadLogChunk &chunk, uint32_t epoch, bool torn, size_t read_pos, size_t end) const;
+
+    // Space an entry takes in its chunk, entries start at multiples of the locator layout's granularity
+    static size_t payload_entry_size(size_t key_len, size_t val_len);
 
     static int mmap_pmem_file(const std::string &filename, size_t max_size, char** target);
+
+    // Allocates the file range up front, so that faulting it in later can't run out of space
+    static void reserve_pmem(int fd, size_t offset, size_t length);
+
+    // Allocates the directory of the level and its preallocated buckets
+    void reserve_level(int level);
+
+    void reserve_payload_chunk(int log_idx, int chunk_idx);
 };
 
 
@@ -0,0 +1,217 @@
+//
+// A small LZ77 codec for payload log values. The output is an LZ4 block (token, literals, 16 bit offset, match
+// length), compressed greedily with a single hash table, which is fast enough to run on the insert path.
+//
+
+#ifndef LSM_LZCODEC_H
+#define LSM_LZCODEC_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+class LzCodec {
+
+public:
+
+    // Upper bound of the compressed size of size bytes
+    static constexpr size_t max_compressed_size(size_t size) {
+        return size + size / 255 + 16;
+    }
+
+    // Returns the compressed size, or 0 if the block would not fit into capacity bytes
+    static size_t compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity) {
+        uint32_t table[1 << HASH_BITS] = {}; // Position + 1 of the last sequence with this hash, 0 if none
+
+        const uint8_t *ip = src;
+        const uint8_t *anchor = src;
+        const uint8_t *end = src + size;
+        uint8_t *op = dst;
+        uint8_t *op_end = dst + capacity;
+
+        if (size >= MIN_INPUT) {
+            const uint8_t *match_limit = end - MF_LIMIT;
+            while (ip < match_limit) {
+                uint32_t sequence = read32(ip);
+                uint32_t &slot = table[hash(sequence)];
+                const uint8_t *match = src + slot - 1;
+                bool found = slot != 0 && ip - match <= MAX_OFFSET && read32(match) == sequence;
+                slot = static_cast<uint32_t>(ip - src + 1);
+
+                if (!found) {
+                    ++ip;
+                    continue;
+                }
+
+                size_t match_len = MIN_MATCH;
+                while (ip + match_len < end - LAST_LITERALS && match[match_len] == ip[match_len]) {
+                    ++match_len;
+                }
+
+                op = write_sequence(op, op_end, anchor, ip - anchor, ip - match, match_len);
+                if (op == nullptr) {
+                    return 0;
+                }
+                ip += match_len;
+                anchor = ip;
+            }
+        }
+
+        op = write_sequence(op, op_end, anchor, end - anchor, 0, 0);
+        return op == nullptr ? 0 : op - dst;
+    }
+
+    // Decompresses exactly raw_size bytes into dst, returns false if the block is corrupt
+    static bool decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size) {
+        return decode(src, size, dst, raw_size, false);
+    }
+
+    // Decompresses only the first prefix bytes of the block into dst and stops there
+    static bool decompress_prefix(const uint8_t *src, size_t size, uint8_t *dst, size_t prefix) {
+        return decode(src, size, dst, prefix, true);
+    }
+
+private:
+
+    static constexpr int HASH_BITS = 12;
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr ptrdiff_t MAX_OFFSET = 65535;
+
+    // The block format requires the last 5 bytes to be literals and the last match to start 12 bytes before the end
+    static constexpr size_t LAST_LITERALS = 5;
+    static constexpr size_t MF_LIMIT = 12;
+    static constexpr size_t MIN_INPUT = MF_LIMIT + 1;
+
+    // Writes at most limit bytes. Unless partial, the block has to decompress to exactly limit bytes
+    static bool decode(const uint8_t *src, size_t size, uint8_t *dst, size_t limit, bool partial) {
+        const uint8_t *ip = src;
+        const uint8_t *end = src + size;
+        uint8_t *op = dst;
+        uint8_t *op_end = dst + limit;
+
+        if (partial && limit == 0) {
+            return true;
+        }
+
+        while (ip < end) {
+            uint8_t token = *ip++;
+
+            size_t literals = token >> 4;
+            if (literals == 15 && !read_length(ip, end, literals)) {
+                return false;
+            }
+            if (literals > static_cast<size_t>(end - ip) || (!partial && literals > static_cast<size_t>(op_end - op))) {
+                return false;
+            }
+            size_t copied = std::min(literals, static_cast<size_t>(op_end - op));
+            memcpy(op, ip, copied);
+            op += copied;
+            ip += literals;
+            if (partial && op == op_end) {
+                return true;
+            }
+
+            if (ip == end) {
+                // The last sequence has no match
+                return op == op_end;
+            }
+
+            if (end - ip < 2) {
+                return false;
+            }
+            size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > static_cast<size_t>(op - dst)) {
+                return false;
+            }
+
+            size_t match_len = token & 15;
+            if (match_len == 15 && !read_length(ip, end, match_len)) {
+                return false;
+            }
+            match_len += MIN_MATCH;
+            if (match_len > static_cast<size_t>(op_end - op)) {
+                if (!partial) {
+                    return false;
+                }
+                match_len = op_end - op;
+            }
+
+            const uint8_t *match = op - offset;
+            if (offset >= match_len) {
+                memcpy(op, match, match_len);
+            } else {
+                // Overlapping matches repeat the last offset bytes
+                for (size_t i = 0; i < match_len; ++i) {
+                    op[i] = match[i];
+                }
+            }
+            op += match_len;
+            if (partial && op == op_end) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static uint32_t read32(const uint8_t *p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint32_t hash(uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    static bool read_length(const uint8_t *&ip, const uint8_t *end, size_t &length) {
+        uint8_t byte;
+        do {
+            if (ip == end) {
+                return false;
+            }
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    static uint8_t *write_length(uint8_t *op, size_t length) {
+        for (; length >= 255; length -= 255) {
+            *op++ = 255;
+        }
+        *op++ = static_cast<uint8_t>(length);
+        return op;
+    }
+
+    // A match_len of 0 writes the last sequence, which only has literals
+    static uint8_t *write_sequence(uint8_t *op, uint8_t *op_end, const uint8_t *literals, size_t literal_len,
+                                   size_t offset, size_t match_len) {
+        size_t needed = 1 + literal_len / 255 + 1 + literal_len + (match_len == 0 ? 0 : 2 + match_len / 255 + 1);
+        if (needed > static_cast<size_t>(op_end - op)) {
+            return nullptr;
+        }
+
+        uint8_t *token = op++;
+        *token = static_cast<uint8_t>(std::min<size_t>(literal_len, 15) << 4);
+        if (literal_len >= 15) {
+            op = write_length(op, literal_len - 15);
+        }
+        memcpy(op, literals, literal_len);
+        op += literal_len;
+
+        if (match_len != 0) {
+            *op++ = static_cast<uint8_t>(offset);
+            *op++ = static_cast<uint8_t>(offset >> 8);
+            *token |= static_cast<uint8_t>(std::min<size_t>(match_len - MIN_MATCH, 15));
+            if (match_len - MIN_MATCH >= 15) {
+                op = write_length(op, match_len - MIN_MATCH - 15);
+            }
+        }
+        return op;
+    }
+};
+
+
+#endif //LSM_LZCODEC_H
@@ -3,7 +3,12 @@
 //
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 
+#include <chrono>
 #include <condition_variable>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include "doctest.h"
 #include "../src/hashtable/Hashtable.h"
 #include "Multithreader.h"
@@ -646,4 +651,921 @@ TEST_CASE_TEMPLATE("Checkpointing", T, uint64_t, std::span<const std::byte>) {
     multithreader.insert(table, 48, 0, 100e6);
     table.checkpoint(1);
     table.count();
-}
\ No newline at end of file
+}
+
+TEST_CASE_TEMPLATE("Tiered merge policy compacts updates in place", T, uint64_t, std::span<const std::byte>) {
+    Hashtable<T, T, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+
+    table.set_merge_policy(0, MergePolicy::Tiered);
+    table.set_merge_policy(1, MergePolicy::Tiered);
+    CHECK(table.get_merge_policy(0) == MergePolicy::Tiered);
+    CHECK(table.get_merge_policy(2) == MergePolicy::Leveled);
+
+    for (uint64_t i = 0; i <= 10e6; ++i) {
+        uint64_t key = i % 1000;
+        if constexpr (std::is_integral_v<T>) {
+            table.insert(key, i);
+        } else {
+            std::span<std::byte> key_span{reinterpret_cast<std::byte *>(&key), 8};
+            std::span<std::byte> val{reinterpret_cast<std::byte *>(&i), 8};
+
+            table.insert(key_span, val);
+        }
+    }
+
+    auto stats = table.merge_stats(0);
+    CHECK(stats.in_place_merges > 0);
+    CHECK(stats.records_dropped > 0);
+
+    for (uint64_t key = 0; key < 1000; ++key) {
+        uint64_t pointer_val;
+        bool found;
+        if constexpr (std::is_integral_v<T>) {
+            found = table.lookup(key, (uint8_t*)&pointer_val);
+        } else {
+            std::span<std::byte> key_span{reinterpret_cast<std::byte*>(&key), 8};
+            found = table.lookup(key_span, (uint8_t*)&pointer_val);
+        }
+        CHECK(found);
+        CHECK(pointer_val == 10e6 - (10000000 - key) % 1000);
+    }
+}
+
+TEST_CASE("Amplification counters track logical and physical bytes") {
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+    Multithreader<uint64_t, uint64_t, PartitionType::Hash> multithreader;
+
+    multithreader.insert(table, 4, 0, 1e6);
+    table.checkpoint(1);
+
+    auto stats = table.stats();
+    CHECK(stats.logical_bytes_written == 1e6 * 2 * sizeof(uint64_t));
+    CHECK(stats.wal_bytes >= stats.logical_bytes_written);
+    CHECK(stats.level_bytes[0] > 0);
+    CHECK(stats.directory_bytes > 0);
+    CHECK(stats.write_amplification() > 1);
+
+    multithreader.lookup(table, 4, 0, 1e6);
+    stats = table.stats();
+    CHECK(stats.lookups == 1e6);
+    CHECK(stats.logical_bytes_read == 1e6 * sizeof(uint64_t));
+    CHECK(stats.pmem_bytes_read > 0);
+    CHECK(stats.space_amplification(1e6 * 2 * sizeof(uint64_t)) > 1);
+}
+
+TEST_CASE("Directory writes that allocate buckets count the flushed bucket pointers") {
+    Hashtable<uint64_t, uint64_t, PartitionType::Range> table("/mnt/pmem0/vogel/tabletest", true);
+
+    // The keys share a DRAM directory entry and fill its children on level 1, so updates reach level 2, whose buckets
+    // aren't preallocated
+    for (uint64_t round = 0; round < 10; ++round) {
+        for (uint64_t key = 0; key < 4096; ++key) {
+            table.insert(key, round);
+        }
+    }
+    REQUIRE(table.merge_stats(2).records_written > 0);
+
+    // Every directory write persists the cache line with the entry's size, the first write into a new bucket also the
+    // two cache lines of bucket pointers
+    uint64_t directory_writes = 0;
+    for (int level = 0; level < 4; ++level) {
+        auto stats = table.merge_stats(level);
+        directory_writes += stats.entries_written + stats.drains + stats.in_place_merges;
+    }
+    CHECK(table.stats().directory_bytes > directory_writes * 64);
+}
+
+TEST_CASE("Trained range partitions spread skewed keys and survive recovery") {
+    // Keys far beyond the default range of 2^28, all values would end up in the last partition without training
+    constexpr uint64_t base = 1ul << 50;
+    constexpr uint64_t stride = 1000003;
+    constexpr int num_keys = 1e6;
+
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Range> table("/mnt/pmem0/vogel/tabletest", true);
+
+        std::vector<uint64_t> sample;
+        for (int i = 0; i < num_keys; i += 100) {
+            sample.push_back(base + i * stride);
+        }
+        table.train_partitions(sample);
+
+        for (int i = 0; i < num_keys; ++i) {
+            table.insert(base + i * stride, i);
+        }
+        // Keys beyond the trained range still have to be accepted
+        for (int i = 0; i < 1000; ++i) {
+            table.insert(UINT64_MAX - i, i);
+        }
+    }
+
+    Hashtable<uint64_t, uint64_t, PartitionType::Range> table("/mnt/pmem0/vogel/tabletest", false);
+    CHECK(table.count() == num_keys + 1000);
+
+    for (int i = 0; i < num_keys; i += 997) {
+        uint64_t val;
+        CHECK(table.lookup(base + i * stride, reinterpret_cast<uint8_t *>(&val)));
+        CHECK(val == i);
+    }
+
+    std::map<uint64_t, uint64_t> scan_result;
+    uint64_t start = base + 4242 * stride;
+    table.scan(start, 100, scan_result);
+
+    CHECK(scan_result.size() == 100);
+    for (int i = 0; i < 100; ++i) {
+        CHECK(scan_result[start + i * stride] == 4242 + i);
+    }
+}
+
+TEST_CASE("Tables can only be opened with the partitioning they were created with") {
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Range> table("/mnt/pmem0/vogel/tabletest", true);
+        table.insert(42, 42);
+    }
+    CHECK_THROWS_AS((Hashtable<uint64_t, uint64_t, PartitionType::Hash>("/mnt/pmem0/vogel/tabletest", false)), std::runtime_error);
+
+    // Tables created before the partitioning was recorded are taken as they are opened
+    int fd = open("/mnt/pmem0/vogel/tabletest/metadata.dat", O_RDWR);
+    REQUIRE(fd >= 0);
+    int unrecorded = 0;
+    REQUIRE(pwrite(fd, &unrecorded, sizeof(unrecorded), 40) == sizeof(unrecorded));
+    close(fd);
+
+    Hashtable<uint64_t, uint64_t, PartitionType::Range> table("/mnt/pmem0/vogel/tabletest", false);
+    uint64_t val;
+    CHECK(table.lookup(42, reinterpret_cast<uint8_t *>(&val)));
+    CHECK(val == 42);
+}
+
+TEST_CASE("Background log compaction keeps inserts from compacting") {
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        Multithreader<uint64_t, uint64_t, PartitionType::Hash> multithreader;
+
+        multithreader.insert(table, 24, 0, 200e6);
+        multithreader.lookup(table, 24, 0, 200e6);
+    }
+
+    // Without ready chunks every insert that fills a chunk has to compact the log itself
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+    Multithreader<uint64_t, uint64_t, PartitionType::Hash> multithreader;
+    table.set_ready_log_chunks(0);
+
+    multithreader.insert(table, 24, 200e6, 300e6);
+    CHECK(table.stats().wal_compaction_stalls > 0);
+    multithreader.lookup(table, 24, 0, 300e6);
+}
+
+TEST_CASE("Log fill levels stay below capacity under log pressure") {
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+    Multithreader<uint64_t, uint64_t, PartitionType::Hash> multithreader;
+
+    for (double fill_level : table.log_fill_levels()) {
+        CHECK(fill_level == 0);
+    }
+
+    // Updates keep all DRAM directory entries busy, the logs only get free space through migrations
+    for (int round = 0; round < 10; ++round) {
+        multithreader.insert(table, 24, 0, 50e6);
+    }
+
+    for (double fill_level : table.log_fill_levels()) {
+        CHECK(fill_level > 0);
+        CHECK(fill_level < 1);
+    }
+    multithreader.lookup(table, 24, 0, 50e6);
+}
+
+TEST_CASE("Bulk loaded values can be updated and survive recovery") {
+    constexpr int num_keys = 20e6;
+
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+
+        std::vector<std::pair<uint64_t, uint64_t>> records;
+        records.reserve(num_keys + 1);
+        for (int i = 0; i < num_keys; ++i) {
+            records.emplace_back(i, i);
+        }
+        // Of two records with the same key, the later one wins
+        records.emplace_back(4242, 42);
+
+        table.bulk_load(records, 24);
+        CHECK(table.stats().wal_bytes == 0);
+        CHECK_THROWS(table.bulk_load(records, 24));
+
+        for (int i = 0; i < 1000; ++i) {
+            table.insert(i, i + 1);
+        }
+    }
+
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+    for (int i = 0; i < num_keys; i += (i < 1000 ? 1 : 97)) {
+        uint64_t val;
+        CHECK(table.lookup(i, reinterpret_cast<uint8_t *>(&val)));
+        CHECK(val == (i < 1000 ? i + 1 : i));
+    }
+    uint64_t val;
+    CHECK(table.lookup(4242, reinterpret_cast<uint8_t *>(&val)));
+    CHECK(val == 42);
+}
+
+TEST_CASE("A replica fed by the change stream sees inserts and removes") {
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash> primary("/mnt/pmem0/vogel/tabletest", true);
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash> replica("/mnt/pmem0/vogel/replicatest", true);
+    Multithreader<uint64_t, uint64_t, PartitionType::Hash> multithreader;
+
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    std::atomic<bool> stop = false;
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash>::ChangeCursor cursor(primary);
+    std::thread server([&] {
+        primary.serve_changes(cursor, fds[0], stop);
+        close(fds[0]);
+    });
+    std::thread applier([&] { replica.apply_changes(fds[1]); });
+
+    multithreader.insert(primary, 24, 0, 10e6);
+    multithreader.remove(primary, 24, 0, 1000);
+
+    stop = true;
+    server.join();
+    applier.join();
+    close(fds[1]);
+
+    multithreader.lookup(replica, 24, 0, 1000, true);
+    multithreader.lookup(replica, 24, 1000, 10e6);
+}
+
+TEST_CASE("Inserts overtake a change cursor that falls behind") {
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+    Multithreader<uint64_t, uint64_t, PartitionType::Hash> multithreader;
+
+    // The cursor never reads, so the logs run full behind it
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash>::ChangeCursor cursor(table);
+    multithreader.insert(table, 24, 0, 200e6);
+    multithreader.lookup(table, 24, 0, 200e6);
+
+    std::vector<Hashtable<uint64_t, uint64_t, PartitionType::Hash>::Change> changes;
+    while (cursor.poll(changes, 4096) > 0) {
+        changes.clear();
+    }
+    CHECK(cursor.overtaken());
+}
+
+TEST_CASE("Background payload log cleaning reclaims overwritten values") {
+    Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+    // Start cleaning a log as soon as its first chunk is full
+    table.set_payload_watermarks(2, 62);
+
+    std::vector<std::byte> value(4096);
+    for (uint64_t i = 0; i < 2e6; ++i) {
+        uint64_t key = i % 20000;
+        memcpy(value.data(), &i, 8);
+        std::span<std::byte> key_span{reinterpret_cast<std::byte *>(&key), 8};
+        table.insert(key_span, value);
+    }
+
+    auto stats = table.stats();
+    CHECK(stats.payload_gc_stalls == 0);
+    // Without cleaning, the payload logs alone would take up 8 GB
+    CHECK(stats.pmem_bytes_allocated < 8e9);
+
+    for (uint64_t key = 0; key < 20000; ++key) {
+        std::vector<uint8_t> pointer_val(4096);
+        std::span<std::byte> key_span{reinterpret_cast<std::byte*>(&key), 8};
+        CHECK(table.lookup(key_span, pointer_val.data()));
+        CHECK(*reinterpret_cast<uint64_t *>(pointer_val.data()) == 2e6 - 20000 + key);
+    }
+}
+
+TEST_CASE("Payload log live bytes only count the newest versions and survive recovery") {
+    const uint64_t entry_size = 24 + 8 + 1024;
+    std::vector<std::byte> value(1024);
+    {
+        Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        for (uint64_t i = 0; i < 1e6; ++i) {
+            uint64_t key = i % 20000;
+            memcpy(value.data(), &i, 8);
+            std::span<std::byte> key_span{reinterpret_cast<std::byte *>(&key), 8};
+            table.insert(key_span, value);
+        }
+        // Superseded versions on PMem are only subtracted once their directory entries are merged
+        uint64_t live_bytes = table.stats().payload_live_bytes;
+        CHECK(live_bytes >= 20000 * entry_size);
+        CHECK(live_bytes < 5 * 20000 * entry_size);
+    }
+
+    Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+    // Recovery looks up every entry, so it knows exactly
+    CHECK(table.stats().payload_live_bytes == 20000 * entry_size);
+}
+
+TEST_CASE("Small records are kept in the buckets and mix with large ones") {
+    std::vector<std::byte> large(1024);
+    auto key_span = [](uint64_t &key) { return std::span<std::byte>{reinterpret_cast<std::byte *>(&key), 8}; };
+    {
+        Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        for (uint64_t key = 0; key < 10e6; ++key) {
+            uint32_t counter = key;
+            table.insert(key_span(key), std::span<std::byte>{reinterpret_cast<std::byte *>(&counter), 4});
+        }
+        CHECK(table.stats().payload_log_bytes == 0);
+
+        // Every tenth record grows out of its bucket, every hundredth is removed
+        for (uint64_t key = 0; key < 10e6; key += 10) {
+            memcpy(large.data(), &key, 8);
+            table.insert(key_span(key), large);
+        }
+        for (uint64_t key = 0; key < 10e6; key += 100) {
+            table.remove(key_span(key));
+        }
+        CHECK(table.stats().payload_log_bytes > 0);
+    }
+
+    Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+    for (uint64_t key = 0; key < 10e6; ++key) {
+        uint64_t value[128] = {0};
+        bool found = table.lookup(key_span(key), reinterpret_cast<uint8_t *>(value));
+        if (key % 100 == 0) {
+            CHECK(!found);
+        } else if (key % 10 == 0) {
+            CHECK(found);
+            CHECK(value[0] == key);
+        } else {
+            CHECK(found);
+            CHECK(value[0] == static_cast<uint32_t>(key));
+        }
+    }
+}
+
+TEST_CASE("Compressed values are returned raw and survive recovery") {
+    auto key_span = [](uint64_t &key) { return std::span<std::byte>{reinterpret_cast<std::byte *>(&key), 8}; };
+    // Half of the values repeat their key, the other half are random and stay raw
+    auto make_value = [](uint64_t key, std::vector<uint64_t> &value) {
+        for (size_t i = 0; i < value.size(); ++i) {
+            value[i] = key % 2 == 0 ? key : (key + 1) * 0x9E3779B97F4A7C15ULL * (i + 1);
+        }
+    };
+    std::vector<uint64_t> value(64);
+    {
+        Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        table.set_payload_codec(PayloadCodec::LZ);
+        for (uint64_t key = 0; key < 1e6; ++key) {
+            make_value(key, value);
+            table.insert(key_span(key), std::as_bytes(std::span(value)));
+        }
+        auto stats = table.stats();
+        CHECK(stats.payload_value_bytes == 1e6 * 512);
+        CHECK(stats.compression_ratio() > 1.5);
+    }
+
+    Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+    std::vector<uint64_t> expected(64);
+    for (uint64_t key = 0; key < 1e6; ++key) {
+        make_value(key, expected);
+        CHECK(table.lookup(key_span(key), reinterpret_cast<uint8_t *>(value.data())));
+        CHECK(value == expected);
+    }
+}
+
+TEST_CASE("Removed long keys stay removed and only log their key") {
+    auto key_span = [](uint64_t (&key)[2]) { return std::span<std::byte>{reinterpret_cast<std::byte *>(key), 16}; };
+    std::vector<std::byte> value(100);
+    {
+        Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        for (uint64_t i = 0; i < 1e6; ++i) {
+            uint64_t key[2] = {i, ~i};
+            table.insert(key_span(key), value);
+        }
+        uint64_t logged = table.stats().payload_log_bytes;
+        for (uint64_t i = 0; i < 1e6; i += 2) {
+            uint64_t key[2] = {i, ~i};
+            table.remove(key_span(key));
+        }
+        // Tombstones only have a header and the key
+        CHECK(table.stats().payload_log_bytes - logged == 5e5 * (24 + 16));
+    }
+
+    Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+    std::vector<std::byte> result(100);
+    for (uint64_t i = 0; i < 1e6; ++i) {
+        uint64_t key[2] = {i, ~i};
+        CHECK(table.lookup(key_span(key), reinterpret_cast<uint8_t *>(result.data())) == (i % 2 == 1));
+    }
+}
+
+TEST_CASE("Tables can only be opened with the payload locator layout they were created with") {
+    using Table = Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash>;
+    std::string key = "a key that is too long to inline";
+    std::vector<std::byte> value(100, std::byte{42});
+    {
+        Table table("/mnt/pmem0/vogel/tabletest", true);
+        table.insert(std::as_bytes(std::span(key)), value);
+    }
+
+    // The layout follows the number of PMem levels in the metadata, its first member is the chunk size
+    int fd = open("/mnt/pmem0/vogel/tabletest/metadata.dat", O_RDWR);
+    REQUIRE(fd >= 0);
+    long chunk_size;
+    REQUIRE(pread(fd, &chunk_size, sizeof(chunk_size), 8) == sizeof(chunk_size));
+    CHECK(chunk_size == DEFAULT_LOCATOR_LAYOUT.chunk_size);
+
+    long other_chunk_size = chunk_size * 2;
+    REQUIRE(pwrite(fd, &other_chunk_size, sizeof(other_chunk_size), 8) == sizeof(other_chunk_size));
+    CHECK_THROWS_AS(Table("/mnt/pmem0/vogel/tabletest", false), std::runtime_error);
+
+    // Tables created before the layout was recorded use the default layout
+    long unrecorded[3] = {0, 0, 0};
+    REQUIRE(pwrite(fd, unrecorded, sizeof(unrecorded), 8) == sizeof(unrecorded));
+    close(fd);
+
+    Table table("/mnt/pmem0/vogel/tabletest", false);
+    std::vector<std::byte> result(100);
+    CHECK(table.lookup(std::as_bytes(std::span(key)), reinterpret_cast<uint8_t *>(result.data())));
+    CHECK(result == value);
+}
+
+TEST_CASE("Tables can only be opened with the key hash they were created with") {
+    using Table = Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash>;
+    std::string key = "short";
+    std::vector<std::byte> value(4, std::byte{42});
+    {
+        Table table("/mnt/pmem0/vogel/tabletest", true);
+        table.insert(std::as_bytes(std::span(key)), value);
+    }
+
+    // The hash version follows the payload locator layout in the metadata
+    int fd = open("/mnt/pmem0/vogel/tabletest/metadata.dat", O_RDWR);
+    REQUIRE(fd >= 0);
+    int version;
+    REQUIRE(pread(fd, &version, sizeof(version), 32) == sizeof(version));
+    CHECK(version == 2);
+
+    // Tables created before the version was recorded hashed short keys like long ones
+    int unrecorded = 0;
+    REQUIRE(pwrite(fd, &unrecorded, sizeof(unrecorded), 32) == sizeof(unrecorded));
+    close(fd);
+    CHECK_THROWS_AS(Table("/mnt/pmem0/vogel/tabletest", false), std::runtime_error);
+}
+
+TEST_CASE("Cleaned payload chunks are reused without zeroing them") {
+    std::vector<std::byte> value(4096);
+    {
+        Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        table.set_payload_watermarks(2, 62);
+        for (uint64_t i = 0; i < 2e6; ++i) {
+            uint64_t key = i % 20000;
+            memcpy(value.data(), &i, 8);
+            table.insert(std::span<std::byte>{reinterpret_cast<std::byte *>(&key), 8}, value);
+        }
+        // Only the entries themselves are written, the stale ones of reused chunks stay in place
+        auto stats = table.stats();
+        CHECK(stats.payload_log_bytes == 2e6 * (24 + 8 + 4096));
+    }
+
+    // Recovery tells the entries of reused chunks apart from the stale ones by their epoch
+    Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+    for (uint64_t key = 0; key < 20000; ++key) {
+        std::vector<uint8_t> result(4096);
+        CHECK(table.lookup(std::span<std::byte>{reinterpret_cast<std::byte *>(&key), 8}, result.data()));
+        CHECK(*reinterpret_cast<uint64_t *>(result.data()) == 2e6 - 20000 + key);
+    }
+    CHECK(table.stats().payload_live_bytes == 20000 * (24 + 8 + 4096));
+}
+
+TEST_CASE("New tables only allocate the PMem of their first level and chunks") {
+    Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+
+    struct stat payload_log;
+    REQUIRE(stat("/mnt/pmem0/vogel/tabletest/payload_log0", &payload_log) == 0);
+    // Only the write chunk and the compaction target are allocated, not the whole file
+    CHECK(payload_log.st_blocks * 512 <= 3 * DEFAULT_LOCATOR_LAYOUT.chunk_size);
+    CHECK(payload_log.st_blocks * 512 < payload_log.st_size);
+
+    struct stat buckets;
+    REQUIRE(stat("/mnt/pmem0/vogel/tabletest/buckets.dat", &buckets) == 0);
+    CHECK(buckets.st_blocks * 512 < buckets.st_size);
+
+    std::vector<std::byte> value(1024, std::byte{42});
+    for (uint64_t key = 0; key < 100000; ++key) {
+        table.insert(std::span<std::byte>{reinterpret_cast<std::byte *>(&key), 8}, value);
+    }
+    for (uint64_t key = 0; key < 100000; ++key) {
+        std::vector<uint8_t> result(1024);
+        REQUIRE(table.lookup(std::span<std::byte>{reinterpret_cast<std::byte *>(&key), 8}, result.data()));
+        CHECK(result[1023] == 42);
+    }
+}
+
+TEST_CASE("Value sizes and ranges can be read without reading the whole value") {
+    Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+    table.set_payload_codec(PayloadCodec::LZ);
+    auto key_span = [](uint64_t &key) { return std::span<std::byte>{reinterpret_cast<std::byte *>(&key), 8}; };
+
+    // Inline, raw, compressed and streamed values
+    std::vector<size_t> sizes{4, 100, 65536};
+    for (uint64_t key = 0; key < sizes.size() * 2; ++key) {
+        std::vector<uint8_t> value(sizes[key / 2]);
+        for (size_t i = 0; i < value.size(); ++i) {
+            value[i] = key % 2 == 0 ? i % 7 : (i * 0x9E3779B97F4A7C15ULL) >> 56;
+        }
+        table.insert(key_span(key), std::as_bytes(std::span(value)));
+
+        CHECK(table.value_size(key_span(key)) == value.size());
+
+        std::vector<uint8_t> slice(value.size());
+        for (size_t offset : {0ul, 1ul, value.size() / 2, value.size() - 1, value.size()}) {
+            std::fill(slice.begin(), slice.end(), 0xFF);
+            CHECK(table.lookup_range(key_span(key), offset, 5000, slice.data()) == std::min(5000ul, value.size() - offset));
+            CHECK(std::equal(slice.begin(), slice.begin() + std::min(5000ul, value.size() - offset), value.begin() + offset));
+        }
+    }
+
+    uint64_t missing = 1000;
+    CHECK(!table.value_size(key_span(missing)));
+    CHECK(!table.lookup_range(key_span(missing), 0, 8, nullptr));
+}
+
+TEST_CASE("Pinned value views stay intact while their chunk is cleaned") {
+    Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+    table.set_payload_watermarks(2, 62);
+    auto key_span = [](uint64_t &key) { return std::span<std::byte>{reinterpret_cast<std::byte *>(&key), 8}; };
+
+    std::vector<uint64_t> value(512);
+    for (uint64_t key = 0; key < 20000; ++key) {
+        std::fill(value.begin(), value.end(), key);
+        table.insert(key_span(key), std::as_bytes(std::span(value)));
+    }
+
+    uint64_t viewed_key = 42;
+    auto view = table.lookup_view(key_span(viewed_key));
+    REQUIRE(view);
+    CHECK(view->value().size() == 4096);
+
+    // Overwriting every key lets the cleaning free the chunk the view points into
+    for (uint64_t round = 1; round <= 100; ++round) {
+        for (uint64_t key = 0; key < 20000; ++key) {
+            std::fill(value.begin(), value.end(), key + round * 20000);
+            table.insert(key_span(key), std::as_bytes(std::span(value)));
+        }
+    }
+    auto viewed = reinterpret_cast<const uint64_t *>(view->value().data());
+    CHECK(std::all_of(viewed, viewed + 512, [&](uint64_t v) { return v == viewed_key; }));
+    view.reset();
+
+    auto current = table.lookup_view(key_span(viewed_key));
+    REQUIRE(current);
+    CHECK(*reinterpret_cast<const uint64_t *>(current->value().data()) == viewed_key + 100 * 20000);
+
+    uint64_t missing = 20000;
+    CHECK(!table.lookup_view(key_span(missing)));
+}
+
+TEST_CASE("A value view held across a full cleaning cycle doesn't stall inserts") {
+    Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+    table.set_payload_watermarks(2, 62);
+    auto key_span = [](uint64_t &key) { return std::span<std::byte>{reinterpret_cast<std::byte *>(&key), 8}; };
+
+    // All keys go to the payload log of the viewed one
+    uint64_t viewed_key = 42;
+    uint64_t viewed_log = table.payload_log_of(key_span(viewed_key));
+    std::vector<uint64_t> keys;
+    for (uint64_t key = 0; keys.size() < 1000; ++key) {
+        if (table.payload_log_of(key_span(key)) == viewed_log) {
+            keys.push_back(key);
+        }
+    }
+
+    std::vector<uint64_t> value(512);
+    for (uint64_t key : keys) {
+        std::fill(value.begin(), value.end(), key);
+        table.insert(key_span(key), std::as_bytes(std::span(value)));
+    }
+    auto view = table.lookup_view(key_span(viewed_key));
+    REQUIRE(view);
+
+    // 4 GiB of overwrites pass through all 64 chunks of 50 MiB of the view's log, only the view's chunk stays pinned
+    for (uint64_t round = 1; round <= 1000; ++round) {
+        for (uint64_t key : keys) {
+            std::fill(value.begin(), value.end(), key + round);
+            table.insert(key_span(key), std::as_bytes(std::span(value)));
+        }
+    }
+    auto viewed = reinterpret_cast<const uint64_t *>(view->value().data());
+    CHECK(std::all_of(viewed, viewed + 512, [&](uint64_t v) { return v == viewed_key; }));
+    view.reset();
+
+    for (uint64_t key : keys) {
+        auto current = table.lookup_view(key_span(key));
+        REQUIRE(current);
+        CHECK(*reinterpret_cast<const uint64_t *>(current->value().data()) == key + 1000);
+    }
+}
+
+TEST_CASE("Recovery replays the newest values with any number of threads") {
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        for (uint64_t round = 0; round < 3; ++round) {
+            for (uint64_t key = 0; key < 1e6; ++key) {
+                table.insert(key, key + round);
+            }
+        }
+        for (uint64_t key = 0; key < 1e6; key += 7) {
+            table.remove(key);
+        }
+    }
+
+    for (int threads : {1, 3, 64}) {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false, threads);
+        for (uint64_t key = 0; key < 1e6; ++key) {
+            uint64_t value;
+            if (key % 7 == 0) {
+                CHECK(!table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+            } else {
+                REQUIRE(table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+                CHECK(value == key + 2);
+            }
+        }
+    }
+}
+
+TEST_CASE("Recovery finds all entries up to the logs' high-water marks") {
+    // Enough entries per log to raise the marks a few times, but too few to migrate them out of DRAM
+    constexpr long num_keys = 64 * 4 * 1024;
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        Multithreader<uint64_t, uint64_t, PartitionType::Hash> multithreader;
+        multithreader.insert(table, 16, 0, num_keys);
+    }
+
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+    Multithreader<uint64_t, uint64_t, PartitionType::Hash> multithreader;
+    multithreader.lookup(table, 16, 0, num_keys);
+}
+
+TEST_CASE("Log entries are replayed when a table is reopened") {
+    constexpr uint64_t num_keys = 1e6;
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        for (uint64_t round = 0; round < 3; ++round) {
+            for (uint64_t key = 0; key < num_keys; ++key) {
+                table.insert(key, key + round);
+            }
+        }
+        for (uint64_t key = 0; key < num_keys; key += 5) {
+            table.remove(key);
+        }
+        CHECK(table.replayable_log_bytes() > 0);
+    }
+
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+        for (uint64_t key = 0; key < num_keys; ++key) {
+            uint64_t value;
+            if (key % 5 == 0) {
+                CHECK_FALSE(table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+            } else {
+                REQUIRE(table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+                CHECK(value == key + 2);
+            }
+        }
+    }
+
+    // Tables without a log format version hold entries of the older, unpacked format
+    int fd = open("/mnt/pmem0/vogel/tabletest/metadata.dat", O_RDWR);
+    REQUIRE(fd >= 0);
+    int unrecorded = 0;
+    REQUIRE(pwrite(fd, &unrecorded, sizeof(unrecorded), 36) == sizeof(unrecorded));
+    close(fd);
+    CHECK_THROWS_AS((Hashtable<uint64_t, uint64_t, PartitionType::Hash>("/mnt/pmem0/vogel/tabletest", false)), std::runtime_error);
+}
+
+TEST_CASE("Tables created before the high-water marks were persisted recover all log entries") {
+    constexpr long num_keys = 64 * 4 * 1024;
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        Multithreader<uint64_t, uint64_t, PartitionType::Hash> multithreader;
+        multithreader.insert(table, 16, 0, num_keys);
+    }
+
+    // Older tables had zeroed padding where the marks of the 6 chunks of each log are, and log format version 1
+    int unrecorded[6] = {0, 0, 0, 0, 0, 0};
+    for (int i = 0; i < 64; ++i) {
+        int fd = open(("/mnt/pmem0/vogel/tabletest/log" + std::to_string(i)).c_str(), O_RDWR);
+        REQUIRE(fd >= 0);
+        REQUIRE(pwrite(fd, unrecorded, sizeof(unrecorded), 64) == sizeof(unrecorded));
+        close(fd);
+    }
+    int fd = open("/mnt/pmem0/vogel/tabletest/metadata.dat", O_RDWR);
+    REQUIRE(fd >= 0);
+    int version = 1;
+    REQUIRE(pwrite(fd, &version, sizeof(version), 36) == sizeof(version));
+    close(fd);
+
+    for (int reopen = 0; reopen < 2; ++reopen) {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+        Multithreader<uint64_t, uint64_t, PartitionType::Hash> multithreader;
+        multithreader.lookup(table, 16, 0, num_keys);
+    }
+}
+
+TEST_CASE("On-demand recovery serves requests while the logs are replayed") {
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        for (uint64_t round = 0; round < 3; ++round) {
+            for (uint64_t key = 0; key < 1e6; ++key) {
+                table.insert(key, key + round);
+            }
+        }
+        for (uint64_t key = 0; key < 1e6; key += 7) {
+            table.remove(key);
+        }
+    }
+
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false, 16, RecoveryMode::OnDemand);
+        for (uint64_t key = 0; key < 1e6; ++key) {
+            uint64_t value;
+            if (key % 7 == 0) {
+                CHECK(!table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+            } else {
+                REQUIRE(table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+                CHECK(value == key + 2);
+            }
+            if (key % 3 == 0) {
+                table.insert(key, key + 3);
+            }
+        }
+        table.wait_for_recovery();
+        CHECK(table.recovery_progress() == 1);
+    }
+
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+    for (uint64_t key = 0; key < 1e6; ++key) {
+        uint64_t value;
+        if (key % 3 == 0) {
+            REQUIRE(table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+            CHECK(value == key + 3);
+        } else if (key % 7 == 0) {
+            CHECK(!table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+        } else {
+            REQUIRE(table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+            CHECK(value == key + 2);
+        }
+    }
+}
+
+TEST_CASE("Cleanly closed tables find all keys with the filters they saved") {
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        for (uint64_t key = 0; key < 1e6; ++key) {
+            table.insert(key, key);
+        }
+        table.checkpoint(16);
+    }
+
+    for (uint64_t round = 1; round < 3; ++round) {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+        for (uint64_t key = 0; key < 1e6; ++key) {
+            uint64_t value;
+            REQUIRE(table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+            CHECK(value == (key % 2 == 0 ? key + round - 1 : key));
+        }
+        for (uint64_t key = 0; key < 1e6; key += 2) {
+            table.insert(key, key + round);
+        }
+        table.checkpoint(16);
+    }
+}
+
+TEST_CASE("The background checkpointer bounds the log bytes a restart replays") {
+    constexpr size_t max_replay_bytes = 1024 * 1024;
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        for (uint64_t key = 0; key < 1e6; ++key) {
+            table.insert(key, key);
+        }
+        CHECK(table.replayable_log_bytes() > max_replay_bytes);
+
+        table.set_max_replay_bytes(max_replay_bytes);
+        for (int i = 0; i < 100 && table.replayable_log_bytes() > max_replay_bytes; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        CHECK(table.replayable_log_bytes() <= max_replay_bytes);
+        CHECK(table.stats().checkpointer_migrations > 0);
+
+        table.set_max_replay_bytes(0);
+        for (uint64_t key = 0; key < 1e6; key += 2) {
+            table.insert(key, key + 1);
+        }
+        table.checkpoint_async(3).get();
+        CHECK(table.replayable_log_bytes() == 0);
+    }
+
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", false);
+    for (uint64_t key = 0; key < 1e6; ++key) {
+        uint64_t value;
+        REQUIRE(table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+        CHECK(value == (key % 2 == 0 ? key + 1 : key));
+    }
+}
+
+TEST_CASE("Partitioned scans return every live key once with its newest value") {
+    constexpr int partitions = 4;
+    {
+        Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+        for (uint64_t key = 0; key < 1e6; ++key) {
+            table.insert(key, key);
+        }
+        for (uint64_t key = 0; key < 1e6; key += 2) {
+            table.insert(key, key + 1);
+        }
+        for (uint64_t key = 0; key < 1e6; key += 3) {
+            table.remove(key);
+        }
+
+        std::vector<std::vector<std::pair<uint64_t, uint64_t>>> results(partitions);
+        std::vector<std::thread> threads;
+        for (int partition = 0; partition < partitions; ++partition) {
+            threads.emplace_back([&, partition] {
+                table.scan_partition(partition, partitions, [&](uint64_t key, std::span<const std::byte> value) {
+                    REQUIRE(value.size() == sizeof(uint64_t));
+                    results[partition].emplace_back(key, *reinterpret_cast<const uint64_t *>(value.data()));
+                });
+            });
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+
+        std::vector<int> seen(1e6);
+        for (auto &partition : results) {
+            for (auto [key, value] : partition) {
+                REQUIRE(key < 1e6);
+                ++seen[key];
+                CHECK(value == (key % 2 == 0 ? key + 1 : key));
+            }
+        }
+        for (uint64_t key = 0; key < 1e6; ++key) {
+            CHECK(seen[key] == (key % 3 == 0 ? 0 : 1));
+        }
+    }
+
+    Hashtable<std::span<const std::byte>, std::span<const std::byte>, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+    auto key_span = [](uint64_t &key) { return std::span<std::byte>{reinterpret_cast<std::byte *>(&key), 8}; };
+    // Every fourth key gets a value that is small enough to be kept inline, odd keys are overwritten
+    for (uint64_t key = 0; key < 200000; ++key) {
+        std::vector<uint64_t> value(12, key);
+        auto bytes = std::as_bytes(std::span(value));
+        table.insert(key_span(key), key % 4 == 0 ? bytes.first(4) : bytes);
+    }
+    for (uint64_t key = 1; key < 200000; key += 2) {
+        std::vector<uint64_t> value(12, key + 1);
+        table.insert(key_span(key), std::as_bytes(std::span(value)));
+    }
+    for (uint64_t key = 0; key < 200000; key += 5) {
+        table.remove(key_span(key));
+    }
+
+    std::vector<int> seen(200000);
+    for (int partition = 0; partition < partitions; ++partition) {
+        table.scan_partition(partition, partitions, [&](std::span<const std::byte> key_bytes, std::span<const std::byte> value) {
+            REQUIRE(key_bytes.size() == 8);
+            uint64_t key;
+            memcpy(&key, key_bytes.data(), 8);
+            REQUIRE(key < 200000);
+            ++seen[key];
+            if (key % 4 == 0) {
+                CHECK(value.size() == 4);
+                CHECK(memcmp(value.data(), &key, 4) == 0);
+            } else {
+                CHECK(value.size() == 96);
+                CHECK(*reinterpret_cast<const uint64_t *>(value.data()) == (key % 2 == 0 ? key : key + 1));
+            }
+        });
+    }
+    for (uint64_t key = 0; key < 200000; ++key) {
+        CHECK(seen[key] == (key % 5 == 0 ? 0 : 1));
+    }
+}
+
+TEST_CASE("Scan visitors can update the records they visit") {
+    Hashtable<uint64_t, uint64_t, PartitionType::Hash> table("/mnt/pmem0/vogel/tabletest", true);
+    for (uint64_t key = 0; key < 1e5; ++key) {
+        table.insert(key, key);
+    }
+
+    // The visited directory entry is unlocked again when the visitor runs
+    table.scan_partition(0, 1, [&](uint64_t key, std::span<const std::byte> value) {
+        table.insert(key, *reinterpret_cast<const uint64_t *>(value.data()) + 1);
+    });
+
+    for (uint64_t key = 0; key < 1e5; ++key) {
+        uint64_t value;
+        REQUIRE(table.lookup(key, reinterpret_cast<uint8_t *>(&value)));
+        CHECK(value == key + 1);
+    }
+}